@@ -109,4 +109,26 @@ atomic_add(volatile int *ptr, int val)
 #error Missing atomic ops
 #endif
 
+
+/**
+ * Atomically set *ptr to 'nv' if it is still 'ov'.
+ * Returns non-zero if the swap was done
+ */
+static inline int
+atomic_cas(volatile unsigned int *ptr, unsigned int ov, unsigned int nv)
+{
+  return __sync_bool_compare_and_swap(ptr, ov, nv);
+}
+
+
+/**
+ * Atomically set *ptr to 'nv' if it is still 'ov'.
+ * Returns non-zero if the swap was done
+ */
+static inline int
+atomic_cas_ptr(void * volatile *ptr, void *ov, void *nv)
+{
+  return __sync_bool_compare_and_swap(ptr, ov, nv);
+}
+
 #endif /* HTSATOMIC_H__ */
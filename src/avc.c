@@ -19,25 +19,60 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdint.h>
+#include <string.h>
 #include "avc.h"
 
+/**
+ * Find the next 00 00 01 start code. Four bytes are checked at a time
+ * and only words that contain a zero byte are looked at closer, so
+ * for slice data (where zeroes are rare) this is mostly one compare
+ * per word.
+ */
 static const uint8_t *
-avc_find_startcode(const uint8_t *p, const uint8_t *end)
+avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
 {
-  int i;
-	
-  uint32_t sc=0xFFFFFFFF;
-  size_t len = (end -p)+1;
-  for (i=0;i<len;i++)
-    {
-      sc = (sc <<8) | p[i];
-      if((sc & 0xffffff00) == 0x00000100) {
-	return p+i-3;
+  const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+  uint32_t x;
+
+  for(end -= 3; p < a && p < end; p++)
+    if(p[0] == 0 && p[1] == 0 && p[2] == 1)
+      return p;
+
+  for(end -= 3; p < end; p += 4) {
+    memcpy(&x, p, 4);
+    if((x - 0x01010101) & (~x) & 0x80808080) { // Has a zero byte
+      if(p[1] == 0) {
+	if(p[0] == 0 && p[2] == 1)
+	  return p;
+	if(p[2] == 0 && p[3] == 1)
+	  return p + 1;
+      }
+      if(p[3] == 0) {
+	if(p[2] == 0 && p[4] == 1)
+	  return p + 2;
+	if(p[4] == 0 && p[5] == 1)
+	  return p + 3;
       }
-		
     }
-  return end;
+  }
+
+  for(end += 3; p < end; p++)
+    if(p[0] == 0 && p[1] == 0 && p[2] == 1)
+      return p;
+
+  return end + 3;
+}
+
+static const uint8_t *
+avc_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+  const uint8_t *out = avc_find_startcode_internal(p, end);
+  if(p < out && out < end && !out[-1]) // Four byte start code
+    out--;
+  return out;
 }
+
 static int
 avc_parse_nal_units(sbuf_t *sb, const uint8_t *buf_in, int size)
 {
@@ -47,10 +82,17 @@ avc_parse_nal_units(sbuf_t *sb, const uint8_t *buf_in, int size)
 
   //printf("CONVERT SIZE %d\n", size);
 
+  /* Length prefixes are at most one byte per NAL larger than the
+     start codes they replace, so this is normally the only alloc */
+  if(sb->sb_data == NULL) {
+    sb->sb_size = size + 64;
+    sb->sb_data = malloc(sb->sb_size);
+  }
+
   size = 0;
   nal_start = avc_find_startcode(p, end);
   while (nal_start < end) {
-    while(!*(nal_start++));
+    while(nal_start < end && !*(nal_start++));
     nal_end = avc_find_startcode(nal_start, end);
     /*printf("%4d bytes  %5d : %d\n", nal_end - nal_start,
       nal_start - buf_in,
@@ -177,17 +219,24 @@ isom_write_avcc(sbuf_t *sb, const uint8_t *data, int len)
 
 
 
+/**
+ * Convert an Annex B packet to AVCC (length prefixed NALs).
+ *
+ * The result is memoized on 'src' so a packet shared by several
+ * consumers is only converted once. The reference to 'src' is consumed.
+ */
 th_pkt_t *
 avc_convert_pkt(th_pkt_t *src)
 {
-  th_pkt_t *pkt = malloc(sizeof(th_pkt_t));
-  *pkt = *src;
-  pkt->pkt_refcount = 1;
-  pkt->pkt_header = NULL;
-  pkt->pkt_payload = NULL;
-
-  pkt->pkt_payload = malloc(sizeof(pktbuf_t));
-  pkt->pkt_payload->pb_refcount=1;
+  th_pkt_t *pkt;
+
+  if((pkt = pkt_memo_get(&src->pkt_avcc)) != NULL) {
+    pkt_ref_dec(src);
+    return pkt;
+  }
+
+  pkt = pkt_copy_nodata(src);
+
   if (src->pkt_header) {
     sbuf_t headers;
     sbuf_init(&headers);
@@ -208,6 +257,7 @@ avc_convert_pkt(th_pkt_t *src)
 		      pktbuf_len(src->pkt_payload));
   
   pkt->pkt_payload = pktbuf_make(payload.sb_data, payload.sb_ptr);
+  pkt = pkt_memo_set(&src->pkt_avcc, pkt);
   pkt_ref_dec(src);
   return pkt;
 }
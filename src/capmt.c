@@ -39,7 +39,7 @@
 #include "tcp.h"
 #include "psi.h"
 #include "tsdemux.h"
-#include "ffdecsa/FFdecsa.h"
+#include "tvcsa.h"
 #include "capmt.h"
 #include "notify.h"
 #include "subscriptions.h"
@@ -132,7 +132,7 @@ typedef struct capmt_service {
   struct capmt_caid_ecm_list ct_caid_ecm;
 
   /**
-   * Status of the key(s) in ct_keys
+   * Status of the key(s) in ct_csa
    */
   enum {
     CT_UNKNOWN,
@@ -140,13 +140,8 @@ typedef struct capmt_service {
     CT_FORBIDDEN
   } ct_keystate;
 
-  /* buffer for keystruct */
-  void    *ct_keys;
-
   /* CSA */
-  int      ct_cluster_size;
-  uint8_t *ct_tsbcluster;
-  int      ct_fill;
+  tvcsa_t  ct_csa;
 
   /* current sequence number */
   uint16_t ct_seq;
@@ -257,8 +252,7 @@ capmt_service_destroy(th_descrambler_t *td)
 
   LIST_REMOVE(ct, ct_link);
 
-  free_key_struct(ct->ct_keys);
-  free(ct->ct_tsbcluster);
+  tvcsa_destroy(&ct->ct_csa, ct->ct_service, "capmt");
   free(ct);
 }
 
@@ -268,9 +262,8 @@ handle_ca0(capmt_t* capmt) {
   service_t *t;
   int ret;
 
-  uint8_t invalid[8], buffer[20], *even, *odd;
+  uint8_t buffer[20], *even, *odd;
   uint16_t seq;
-  memset(invalid, 0, 8);
 
   tvhlog(LOG_INFO, "capmt", "got connection from client ...");
 
@@ -307,10 +300,7 @@ handle_ca0(capmt_t* capmt) {
       if(seq != ct->ct_seq)
         continue;
 
-      if (memcmp(even, invalid, 8))
-        set_even_control_word(ct->ct_keys, even);
-      if (memcmp(odd, invalid, 8))
-        set_odd_control_word(ct->ct_keys, odd);
+      tvcsa_set_control_words(&ct->ct_csa, even, odd);
 
       if(ct->ct_keystate != CT_RESOLVED)
         tvhlog(LOG_INFO, "capmt", "Obtained key for service \"%s\"",t->s_svcname);
@@ -558,9 +548,6 @@ capmt_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *s
      const uint8_t *tsb)
 {
   capmt_service_t *ct = (capmt_service_t *)td;
-  int r, i;
-  unsigned char *vec[3];
-  uint8_t *t0;
 
   if(ct->ct_keystate == CT_FORBIDDEN)
     return 1;
@@ -568,28 +555,7 @@ capmt_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *s
   if(ct->ct_keystate != CT_RESOLVED)
     return -1;
 
-  memcpy(ct->ct_tsbcluster + ct->ct_fill * 188, tsb, 188);
-  ct->ct_fill++;
-
-  if(ct->ct_fill != ct->ct_cluster_size)
-    return 0;
-
-  ct->ct_fill = 0;
-
-  vec[0] = ct->ct_tsbcluster;
-  vec[1] = ct->ct_tsbcluster + ct->ct_cluster_size * 188;
-  vec[2] = NULL;
-
-  while(1) {
-    t0 = vec[0];
-    r = decrypt_packets(ct->ct_keys, vec);
-    if(r == 0)
-      break;
-    for(i = 0; i < r; i++) {
-      ts_recv_packet2(t, t0);
-      t0 += 188;
-    }
-  }
+  tvcsa_descramble(&ct->ct_csa, t, tsb);
   return 0;
 }
 
@@ -618,8 +584,7 @@ capmt_service_start(service_t *t)
 
     /* create new capmt service */
     ct                  = calloc(1, sizeof(capmt_service_t));
-    ct->ct_cluster_size = get_suggested_cluster_size();
-    ct->ct_tsbcluster   = malloc(ct->ct_cluster_size * 188);
+    tvcsa_init(&ct->ct_csa);
     ct->ct_seq          = capmt->capmt_seq++;
 
     TAILQ_FOREACH(st, &t->s_components, es_link) {
@@ -640,7 +605,6 @@ capmt_service_start(service_t *t)
       ct->ct_caid_last = -1;
     }
 
-    ct->ct_keys       = get_key_struct();
     ct->ct_capmt      = capmt;
     ct->ct_service  = t;
 
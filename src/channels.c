@@ -39,6 +39,7 @@
 #include "notify.h"
 #include "dvr/dvr.h"
 #include "htsp.h"
+#include "upnp/tv_upnp_browse.h"
 
 struct channel_list channels_not_xmltv_mapped;
 
@@ -193,6 +194,7 @@ channel_create(const char *name, int number)
   }
 
   htsp_channel_add(ch);
+  tv_upnp_browse_channel_update(ch);
   return ch;
 }
 
@@ -366,6 +368,7 @@ channel_rename(channel_t *ch, const char *newname)
 
   channel_save(ch);
   htsp_channel_update(ch);
+  tv_upnp_browse_channel_update(ch);
   return 0;
 }
 
@@ -404,6 +407,7 @@ channel_delete(channel_t *ch)
   hts_settings_remove("channels/%d", ch->ch_id);
 
   htsp_channel_delete(ch);
+  tv_upnp_browse_channel_delete(ch);
 
   RB_REMOVE(&channel_name_tree, ch, ch_name_link);
   RB_REMOVE(&channel_identifier_tree, ch, ch_identifier_link);
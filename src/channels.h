@@ -63,6 +63,11 @@ typedef struct channel {
 
   struct channel_tag_mapping_list ch_ctms;
 
+  /* HTSP change sequence numbers, see htsp.c */
+  uint32_t ch_htsp_created;
+  uint32_t ch_htsp_seq;
+  uint32_t ch_htsp_epg_seq;
+
 } channel_t;
 
 
@@ -81,6 +86,10 @@ typedef struct channel_tag {
   struct channel_tag_mapping_list ct_ctms;
 
   struct dvr_autorec_entry_list ct_autorecs;
+
+  /* HTSP change sequence numbers, see htsp.c */
+  uint32_t ct_htsp_created;
+  uint32_t ct_htsp_seq;
 } channel_tag_t;
 
 
@@ -32,7 +32,7 @@
 #include "tcp.h"
 #include "psi.h"
 #include "tsdemux.h"
-#include "ffdecsa/FFdecsa.h"
+#include "tvcsa.h"
 #include "cwc.h"
 #include "notify.h"
 #include "atomic.h"
@@ -110,13 +110,60 @@ typedef struct ecm_section {
   uint16_t es_seq;
   char es_nok;
   char es_pending;
+  char es_coalesced; // waiting for a request sent by some other section
   int64_t es_time;  // time request was sent
   size_t es_ecmsize;
   uint8_t es_ecm[4070];
 
+  /* Key in the ECM cache, see ecm_cache_entry_t */
+  uint16_t es_caid;
+  uint32_t es_providerid;
+  uint32_t es_crc;
+
 } ecm_section_t;
 
 
+/**
+ * Process wide ECM -> control word cache
+ *
+ * Services sharing an ECM PID, or the same channel tuned on several
+ * adapters, all see identical ECMs. Only the first one is sent to the
+ * card server, the others wait for the same reply which is fanned out
+ * to every waiting section. Resolved ECMs are kept for ECM_CACHE_TTL
+ * seconds so a newly started service can get its keys right away.
+ *
+ * Protected by ecm_cache_mutex, which must never be held while
+ * acquiring any other lock except cwc_writer_mutex.
+ */
+#define ECM_CACHE_HASH_SIZE     256
+#define ECM_CACHE_TTL           10     /* seconds */
+#define ECM_CACHE_PENDING_TTL   5      /* seconds */
+
+LIST_HEAD(ecm_cache_entry_list, ecm_cache_entry);
+
+typedef struct ecm_cache_entry {
+  LIST_ENTRY(ecm_cache_entry) ece_link;
+
+  uint16_t ece_caid;
+  uint32_t ece_providerid;
+  uint32_t ece_crc;
+  size_t ece_ecmsize;
+  uint8_t *ece_ecm;     /* Compared as well, the CRC may collide */
+
+  struct cwc *ece_cwc;  /* Server the request was sent to */
+  uint16_t ece_seq;
+
+  int ece_resolved;
+  int64_t ece_time;     /* time request was sent or reply received */
+  uint8_t ece_cw[16];
+
+} ecm_cache_entry_t;
+
+static pthread_mutex_t ecm_cache_mutex;
+static struct ecm_cache_entry_list ecm_cache[ECM_CACHE_HASH_SIZE];
+static int ecm_cache_hits, ecm_cache_coalesced, ecm_cache_sent;
+
+
 /**
  *
  */
@@ -145,7 +192,7 @@ typedef struct cwc_service {
   int cs_okchannel;
 
   /**
-   * Status of the key(s) in cs_keys
+   * Status of the key(s) in cs_csa
    */
   enum {
     CS_UNKNOWN,
@@ -153,18 +200,10 @@ typedef struct cwc_service {
     CS_FORBIDDEN
   } cs_keystate;
 
-  void *cs_keys;
-
-
-  uint8_t cs_cw[16];
-  int cs_pending_cw_update;
-
   /**
    * CSA
    */
-  int cs_cluster_size;
-  uint8_t *cs_tsbcluster;
-  int cs_fill;
+  tvcsa_t cs_csa;
 
   LIST_HEAD(, ecm_pid) cs_pids;
 
@@ -720,6 +759,116 @@ cwc_send_login(cwc_t *cwc)
 
 
 
+/**
+ * ecm_cache_mutex is held
+ */
+static int
+ecm_cache_expired(ecm_cache_entry_t *ece, int64_t now)
+{
+  int ttl = ece->ece_resolved ? ECM_CACHE_TTL : ECM_CACHE_PENDING_TTL;
+  return now - ece->ece_time > ttl * 1000000LL;
+}
+
+
+/**
+ * ecm_cache_mutex is held
+ */
+static void
+ecm_cache_remove(ecm_cache_entry_t *ece)
+{
+  LIST_REMOVE(ece, ece_link);
+  free(ece->ece_ecm);
+  free(ece);
+}
+
+
+/**
+ * Find a non-expired entry for the ECM 'data' of the section's key,
+ * expired entries in the same bucket are dropped on the way
+ *
+ * ecm_cache_mutex is held
+ */
+static ecm_cache_entry_t *
+ecm_cache_find(ecm_section_t *es, const uint8_t *data, int64_t now)
+{
+  ecm_cache_entry_t *ece, *next;
+  struct ecm_cache_entry_list *head =
+    &ecm_cache[es->es_crc & (ECM_CACHE_HASH_SIZE - 1)];
+
+  for(ece = LIST_FIRST(head); ece != NULL; ece = next) {
+    next = LIST_NEXT(ece, ece_link);
+
+    if(ecm_cache_expired(ece, now)) {
+      ecm_cache_remove(ece);
+      continue;
+    }
+
+    if(ece->ece_crc        == es->es_crc &&
+       ece->ece_caid       == es->es_caid &&
+       ece->ece_providerid == es->es_providerid &&
+       ece->ece_ecmsize    == es->es_ecmsize &&
+       !memcmp(ece->ece_ecm, data, es->es_ecmsize))
+      return ece;
+  }
+  return NULL;
+}
+
+
+/**
+ * Find the pending request sent to 'cwc' with sequence number 'seq'
+ *
+ * ecm_cache_mutex is held
+ */
+static ecm_cache_entry_t *
+ecm_cache_find_pending(cwc_t *cwc, uint16_t seq)
+{
+  ecm_cache_entry_t *ece;
+  int i;
+
+  for(i = 0; i < ECM_CACHE_HASH_SIZE; i++)
+    LIST_FOREACH(ece, &ecm_cache[i], ece_link)
+      if(!ece->ece_resolved && ece->ece_cwc == cwc && ece->ece_seq == seq)
+	return ece;
+  return NULL;
+}
+
+
+/**
+ * Drop all requests pending on 'cwc', the replies will never arrive
+ */
+static void
+ecm_cache_flush(cwc_t *cwc)
+{
+  ecm_cache_entry_t *ece, *next;
+  int i;
+
+  pthread_mutex_lock(&ecm_cache_mutex);
+  for(i = 0; i < ECM_CACHE_HASH_SIZE; i++) {
+    for(ece = LIST_FIRST(&ecm_cache[i]); ece != NULL; ece = next) {
+      next = LIST_NEXT(ece, ece_link);
+      if(!ece->ece_resolved && ece->ece_cwc == cwc)
+	ecm_cache_remove(ece);
+    }
+  }
+  pthread_mutex_unlock(&ecm_cache_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+ecm_section_match(ecm_section_t *a, ecm_section_t *b)
+{
+  return a->es_crc == b->es_crc && a->es_caid == b->es_caid &&
+    a->es_providerid == b->es_providerid && a->es_ecmsize == b->es_ecmsize &&
+    !memcmp(a->es_ecm, b->es_ecm, a->es_ecmsize);
+}
+
+
+/**
+ * s_stream_mutex of the service is held
+ */
 static void
 handle_ecm_reply(cwc_service_t *ct, ecm_section_t *es, uint8_t *msg,
 		 int len, int seq)
@@ -786,28 +935,30 @@ handle_ecm_reply(cwc_service_t *ct, ecm_section_t *es, uint8_t *msg,
     
     if(ct->cs_keystate != CS_RESOLVED)
       tvhlog(LOG_INFO, "cwc",
-	     "Obtained key for for service \"%s\" in %lld ms, from %s",
+	     "Obtained key for service \"%s\" in %lld ms, from %s",
 	     t->s_svcname, delay, ct->cs_cwc->cwc_hostname);
     
     ct->cs_keystate = CS_RESOLVED;
-    memcpy(ct->cs_cw, msg + 3, 16);
-    ct->cs_pending_cw_update = 1;
+    tvcsa_set_control_words(&ct->cs_csa, msg + 3, msg + 3 + 8);
   }
 }
 
 
 /**
  * Handle running reply
- * cwc_mutex is held
+ * cwc_mutex is held, the s_stream_mutex of each service is taken
+ * while its control words are updated
  */
 static int
 cwc_running_reply(cwc_t *cwc, uint8_t msgtype, uint8_t *msg, int len)
 {
+  cwc_t *cwc2;
   cwc_service_t *ct;
   ecm_pid_t *ep;
-  ecm_section_t *es;
+  ecm_section_t *es, *req = NULL;
+  ecm_cache_entry_t *ece;
   uint16_t seq = (msg[2] << 8) | msg[3];
-  int i;
+  int i, waiters = 0;
 
   len -= 12;
   msg += 12;
@@ -815,20 +966,78 @@ cwc_running_reply(cwc_t *cwc, uint8_t msgtype, uint8_t *msg, int len)
   switch(msgtype) {
   case 0x80:
   case 0x81:
+    /* Find the section that sent the request */
     LIST_FOREACH(ct, &cwc->cwc_services, cs_link) {
       LIST_FOREACH(ep, &ct->cs_pids, ep_link) {
 	for(i = 0; i <= ep->ep_last_section; i++) {
 	  es = ep->ep_sections[i];
-	  if(es != NULL) {
-	    if(es->es_seq == seq && es->es_pending) {
+	  if(es != NULL && es->es_seq == seq && es->es_pending &&
+	     !es->es_coalesced) {
+	    req = es;
+	    break;
+	  }
+	}
+	if(req != NULL)
+	  break;
+      }
+      if(req != NULL)
+	break;
+    }
+
+    pthread_mutex_lock(&ecm_cache_mutex);
+    ece = ecm_cache_find_pending(cwc, seq);
+    if(ece != NULL) {
+      if(len < 19) {
+	ecm_cache_remove(ece);
+      } else {
+	ece->ece_resolved = 1;
+	ece->ece_time = getmonoclock();
+	memcpy(ece->ece_cw, msg + 3, 16);
+      }
+    }
+    pthread_mutex_unlock(&ecm_cache_mutex);
+
+    if(req == NULL) {
+      tvhlog(LOG_WARNING, "cwc", "Got unexpected ECM reply (seqno: %d)", seq);
+      break;
+    }
+
+    pthread_mutex_lock(&ct->cs_service->s_stream_mutex);
+    handle_ecm_reply(ct, req, msg, len, seq);
+    pthread_mutex_unlock(&ct->cs_service->s_stream_mutex);
+
+    if(ece == NULL)
+      break;
+
+    /* Fan out to everyone waiting for the same ECM */
+    TAILQ_FOREACH(cwc2, &cwcs, cwc_link) {
+      LIST_FOREACH(ct, &cwc2->cwc_services, cs_link) {
+	LIST_FOREACH(ep, &ct->cs_pids, ep_link) {
+	  for(i = 0; i <= ep->ep_last_section; i++) {
+	    es = ep->ep_sections[i];
+	    if(es == NULL || es == req || !es->es_pending ||
+	       !ecm_section_match(es, req))
+	      continue;
+
+	    waiters++;
+	    es->es_coalesced = 0;
+	    if(len < 19) {
+	      /* Forget the ECM so it is sent on its own next time */
+	      es->es_pending = 0;
+	      es->es_ecmsize = 0;
+	    } else {
+	      pthread_mutex_lock(&ct->cs_service->s_stream_mutex);
 	      handle_ecm_reply(ct, es, msg, len, seq);
-	      return 0;
+	      pthread_mutex_unlock(&ct->cs_service->s_stream_mutex);
 	    }
 	  }
 	}
       }
     }
-    tvhlog(LOG_WARNING, "cwc", "Got unexpected ECM reply (seqno: %d)", seq);
+    if(waiters)
+      tvhlog(LOG_DEBUG, "cwc",
+	     "ECM reply (seqno: %d) delivered to %d coalesced requests",
+	     seq, waiters);
     break;
   }
   return 0;
@@ -1087,6 +1296,7 @@ cwc_thread(void *aux)
       cwc_session(cwc);
 
       cwc->cwc_fd = -1;
+      ecm_cache_flush(cwc);
       close(fd);
       cwc->cwc_caid = 0;
       cwc->cwc_connected = 0;
@@ -1484,8 +1694,11 @@ cwc_table_input(struct th_descrambler *td, struct service *t,
   int section;
   ecm_pid_t *ep;
   ecm_section_t *es;
+  ecm_cache_entry_t *ece;
   char chaninfo[32];
   caid_t *c;
+  int64_t now;
+  int waiting;
 
   if(len > 4096)
     return;
@@ -1538,11 +1751,56 @@ cwc_table_input(struct th_descrambler *td, struct service *t,
 
     es = ep->ep_sections[section];
 
-    if(es->es_ecmsize == len && !memcmp(es->es_ecm, data, len))
-      break; /* key already sent */
+    now = getmonoclock();
+
+    if(es->es_ecmsize == len && !memcmp(es->es_ecm, data, len)) {
+      if(!es->es_coalesced)
+	break; /* key already sent */
+
+      /* Waiting for some other section's request. If that has expired
+	 or was dropped with its server the reply will never come, so
+	 handle the ECM as new */
+      pthread_mutex_lock(&ecm_cache_mutex);
+      ece = ecm_cache_find(es, data, now);
+      waiting = ece != NULL && !ece->ece_resolved;
+      pthread_mutex_unlock(&ecm_cache_mutex);
+      if(waiting)
+	break;
+      es->es_coalesced = 0;
+      es->es_pending = 0;
+    }
+
+    es->es_caid = c->caid;
+    es->es_providerid = c->providerid;
+    es->es_crc = crc32((uint8_t *)data, len, 0xffffffff);
+    es->es_ecmsize = len;
+
+    pthread_mutex_lock(&ecm_cache_mutex);
+
+    ece = ecm_cache_find(es, data, now);
+    if(ece != NULL && ece->ece_resolved) {
+      /* Already answered for some other service */
+      ecm_cache_hits++;
+      memcpy(es->es_ecm, data, len);
+      es->es_channel = channel;
+      es->es_section = section;
+      es->es_pending = 0;
+      es->es_nok = 0;
+      ct->cs_okchannel = channel;
+      if(ct->cs_keystate != CS_RESOLVED)
+	tvhlog(LOG_INFO, "cwc",
+	       "Obtained key for service \"%s\" from ECM cache",
+	       t->s_svcname);
+      ct->cs_keystate = CS_RESOLVED;
+      tvcsa_set_control_words(&ct->cs_csa, ece->ece_cw, ece->ece_cw + 8);
+      pthread_mutex_unlock(&ecm_cache_mutex);
+      break;
+    }
 
     if(cwc->cwc_fd == -1) {
       // New key, but we are not connected (anymore), can not descramble
+      pthread_mutex_unlock(&ecm_cache_mutex);
+      es->es_ecmsize = 0;
       ct->cs_keystate = CS_UNKNOWN;
       break;
     }
@@ -1552,21 +1810,53 @@ cwc_table_input(struct th_descrambler *td, struct service *t,
     es->es_pending = 1;
 
     memcpy(es->es_ecm, data, len);
-    es->es_ecmsize = len;
 
     if(ct->cs_okchannel != -1 && channel != -1 && 
        ct->cs_okchannel != channel) {
+      pthread_mutex_unlock(&ecm_cache_mutex);
       tvhlog(LOG_DEBUG, "cwc", "Filtering ECM channel %d", channel);
       return;
     }
 
+    es->es_time = now;
+
+    if(ece != NULL) {
+      /* Identical request already in flight, wait for its reply */
+      ecm_cache_coalesced++;
+      es->es_coalesced = 1;
+      pthread_mutex_unlock(&ecm_cache_mutex);
+
+      tvhlog(LOG_DEBUG, "cwc",
+	     "Coalescing ECM%s section=%d/%d, for service %s "
+	     "with pending request (seqno: %d) PID %d",
+	     chaninfo, section, ep->ep_last_section, t->s_svcname,
+	     ece->ece_seq, st->es_pid);
+      break;
+    }
+
+    es->es_coalesced = 0;
     es->es_seq = cwc_send_msg(cwc, data, len, sid, 1);
 
+    ece = calloc(1, sizeof(ecm_cache_entry_t));
+    ece->ece_caid = es->es_caid;
+    ece->ece_providerid = es->es_providerid;
+    ece->ece_crc = es->es_crc;
+    ece->ece_ecmsize = len;
+    ece->ece_ecm = malloc(len);
+    memcpy(ece->ece_ecm, data, len);
+    ece->ece_cwc = cwc;
+    ece->ece_seq = es->es_seq;
+    ece->ece_time = now;
+    LIST_INSERT_HEAD(&ecm_cache[es->es_crc & (ECM_CACHE_HASH_SIZE - 1)],
+		     ece, ece_link);
+    ecm_cache_sent++;
+    pthread_mutex_unlock(&ecm_cache_mutex);
+
     tvhlog(LOG_DEBUG, "cwc", 
-	   "Sending ECM%s section=%d/%d, for service %s (seqno: %d) PID %d", 
+	   "Sending ECM%s section=%d/%d, for service %s (seqno: %d) PID %d "
+	   "(ECM cache: %d sent, %d hits, %d coalesced)",
 	   chaninfo, section, ep->ep_last_section, t->s_svcname, es->es_seq,
-	   st->es_pid);
-    es->es_time = getmonoclock();
+	   st->es_pid, ecm_cache_sent, ecm_cache_hits, ecm_cache_coalesced);
     break;
 
   default:
@@ -1651,28 +1941,6 @@ cwc_emm_nds(cwc_t *cwc, uint8_t *data, int len)
     cwc_send_msg(cwc, data, len, 0, 1);
 }
 
-/**
- *
- */
-static void
-update_keys(cwc_service_t *ct)
-{
-  int i;
-  ct->cs_pending_cw_update = 0;
-  for(i = 0; i < 8; i++)
-    if(ct->cs_cw[i]) {
-      set_even_control_word(ct->cs_keys, ct->cs_cw);
-      break;
-    }
-  
-  for(i = 0; i < 8; i++)
-    if(ct->cs_cw[8 + i]) {
-      set_odd_control_word(ct->cs_keys, ct->cs_cw + 8);
-      break;
-    }
-}
-
-
 /**
  *
  */
@@ -1681,8 +1949,6 @@ cwc_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *st,
 	       const uint8_t *tsb)
 {
   cwc_service_t *ct = (cwc_service_t *)td;
-  int r;
-  unsigned char *vec[3];
 
   if(ct->cs_keystate == CS_FORBIDDEN)
     return 1;
@@ -1690,48 +1956,7 @@ cwc_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *st,
   if(ct->cs_keystate != CS_RESOLVED)
     return -1;
 
-  if(ct->cs_fill == 0 && ct->cs_pending_cw_update)
-    update_keys(ct);
-
-  memcpy(ct->cs_tsbcluster + ct->cs_fill * 188, tsb, 188);
-  ct->cs_fill++;
-
-  if(ct->cs_fill != ct->cs_cluster_size)
-    return 0;
-
-  while(1) {
-
-    vec[0] = ct->cs_tsbcluster;
-    vec[1] = ct->cs_tsbcluster + ct->cs_fill * 188;
-    vec[2] = NULL;
-    
-    r = decrypt_packets(ct->cs_keys, vec);
-    if(r > 0) {
-      int i;
-      const uint8_t *t0 = ct->cs_tsbcluster;
-
-      for(i = 0; i < r; i++) {
-	ts_recv_packet2(t, t0);
-	t0 += 188;
-      }
-
-      r = ct->cs_fill - r;
-      assert(r >= 0);
-
-      if(r > 0)
-	memmove(ct->cs_tsbcluster, t0, r * 188);
-      ct->cs_fill = r;
-
-      if(ct->cs_pending_cw_update && r > 0)
-	continue;
-    } else {
-      ct->cs_fill = 0;
-    }
-    break;
-  }
-  if(ct->cs_pending_cw_update)
-    update_keys(ct);
-
+  tvcsa_descramble(&ct->cs_csa, t, tsb);
   return 0;
 }
 
@@ -1757,8 +1982,7 @@ cwc_service_destroy(th_descrambler_t *td)
 
   LIST_REMOVE(ct, cs_link);
 
-  free_key_struct(ct->cs_keys);
-  free(ct->cs_tsbcluster);
+  tvcsa_destroy(&ct->cs_csa, ct->cs_service, "cwc");
   free(ct);
 }
 
@@ -1802,10 +2026,7 @@ cwc_service_start(service_t *t)
       continue;
 
     ct = calloc(1, sizeof(cwc_service_t));
-    ct->cs_cluster_size = get_suggested_cluster_size();
-    ct->cs_tsbcluster = malloc(ct->cs_cluster_size * 188);
-
-    ct->cs_keys = get_key_struct();
+    tvcsa_init(&ct->cs_csa);
     ct->cs_cwc = cwc;
     ct->cs_service = t;
     ct->cs_okchannel = -1;
@@ -2110,6 +2331,7 @@ cwc_init(void)
   TAILQ_INIT(&cwcs);
   pthread_mutex_init(&cwc_mutex, NULL);
   pthread_cond_init(&cwc_config_changed, NULL);
+  pthread_mutex_init(&ecm_cache_mutex, NULL);
 
   dt = dtable_create(&cwc_dtc, "cwc", NULL);
   dtable_load(dt);
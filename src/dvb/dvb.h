@@ -91,8 +91,6 @@ typedef struct th_dvb_mux_instance {
   uint32_t tdmi_ber, tdmi_uncorrected_blocks;
 
 #define TDMI_FEC_ERR_HISTOGRAM_SIZE 10
-  uint32_t tdmi_fec_err_histogram[TDMI_FEC_ERR_HISTOGRAM_SIZE];
-  int      tdmi_fec_err_ptr;
 
   time_t tdmi_time;
 
@@ -100,6 +98,8 @@ typedef struct th_dvb_mux_instance {
   LIST_HEAD(, th_dvb_table) tdmi_tables;
   TAILQ_HEAD(, th_dvb_table) tdmi_table_queue;
   int tdmi_table_initial;
+  int tdmi_quickreq_done; /* All TDT_QUICKREQ tables received since tune */
+  time_t tdmi_tune_time;  /* Last time this mux was tuned */
 
   enum {
     TDMI_FE_UNKNOWN,
@@ -112,6 +112,7 @@ typedef struct th_dvb_mux_instance {
   } tdmi_fe_status;
 
   int tdmi_quality;
+  int tdmi_quality_dirty; /* Quality changed but not yet saved */
 
   int tdmi_enabled;
 
@@ -138,11 +139,25 @@ typedef struct th_dvb_mux_instance {
 } th_dvb_mux_instance_t;
 
 
+/**
+ * Frontend status as last read by the monitor thread
+ */
+typedef struct dvb_fe_snapshot {
+  int fs_generation;      /* tda_fe_generation the values were read for */
+  int fs_status;          /* TDMI_FE_... */
+  uint16_t fs_snr, fs_signal;
+  uint32_t fs_ber, fs_unc;
+} dvb_fe_snapshot_t;
+
+
 /**
  * DVB Adapter (one of these per physical adapter)
  */
 #define TDA_MUX_HASH_WIDTH 101
 
+#define DVB_SCAN_MIN_DWELL 5  /* Seconds an idle scan stays on a mux */
+#define DVB_SCAN_MAX_DWELL 20 /* Seconds to wait for the quick tables */
+
 typedef struct th_dvb_adapter {
 
   TAILQ_ENTRY(th_dvb_adapter) tda_global_link;
@@ -181,12 +196,31 @@ typedef struct th_dvb_adapter {
   int tda_hostconnection;
 
   gtimer_t tda_mux_scanner_timer;
+  int tda_scan_initial;  /* Current mux was tuned for initial scan */
 
   pthread_mutex_t tda_delivery_mutex;
   struct service_list tda_transports; /* Currently bound transports */
 
-  gtimer_t tda_fe_monitor_timer;
-  int tda_fe_monitor_hold;
+  /**
+   * Frontend monitor, see dvb_fe.c. The monitor thread polls the
+   * frontend without global_lock and publishes the result in
+   * tda_fe_snapshot (read with dvb_fe_snapshot_get()). Only status
+   * and quality transitions are applied to the mux under global_lock.
+   * tda_fe_generation is bumped (with global_lock held) on every tune
+   */
+  volatile int tda_fe_generation;
+  volatile int tda_fe_tuned;
+  volatile unsigned int tda_fe_seq;
+  dvb_fe_snapshot_t tda_fe_snapshot;
+  gtimer_t tda_fe_save_timer;
+
+  /**
+   * Zap time, from tuning until the first packet is received.
+   * tda_tune_start is set when tuning and cleared by the DVR thread,
+   * tda_zap_avg is a running average (ms), 0 if not known yet
+   */
+  volatile int64_t tda_tune_start;
+  int tda_zap_avg;
 
   int tda_sat; // Set if this adapter is a satellite receiver (DVB-S, etc) 
 
@@ -200,6 +234,21 @@ typedef struct th_dvb_adapter {
   int tda_allpids_dmx_fd;
   int tda_dump_fd;
 
+  /**
+   * Software section filtering, see dvb_tables.c
+   *
+   * tda_sw_sections is the setting. tda_sw_tables is set while the
+   * current mux is delivered in full on the DVR device and tables are
+   * read from there (global_lock). The PID table and section queue are
+   * protected by tda_delivery_mutex
+   */
+  uint32_t tda_sw_sections;
+  int tda_sw_tables;
+  struct dvb_sw_pid **tda_sw_pids;
+  TAILQ_HEAD(, dvb_sw_section) tda_sw_queue;
+  int tda_sw_queue_len;
+  int tda_sw_pipe[2];
+
   uint32_t tda_last_fec;
 
   int tda_unc_is_delta;  /* 1 if we believe FE_READ_UNCORRECTED_BLOCKS
@@ -231,6 +280,8 @@ void dvb_adapter_set_qmon(th_dvb_adapter_t *tda, int on);
 
 void dvb_adapter_set_dump_muxes(th_dvb_adapter_t *tda, int on);
 
+void dvb_adapter_set_sw_sections(th_dvb_adapter_t *tda, int on);
+
 void dvb_adapter_set_nitoid(th_dvb_adapter_t *tda, int nitoid);
 
 void dvb_adapter_set_diseqc_version(th_dvb_adapter_t *tda, unsigned int v);
@@ -267,6 +318,9 @@ th_dvb_mux_instance_t *dvb_mux_create(th_dvb_adapter_t *tda,
 				      const char *logprefix, int enabled,
 				      int initialscan, const char *identifier);
 
+th_dvb_mux_instance_t *dvb_mux_find_equivalent(th_dvb_adapter_t *tda,
+					       th_dvb_mux_instance_t *src);
+
 void dvb_mux_set_networkname(th_dvb_mux_instance_t *tdmi, const char *name);
 
 void dvb_mux_set_tsid(th_dvb_mux_instance_t *tdmi, uint16_t tsid);
@@ -322,6 +376,10 @@ int dvb_fe_tune(th_dvb_mux_instance_t *tdmi, const char *reason);
 
 void dvb_fe_stop(th_dvb_mux_instance_t *tdmi);
 
+void dvb_fe_init(th_dvb_adapter_t *tda);
+
+void dvb_fe_snapshot_get(th_dvb_adapter_t *tda, dvb_fe_snapshot_t *fs);
+
 
 /**
  * DVB Tables
@@ -332,6 +390,8 @@ void dvb_table_add_default(th_dvb_mux_instance_t *tdmi);
 
 void dvb_table_flush_all(th_dvb_mux_instance_t *tdmi);
 
+void dvb_table_sw_input(th_dvb_adapter_t *tda, const uint8_t *tsb);
+
 /**
  * Satellite configuration
  */
@@ -60,6 +60,7 @@ tda_alloc(void)
   TAILQ_INIT(&tda->tda_scan_queues[1]);
   TAILQ_INIT(&tda->tda_initial_scan_queue);
   TAILQ_INIT(&tda->tda_satconfs);
+  TAILQ_INIT(&tda->tda_sw_queue);
 
   tda->tda_allpids_dmx_fd = -1;
   tda->tda_dump_fd = -1;
@@ -84,6 +85,7 @@ tda_save(th_dvb_adapter_t *tda)
   htsmsg_add_u32(m, "idlescan", tda->tda_idlescan);
   htsmsg_add_u32(m, "qmon", tda->tda_qmon);
   htsmsg_add_u32(m, "dump_muxes", tda->tda_dump_muxes);
+  htsmsg_add_u32(m, "sw_sections", tda->tda_sw_sections);
   htsmsg_add_u32(m, "nitoid", tda->tda_nitoid);
   htsmsg_add_u32(m, "diseqc_version", tda->tda_diseqc_version);
   hts_settings_save(m, "dvbadapters/%s", tda->tda_identifier);
@@ -190,6 +192,25 @@ dvb_adapter_set_dump_muxes(th_dvb_adapter_t *tda, int on)
 }
 
 
+/**
+ *
+ */
+void
+dvb_adapter_set_sw_sections(th_dvb_adapter_t *tda, int on)
+{
+  if(tda->tda_sw_sections == on)
+    return;
+
+  lock_assert(&global_lock);
+
+  tvhlog(LOG_NOTICE, "dvb", "Adapter \"%s\" software section filtering "
+	 "set to: %s", tda->tda_displayname, on ? "On" : "Off");
+
+  tda->tda_sw_sections = on;
+  tda_save(tda);
+}
+
+
 /**
  *
  */
@@ -325,6 +346,8 @@ tda_add(int adapter_num)
 
   dvb_table_init(tda);
 
+  dvb_fe_init(tda);
+
   if(tda->tda_sat)
     dvb_satconf_init(tda);
 
@@ -381,6 +404,7 @@ dvb_adapter_init(uint32_t adapter_mask)
       htsmsg_get_u32(c, "idlescan", &tda->tda_idlescan);
       htsmsg_get_u32(c, "qmon", &tda->tda_qmon);
       htsmsg_get_u32(c, "dump_muxes", &tda->tda_dump_muxes);
+      htsmsg_get_u32(c, "sw_sections", &tda->tda_sw_sections);
       htsmsg_get_u32(c, "nitoid", &tda->tda_nitoid);
       htsmsg_get_u32(c, "diseqc_version", &tda->tda_diseqc_version);
     }
@@ -392,21 +416,96 @@ dvb_adapter_init(uint32_t adapter_mask)
 }
 
 
+/**
+ * Adapters receiving the same network. Idle scanning of muxes that are
+ * known to be OK is shared between them
+ *
+ * nitoid 0 means "any network" so it never groups adapters. For DVB-S
+ * the muxes must also be on the same (named) satconf, see
+ * dvb_mux_find_equivalent()
+ */
+static int
+dvb_adapter_same_network(th_dvb_adapter_t *a, th_dvb_adapter_t *b)
+{
+  return a != b && b->tda_rootpath != NULL &&
+    a->tda_type == b->tda_type &&
+    a->tda_nitoid != 0 && a->tda_nitoid == b->tda_nitoid;
+}
+
+
+/**
+ * Check if another adapter on the same network is tuned to, or has
+ * visited more recently, the given mux. If so the mux counts as
+ * scanned for this adapter as well
+ */
+static int
+dvb_adapter_scan_shared(th_dvb_adapter_t *tda, th_dvb_mux_instance_t *tdmi)
+{
+  th_dvb_mux_instance_t *e;
+  th_dvb_adapter_t *o;
+
+  TAILQ_FOREACH(o, &dvb_adapters, tda_global_link) {
+    if(!dvb_adapter_same_network(tda, o) ||
+       (e = dvb_mux_find_equivalent(o, tdmi)) == NULL)
+      continue;
+
+    if(o->tda_mux_current == e) {
+      tdmi->tdmi_tune_time = dispatch_clock;
+      return 1;
+    }
+    if(e->tdmi_tune_time > tdmi->tdmi_tune_time) {
+      tdmi->tdmi_tune_time = e->tdmi_tune_time;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Pick the next mux to scan from a queue. Muxes already covered by
+ * another adapter are rotated to the back of the queue
+ */
+static th_dvb_mux_instance_t *
+dvb_adapter_scan_pick(th_dvb_adapter_t *tda,
+		      struct th_dvb_mux_instance_queue *q, int shared)
+{
+  th_dvb_mux_instance_t *tdmi, *first = NULL;
+
+  while((tdmi = TAILQ_FIRST(q)) != NULL && tdmi != first) {
+    if(!shared || !dvb_adapter_scan_shared(tda, tdmi))
+      return tdmi;
+
+    if(first == NULL)
+      first = tdmi;
+    TAILQ_REMOVE(q, tdmi, tdmi_scan_link);
+    TAILQ_INSERT_TAIL(q, tdmi, tdmi_scan_link);
+  }
+  return NULL;
+}
+
+
 /**
  * If nobody is subscribing, cycle thru all muxes to get some stats
  * and EIT updates
+ *
+ * The scanner stays on a mux until all its TDT_QUICKREQ tables are
+ * received (but at most DVB_SCAN_MAX_DWELL). Idle scans stay at least
+ * DVB_SCAN_MIN_DWELL to get some EIT and signal statistics, initial
+ * scans move on right away.
  */
 void
 dvb_adapter_mux_scanner(void *aux)
 {
   th_dvb_adapter_t *tda = aux;
   th_dvb_mux_instance_t *tdmi;
-  int i;
+  int i, dwell;
 
   if(tda->tda_rootpath == NULL)
     return; // No hardware
 
-  gtimer_arm(&tda->tda_mux_scanner_timer, dvb_adapter_mux_scanner, tda, 20);
+  gtimer_arm(&tda->tda_mux_scanner_timer, dvb_adapter_mux_scanner, tda,
+	     DVB_SCAN_MAX_DWELL);
 
   if(LIST_FIRST(&tda->tda_muxes) == NULL)
     return; // No muxes configured
@@ -414,9 +513,27 @@ dvb_adapter_mux_scanner(void *aux)
   if(service_compute_weight(&tda->tda_transports) > 0)
     return; /* someone is here */
 
+  /* Give the current mux time to deliver its tables */
+  if((tdmi = tda->tda_mux_current) != NULL) {
+    dwell = dispatch_clock - tdmi->tdmi_tune_time;
+
+    if(!tdmi->tdmi_quickreq_done && dwell < DVB_SCAN_MAX_DWELL) {
+      gtimer_arm(&tda->tda_mux_scanner_timer, dvb_adapter_mux_scanner, tda,
+		 DVB_SCAN_MAX_DWELL - dwell);
+      return;
+    }
+
+    if(!tda->tda_scan_initial && dwell < DVB_SCAN_MIN_DWELL) {
+      gtimer_arm(&tda->tda_mux_scanner_timer, dvb_adapter_mux_scanner, tda,
+		 DVB_SCAN_MIN_DWELL - dwell);
+      return;
+    }
+  }
+
   /* Check if we have muxes pending for quickscan, if so, choose them */
   if((tdmi = TAILQ_FIRST(&tda->tda_initial_scan_queue)) != NULL) {
-    dvb_fe_tune(tdmi, "Initial autoscan");
+    if(!dvb_fe_tune(tdmi, "Initial autoscan"))
+      tda->tda_scan_initial = 1;
     return;
   }
 
@@ -433,10 +550,14 @@ dvb_adapter_mux_scanner(void *aux)
       return;
   }
 
-  /* Alternate between the other two (bad and OK) */
+  /* Alternate between the other two (bad and OK). Bad muxes are
+     checked by each adapter, OK muxes are shared with other adapters
+     on the same network */
   for(i = 0; i < 2; i++) {
     tda->tda_scan_selector = !tda->tda_scan_selector;
-    tdmi = TAILQ_FIRST(&tda->tda_scan_queues[tda->tda_scan_selector]);
+    tdmi = dvb_adapter_scan_pick(tda,
+				 &tda->tda_scan_queues[tda->tda_scan_selector],
+				 tda->tda_scan_selector == 1);
     if(tdmi != NULL) {
       dvb_fe_tune(tdmi, "Autoscan");
       return;
@@ -518,8 +639,9 @@ static void *
 dvb_adapter_input_dvr(void *aux)
 {
   th_dvb_adapter_t *tda = aux;
-  int fd, i, r;
+  int fd, i, r, d, n;
   uint8_t tsb[188 * 10];
+  tsdesc_t tsd[10];
   service_t *t;
 
   fd = tvh_open(tda->tda_dvr_path, O_RDONLY, 0);
@@ -533,12 +655,24 @@ dvb_adapter_input_dvr(void *aux)
     r = read(fd, tsb, sizeof(tsb));
 
     pthread_mutex_lock(&tda->tda_delivery_mutex);
-    
-    for(i = 0; i < r; i += 188) {
-      LIST_FOREACH(t, &tda->tda_transports, s_active_link)
-	if(t->s_dvb_mux_instance == tda->tda_mux_current)
-	  ts_recv_packet1(t, tsb + i, NULL);
+
+    if(r > 0 && tda->tda_tune_start) {
+      d = (getmonoclock() - tda->tda_tune_start) / 1000;
+      tda->tda_tune_start = 0;
+      tda->tda_zap_avg = tda->tda_zap_avg ? (tda->tda_zap_avg * 3 + d) / 4 : d;
     }
+    
+    /* Parse the packet headers once for all services on the mux */
+    n = r > 0 ? r / 188 : 0;
+    ts_parse_packets(tsb, n, tsd);
+
+    LIST_FOREACH(t, &tda->tda_transports, s_active_link)
+      if(t->s_dvb_mux_instance == tda->tda_mux_current)
+	ts_recv_packets(t, tsd, n);
+
+    if(tda->tda_sw_pids != NULL)
+      for(i = 0; i < n; i++)
+	dvb_table_sw_input(tda, tsb + i * 188);
 
     if(tda->tda_dump_fd != -1) {
       if(write(tda->tda_dump_fd, tsb, r) != r) {
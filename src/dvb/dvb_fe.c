@@ -17,6 +17,7 @@
  */
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -40,6 +41,8 @@
 #include "notify.h"
 #include "dvr/dvr.h"
 
+#define DVB_FE_QUALITY_SAVE_DELAY 60 /* Max rate of quality writes (s) */
+
 /**
  * Return uncorrected block (since last read)
  *
@@ -77,91 +80,80 @@ dvb_fe_get_unc(th_dvb_adapter_t *tda)
 
 
 /**
- * Front end monitor
- *
- * Monitor status every second
+ * Publish a new snapshot. Readers retry while tda_fe_seq is odd or
+ * has changed under them
  */
 static void
-dvb_fe_monitor(void *aux)
+dvb_fe_snapshot_put(th_dvb_adapter_t *tda, const dvb_fe_snapshot_t *fs)
 {
-  th_dvb_adapter_t *tda = aux;
-  fe_status_t fe_status;
-  int status, v, update = 0, vv, i, fec, q;
-  th_dvb_mux_instance_t *tdmi = tda->tda_mux_current;
-  char buf[50];
+  __sync_fetch_and_add(&tda->tda_fe_seq, 1);
+  tda->tda_fe_snapshot = *fs;
+  __sync_fetch_and_add(&tda->tda_fe_seq, 1);
+}
 
-  gtimer_arm(&tda->tda_fe_monitor_timer, dvb_fe_monitor, tda, 1);
 
-  if(tdmi == NULL)
-    return;
+/**
+ * Get the last frontend status, does not need any locks
+ */
+void
+dvb_fe_snapshot_get(th_dvb_adapter_t *tda, dvb_fe_snapshot_t *fs)
+{
+  unsigned int seq;
 
-  /**
-   * Read out front end status
-   */
-  if(ioctl(tda->tda_fe_fd, FE_READ_STATUS, &fe_status))
-    fe_status = 0;
-
-  if(fe_status & FE_HAS_LOCK)
-    status = -1;
-  else if(fe_status & (FE_HAS_SYNC | FE_HAS_VITERBI | FE_HAS_CARRIER))
-    status = TDMI_FE_BAD_SIGNAL;
-  else if(fe_status & FE_HAS_SIGNAL)
-    status = TDMI_FE_FAINT_SIGNAL;
-  else
-    status = TDMI_FE_NO_SIGNAL;
-
-  if(tda->tda_fe_monitor_hold > 0) {
-    /* Post tuning threshold */
-    if(status == -1) { /* We have a lock, don't hold off */
-      tda->tda_fe_monitor_hold = 0; 
-      /* Reset FEC counter */
-      dvb_fe_get_unc(tda);
-    } else {
-      tda->tda_fe_monitor_hold--;
-      return;
-    }
-  }
+  do {
+    while((seq = tda->tda_fe_seq) & 1)
+      sched_yield();
+    __sync_synchronize();
+    *fs = tda->tda_fe_snapshot;
+    __sync_synchronize();
+  } while(seq != tda->tda_fe_seq);
+}
 
-  if(status == -1) {
-    /* Read FEC counter (delta) */
 
-    fec = dvb_fe_get_unc(tda);
-    
-    tdmi->tdmi_fec_err_histogram[tdmi->tdmi_fec_err_ptr++] = fec;
-    if(tdmi->tdmi_fec_err_ptr == TDMI_FEC_ERR_HISTOGRAM_SIZE)
-      tdmi->tdmi_fec_err_ptr = 0;
-
-    v = vv = 0;
-    for(i = 0; i < TDMI_FEC_ERR_HISTOGRAM_SIZE; i++) {
-      if(tdmi->tdmi_fec_err_histogram[i] > DVB_FEC_ERROR_LIMIT)
-	v++;
-      vv += tdmi->tdmi_fec_err_histogram[i];
-    }
-    vv = vv / TDMI_FEC_ERR_HISTOGRAM_SIZE;
+/**
+ * Save mux quality, rate limited to once per DVB_FE_QUALITY_SAVE_DELAY
+ */
+static void
+dvb_fe_save_quality(void *aux)
+{
+  th_dvb_adapter_t *tda = aux;
+  th_dvb_mux_instance_t *tdmi = tda->tda_mux_current;
 
-    if(v == 0) {
-      status = TDMI_FE_OK;
-    } else if(v == 1) {
-      status = TDMI_FE_BURSTY_FEC;
-    } else {
-      status = TDMI_FE_CONSTANT_FEC;
-    }
+  if(tdmi != NULL && tdmi->tdmi_quality_dirty) {
+    tdmi->tdmi_quality_dirty = 0;
+    dvb_mux_save(tdmi);
+  }
+}
 
-    /* bit error rate */
-    if(ioctl(tda->tda_fe_fd, FE_READ_BER, &tdmi->tdmi_ber) == -1)
-      tdmi->tdmi_ber = -2;
 
-    /* signal strength */
-    if(ioctl(tda->tda_fe_fd, FE_READ_SIGNAL_STRENGTH, &tdmi->tdmi_signal) == -1)
-      tdmi->tdmi_signal = -2;
+/**
+ * Apply a status / quality transition to the current mux
+ *
+ * Returns the resulting quality, or -1 if the mux has changed since
+ * the snapshot was taken
+ */
+static int
+dvb_fe_apply(th_dvb_adapter_t *tda, const dvb_fe_snapshot_t *fs)
+{
+  th_dvb_mux_instance_t *tdmi;
+  int q, update = 0;
+  char buf[50];
 
-    /* signal/noise ratio */
-    if(ioctl(tda->tda_fe_fd, FE_READ_SNR, &tdmi->tdmi_snr) == -1)
-      tdmi->tdmi_snr = -2;
+  pthread_mutex_lock(&global_lock);
+
+  tdmi = tda->tda_mux_current;
+  if(tdmi == NULL || fs->fs_generation != tda->tda_fe_generation) {
+    pthread_mutex_unlock(&global_lock);
+    return -1;
   }
 
-  if(status != tdmi->tdmi_fe_status) {
-    tdmi->tdmi_fe_status = status;
+  tdmi->tdmi_snr = fs->fs_snr;
+  tdmi->tdmi_signal = fs->fs_signal;
+  tdmi->tdmi_ber = fs->fs_ber;
+  tdmi->tdmi_uncorrected_blocks = fs->fs_unc;
+
+  if(fs->fs_status != tdmi->tdmi_fe_status) {
+    tdmi->tdmi_fe_status = fs->fs_status;
 
     dvb_mux_nicename(buf, sizeof(buf), tdmi);
     tvhlog(LOG_DEBUG, 
@@ -170,9 +162,9 @@ dvb_fe_monitor(void *aux)
     update = 1;
   }
 
-  if(status != TDMI_FE_UNKNOWN) {
+  if(fs->fs_status != TDMI_FE_UNKNOWN) {
     if(tda->tda_qmon) {
-      q = tdmi->tdmi_quality + (status - TDMI_FE_OK + 1);
+      q = tdmi->tdmi_quality + (fs->fs_status - TDMI_FE_OK + 1);
       q = MAX(MIN(q, 100), 0);
     } else {
       q = 100;
@@ -190,8 +182,156 @@ dvb_fe_monitor(void *aux)
     htsmsg_add_u32(m, "quality", tdmi->tdmi_quality);
     notify_by_msg("dvbMux", m);
 
-    dvb_mux_save(tdmi);
+    if(!tdmi->tdmi_quality_dirty) {
+      tdmi->tdmi_quality_dirty = 1;
+      gtimer_arm(&tda->tda_fe_save_timer, dvb_fe_save_quality, tda,
+		 DVB_FE_QUALITY_SAVE_DELAY);
+    }
   }
+
+  q = tdmi->tdmi_quality;
+  pthread_mutex_unlock(&global_lock);
+  return q;
+}
+
+
+/**
+ * Will dvb_fe_apply() change the quality for the given status
+ */
+static int
+dvb_fe_quality_moving(th_dvb_adapter_t *tda, int status, int q)
+{
+  int d = status - TDMI_FE_OK + 1;
+
+  if(status == TDMI_FE_UNKNOWN || q < 0)
+    return q < 0;
+  if(!tda->tda_qmon)
+    return q != 100;
+  return (d > 0 && q < 100) || (d < 0 && q > 0);
+}
+
+
+/**
+ * Front end monitor thread
+ *
+ * Monitor status every second. The FE_READ_* ioctls can be slow so
+ * this is done without holding global_lock
+ */
+static void *
+dvb_fe_monitor_thread(void *aux)
+{
+  th_dvb_adapter_t *tda = aux;
+  dvb_fe_snapshot_t fs;
+  fe_status_t fe_status;
+  uint32_t hist[TDMI_FEC_ERR_HISTOGRAM_SIZE];
+  int gen = -1, hold = 0, ptr = 0, q = -1, last_status = -1;
+  int status, v, i, fec;
+
+  memset(&fs, 0, sizeof(fs));
+
+  while(1) {
+    sleep(1);
+
+    if(!tda->tda_fe_tuned)
+      continue;
+
+    if(tda->tda_fe_generation != gen) {
+      /* Retuned */
+      gen = tda->tda_fe_generation;
+      hold = 4;
+      ptr = 0;
+      memset(hist, 0, sizeof(hist));
+      q = -1;
+      last_status = -1;
+      memset(&fs, 0, sizeof(fs));
+      fs.fs_generation = gen;
+      fs.fs_status = TDMI_FE_UNKNOWN;
+    }
+
+    /**
+     * Read out front end status
+     */
+    if(ioctl(tda->tda_fe_fd, FE_READ_STATUS, &fe_status))
+      fe_status = 0;
+
+    if(fe_status & FE_HAS_LOCK)
+      status = -1;
+    else if(fe_status & (FE_HAS_SYNC | FE_HAS_VITERBI | FE_HAS_CARRIER))
+      status = TDMI_FE_BAD_SIGNAL;
+    else if(fe_status & FE_HAS_SIGNAL)
+      status = TDMI_FE_FAINT_SIGNAL;
+    else
+      status = TDMI_FE_NO_SIGNAL;
+
+    if(hold > 0) {
+      /* Post tuning threshold */
+      if(status == -1) { /* We have a lock, don't hold off */
+	hold = 0;
+	/* Reset FEC counter */
+	dvb_fe_get_unc(tda);
+      } else {
+	hold--;
+	continue;
+      }
+    }
+
+    if(status == -1) {
+      /* Read FEC counter (delta) */
+
+      fec = dvb_fe_get_unc(tda);
+      fs.fs_unc = fec;
+
+      hist[ptr++] = fec;
+      if(ptr == TDMI_FEC_ERR_HISTOGRAM_SIZE)
+	ptr = 0;
+
+      v = 0;
+      for(i = 0; i < TDMI_FEC_ERR_HISTOGRAM_SIZE; i++)
+	if(hist[i] > DVB_FEC_ERROR_LIMIT)
+	  v++;
+
+      if(v == 0) {
+	status = TDMI_FE_OK;
+      } else if(v == 1) {
+	status = TDMI_FE_BURSTY_FEC;
+      } else {
+	status = TDMI_FE_CONSTANT_FEC;
+      }
+
+      /* bit error rate */
+      if(ioctl(tda->tda_fe_fd, FE_READ_BER, &fs.fs_ber) == -1)
+	fs.fs_ber = -2;
+
+      /* signal strength */
+      if(ioctl(tda->tda_fe_fd, FE_READ_SIGNAL_STRENGTH, &fs.fs_signal) == -1)
+	fs.fs_signal = -2;
+
+      /* signal/noise ratio */
+      if(ioctl(tda->tda_fe_fd, FE_READ_SNR, &fs.fs_snr) == -1)
+	fs.fs_snr = -2;
+    }
+
+    fs.fs_status = status;
+    dvb_fe_snapshot_put(tda, &fs);
+
+    /* Only take global_lock when something is changing */
+    if(status != last_status || dvb_fe_quality_moving(tda, status, q)) {
+      q = dvb_fe_apply(tda, &fs);
+      last_status = status;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+dvb_fe_init(th_dvb_adapter_t *tda)
+{
+  pthread_t ptid;
+  pthread_create(&ptid, NULL, dvb_fe_monitor_thread, tda);
 }
 
 
@@ -205,6 +345,16 @@ dvb_fe_stop(th_dvb_mux_instance_t *tdmi)
 
   assert(tdmi == tda->tda_mux_current);
   tda->tda_mux_current = NULL;
+  tda->tda_fe_tuned = 0;
+  tda->tda_fe_generation++;
+
+  if(tdmi->tdmi_quality_dirty) {
+    tdmi->tdmi_quality_dirty = 0;
+    dvb_mux_save(tdmi);
+  }
+  gtimer_disarm(&tda->tda_fe_save_timer);
+
+  tda->tda_sw_tables = 0;
 
   if(tda->tda_allpids_dmx_fd != -1) {
     close(tda->tda_allpids_dmx_fd);
@@ -235,19 +385,20 @@ dvb_fe_stop(th_dvb_mux_instance_t *tdmi)
 
 
 /**
- * Open a dump file which we write the entire mux output to
+ * Route all PIDs of the current mux to the DVR device
  */
-static void
-dvb_adapter_open_dump_file(th_dvb_adapter_t *tda)
+static int
+dvb_adapter_open_allpids(th_dvb_adapter_t *tda)
 {
   struct dmx_pes_filter_params dmx_param;
-  char fullname[1000];
-  char path[500];
   const char *fname = tda->tda_mux_current->tdmi_identifier;
+  int fd;
 
-  int fd = tvh_open(tda->tda_demux_path, O_RDWR, 0);
-  if(fd == -1)
-    return;
+  if(tda->tda_allpids_dmx_fd != -1)
+    return 0;
+
+  if((fd = tvh_open(tda->tda_demux_path, O_RDWR, 0)) == -1)
+    return -1;
 
   memset(&dmx_param, 0, sizeof(dmx_param));
   dmx_param.pid = 0x2000;
@@ -262,16 +413,33 @@ dvb_adapter_open_dump_file(th_dvb_adapter_t *tda)
 	   fname, tda->tda_demux_path, 
 	   strerror(errno));
     close(fd);
-    return;
+    return -1;
   }
 
+  tda->tda_allpids_dmx_fd = fd;
+  return 0;
+}
+
+
+/**
+ * Open a dump file which we write the entire mux output to
+ */
+static void
+dvb_adapter_open_dump_file(th_dvb_adapter_t *tda)
+{
+  char fullname[1000];
+  char path[500];
+  const char *fname = tda->tda_mux_current->tdmi_identifier;
+
+  if(dvb_adapter_open_allpids(tda))
+    return;
+
   snprintf(path, sizeof(path), "%s/muxdumps", 
       dvr_config_find_by_name_default("")->dvr_storage);
 
   if(mkdir(path, 0777) && errno != EEXIST) {
     tvhlog(LOG_ERR, "dvb", "\"%s\" unable to create mux dump dir %s -- %s",
 	   fname, path, strerror(errno));
-    close(fd);
     return;
   }
 
@@ -293,14 +461,12 @@ dvb_adapter_open_dump_file(th_dvb_adapter_t *tda)
   if(f == -1) {
     tvhlog(LOG_ERR, "dvb", "\"%s\" unable to create mux dump file %s -- %s",
 	   fname, fullname, strerror(errno));
-    close(fd);
     return;
   }
 	   
   tvhlog(LOG_WARNING, "dvb", "\"%s\" writing to mux dump file %s",
 	 fname, fullname);
 
-  tda->tda_allpids_dmx_fd = fd;
   tda->tda_dump_fd = f;
 }
 
@@ -474,8 +640,6 @@ dvb_fe_tune(th_dvb_mux_instance_t *tdmi, const char *reason)
 
   dvb_mux_nicename(buf, sizeof(buf), tdmi);
 
-  tda->tda_fe_monitor_hold = 4;
-
 
 #if DVB_API_VERSION >= 5
   if (tda->tda_type == FE_QPSK) {
@@ -500,11 +664,18 @@ dvb_fe_tune(th_dvb_mux_instance_t *tdmi, const char *reason)
   }   
 
   tda->tda_mux_current = tdmi;
+  tda->tda_fe_generation++;
+  tda->tda_fe_tuned = 1;
+  tda->tda_tune_start = getmonoclock();
+  tda->tda_scan_initial = 0;
+  tdmi->tdmi_quickreq_done = 0;
+  tdmi->tdmi_tune_time = dispatch_clock;
 
   if(tda->tda_dump_muxes)
     dvb_adapter_open_dump_file(tda);
 
-  gtimer_arm(&tda->tda_fe_monitor_timer, dvb_fe_monitor, tda, 1);
+  if(tda->tda_sw_sections && !dvb_adapter_open_allpids(tda))
+    tda->tda_sw_tables = 1;
 
   dvb_table_add_default(tdmi);
 
@@ -336,6 +336,40 @@ dvb_mux_destroy(th_dvb_mux_instance_t *tdmi)
 }
 
 
+/**
+ * Find the mux on 'tda' that carries the same transport stream as
+ * 'src' (on another adapter). Satconfs are per adapter so they are
+ * matched by name. Without satconfs DVB-S muxes can not be told apart
+ * (different LNBs / dishes) so they never match
+ */
+th_dvb_mux_instance_t *
+dvb_mux_find_equivalent(th_dvb_adapter_t *tda, th_dvb_mux_instance_t *src)
+{
+  const struct dvb_mux_conf *dmc = &src->tdmi_conf;
+  th_dvb_mux_instance_t *tdmi;
+  dvb_satconf_t *a, *b;
+  unsigned int hash;
+
+  hash = (dmc->dmc_fe_params.frequency + 
+	  dmc->dmc_polarisation) % TDA_MUX_HASH_WIDTH;
+
+  LIST_FOREACH(tdmi, &tda->tda_mux_hash[hash], tdmi_adapter_hash_link) {
+    if(tdmi->tdmi_conf.dmc_fe_params.frequency != dmc->dmc_fe_params.frequency ||
+       tdmi->tdmi_conf.dmc_polarisation != dmc->dmc_polarisation)
+      continue;
+
+    a = tdmi->tdmi_conf.dmc_satconf;
+    b = dmc->dmc_satconf;
+    if(a == NULL && b == NULL && tda->tda_type != FE_QPSK)
+      return tdmi;
+    if(a != NULL && b != NULL && a->sc_name != NULL && b->sc_name != NULL &&
+       !strcmp(a->sc_name, b->sc_name))
+      return tdmi;
+  }
+  return NULL;
+}
+
+
 /**
  *
  */
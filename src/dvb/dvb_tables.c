@@ -46,6 +46,8 @@
 #define TDT_QUICKREQ      0x2
 #define TDT_INC_TABLE_HDR 0x4
 
+#define DVB_SW_QUEUE_MAX  2000 /* Max sections waiting for the table thread */
+
 static void dvb_table_add_pmt(th_dvb_mux_instance_t *tdmi, int pmt_pid);
 
 static int tdt_id_tally;
@@ -89,9 +91,40 @@ typedef struct th_dvb_table {
 
   int tdt_id;
 
+  /**
+   * Set if sections are filtered in software from the DVR stream,
+   * such tables never have a fd and are never on the cycle queue
+   */
+  int tdt_sw;
+
 } th_dvb_table_t;
 
 
+/**
+ * Software section filtering
+ *
+ * When the full mux is delivered on the DVR device (tda_sw_tables)
+ * tables do not get a demux fd each. Instead the DVR thread
+ * reassembles sections on all PIDs that any table wants and queues
+ * them to the table thread which dispatches them under global_lock.
+ * This way all tables are collected at once without using up the
+ * hardware filters.
+ */
+typedef struct dvb_sw_pid {
+  th_dvb_adapter_t *sp_tda;
+  int sp_pid;
+  int sp_refcount;
+  psi_section_t sp_section;
+} dvb_sw_pid_t;
+
+typedef struct dvb_sw_section {
+  TAILQ_ENTRY(dvb_sw_section) dss_link;
+  int dss_pid;
+  int dss_len;
+  uint8_t dss_data[0];
+} dvb_sw_section_t;
+
+
 
 
 /**
@@ -114,21 +147,28 @@ dvb_table_fastswitch(th_dvb_mux_instance_t *tdmi)
   th_dvb_adapter_t *tda = tdmi->tdmi_adapter;
   char buf[100];
 
-  if(!tdmi->tdmi_table_initial)
+  if(tdmi->tdmi_quickreq_done)
     return;
 
   LIST_FOREACH(tdt, &tdmi->tdmi_tables, tdt_link)
     if((tdt->tdt_flags & TDT_QUICKREQ) && tdt->tdt_count == 0)
       return;
 
-  tdmi->tdmi_table_initial = 0;
-  tda->tda_initial_num_mux--;
+  tdmi->tdmi_quickreq_done = 1;
 
+  if(tdmi->tdmi_table_initial) {
+    tdmi->tdmi_table_initial = 0;
+    tda->tda_initial_num_mux--;
 
-  dvb_mux_nicename(buf, sizeof(buf), tdmi);
-  tvhlog(LOG_DEBUG, "dvb", "\"%s\" initial scan completed for \"%s\"",
-	 tda->tda_rootpath, buf);
-  dvb_adapter_mux_scanner(tda);
+    dvb_mux_nicename(buf, sizeof(buf), tdmi);
+    tvhlog(LOG_DEBUG, "dvb", "\"%s\" initial scan completed for \"%s\"",
+	   tda->tda_rootpath, buf);
+  }
+
+  /* Let the scanner move on. Not called directly since it may retune
+     and destroy the table we are called for */
+  if(tda->tda_rootpath != NULL)
+    gtimer_arm(&tda->tda_mux_scanner_timer, dvb_adapter_mux_scanner, tda, 0);
 }
 
 
@@ -226,6 +266,171 @@ dvb_proc_table(th_dvb_mux_instance_t *tdmi, th_dvb_table_t *tdt, uint8_t *sec,
     dvb_table_fastswitch(tdmi);
 }
 
+/**
+ * Check a section against a table's filter the way the demux hardware
+ * would. filter[0] is the table id, the rest is matched from byte 3 on
+ * (the section length is skipped)
+ */
+static int
+tdt_sw_match(th_dvb_table_t *tdt, const uint8_t *sec, int len)
+{
+  struct dmx_filter *f = &tdt->tdt_fparams->filter;
+  int i, o;
+
+  for(i = 0; i < DMX_FILTER_SIZE; i++) {
+    if(f->mask[i] == 0)
+      continue;
+    o = i ? i + 2 : 0;
+    if(o >= len || (sec[o] ^ f->filter[i]) & f->mask[i])
+      return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Called by psi_section_reassemble() in the DVR thread
+ */
+static void
+dvb_table_sw_section(const uint8_t *data, size_t len, void *opaque)
+{
+  dvb_sw_pid_t *sp = opaque;
+  th_dvb_adapter_t *tda = sp->sp_tda;
+  dvb_sw_section_t *dss;
+  char c = 0;
+
+  if(len < 3 || tda->tda_sw_queue_len >= DVB_SW_QUEUE_MAX)
+    return;
+
+  dss = malloc(sizeof(dvb_sw_section_t) + len);
+  dss->dss_pid = sp->sp_pid;
+  dss->dss_len = len;
+  memcpy(dss->dss_data, data, len);
+
+  TAILQ_INSERT_TAIL(&tda->tda_sw_queue, dss, dss_link);
+  if(tda->tda_sw_queue_len++ == 0 && write(tda->tda_sw_pipe[1], &c, 1)) {}
+}
+
+
+/**
+ * Feed a TS packet from the DVR stream to the software section filters
+ *
+ * tda_delivery_mutex must be held
+ */
+void
+dvb_table_sw_input(th_dvb_adapter_t *tda, const uint8_t *tsb)
+{
+  int pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+  dvb_sw_pid_t *sp;
+
+  if(tsb[1] & 0x80 || (sp = tda->tda_sw_pids[pid]) == NULL)
+    return;
+
+  psi_section_reassemble(&sp->sp_section, tsb, 0, dvb_table_sw_section, sp);
+}
+
+
+/**
+ * Start software section filtering on a PID
+ */
+static void
+dvb_table_sw_pid_ref(th_dvb_adapter_t *tda, int pid)
+{
+  dvb_sw_pid_t *sp;
+
+  pthread_mutex_lock(&tda->tda_delivery_mutex);
+  if(tda->tda_sw_pids == NULL)
+    tda->tda_sw_pids = calloc(8192, sizeof(dvb_sw_pid_t *));
+
+  if((sp = tda->tda_sw_pids[pid]) == NULL) {
+    sp = calloc(1, sizeof(dvb_sw_pid_t));
+    sp->sp_tda = tda;
+    sp->sp_pid = pid;
+    tda->tda_sw_pids[pid] = sp;
+  }
+  sp->sp_refcount++;
+  pthread_mutex_unlock(&tda->tda_delivery_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+dvb_table_sw_pid_unref(th_dvb_adapter_t *tda, int pid)
+{
+  dvb_sw_pid_t *sp;
+
+  pthread_mutex_lock(&tda->tda_delivery_mutex);
+  sp = tda->tda_sw_pids[pid];
+  if(--sp->sp_refcount == 0) {
+    tda->tda_sw_pids[pid] = NULL;
+    free(sp);
+  }
+  pthread_mutex_unlock(&tda->tda_delivery_mutex);
+}
+
+
+/**
+ * Dispatch queued sections to the tables of the current mux
+ */
+static void
+dvb_table_sw_dispatch(th_dvb_adapter_t *tda)
+{
+  TAILQ_HEAD(, dvb_sw_section) q;
+  th_dvb_mux_instance_t *tdmi;
+  dvb_sw_section_t *dss;
+  th_dvb_table_t *tdt;
+
+  TAILQ_INIT(&q);
+
+  pthread_mutex_lock(&tda->tda_delivery_mutex);
+  if(TAILQ_FIRST(&tda->tda_sw_queue) != NULL) {
+    TAILQ_MOVE(&q, &tda->tda_sw_queue, dss_link);
+    TAILQ_INIT(&tda->tda_sw_queue);
+  }
+  tda->tda_sw_queue_len = 0;
+  pthread_mutex_unlock(&tda->tda_delivery_mutex);
+
+  pthread_mutex_lock(&global_lock);
+  while((dss = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, dss, dss_link);
+
+    /* The mux may change (or be stopped) by any of the callbacks */
+    if((tdmi = tda->tda_mux_current) != NULL && tda->tda_sw_tables) {
+      LIST_FOREACH(tdt, &tdmi->tdmi_tables, tdt_link)
+	if(tdt->tdt_sw && tdt->tdt_pid == dss->dss_pid)
+	  break;
+
+      /* Only one table per PID, see tdt_add() */
+      if(tdt != NULL && tdt_sw_match(tdt, dss->dss_data, dss->dss_len))
+	dvb_proc_table(tdmi, tdt, dss->dss_data, dss->dss_len);
+    }
+    free(dss);
+  }
+  pthread_mutex_unlock(&global_lock);
+}
+
+
+/**
+ * Drop all queued sections and reassembly state, called when the
+ * mux is stopped
+ */
+static void
+dvb_table_sw_flush(th_dvb_adapter_t *tda)
+{
+  dvb_sw_section_t *dss;
+
+  pthread_mutex_lock(&tda->tda_delivery_mutex);
+  while((dss = TAILQ_FIRST(&tda->tda_sw_queue)) != NULL) {
+    TAILQ_REMOVE(&tda->tda_sw_queue, dss, dss_link);
+    free(dss);
+  }
+  tda->tda_sw_queue_len = 0;
+  pthread_mutex_unlock(&tda->tda_delivery_mutex);
+}
+
+
 /**
  *
  */
@@ -251,6 +456,13 @@ dvb_table_input(void *aux)
       if(!(ev[i].events & EPOLLIN))
 	continue;
 
+      if(tid == 0) {
+	/* Software filtered sections are pending */
+	if(read(fd, sec, sizeof(sec)) > 0)
+	  dvb_table_sw_dispatch(tda);
+	continue;
+      }
+
       if((r = read(fd, sec, sizeof(sec))) < 3)
 	continue;
 
@@ -290,7 +502,19 @@ void
 dvb_table_init(th_dvb_adapter_t *tda)
 {
   pthread_t ptid;
+  struct epoll_event e;
+
   tda->tda_table_epollfd = epoll_create(50);
+
+  /* Wakeup for software filtered sections, table id 0 is never used */
+  if(pipe(tda->tda_sw_pipe) == 0) {
+    fcntl(tda->tda_sw_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(tda->tda_sw_pipe[1], F_SETFL, O_NONBLOCK);
+    e.events = EPOLLIN;
+    e.data.u64 = (uint64_t)tda->tda_sw_pipe[0] << 32;
+    epoll_ctl(tda->tda_table_epollfd, EPOLL_CTL_ADD, tda->tda_sw_pipe[0], &e);
+  }
+
   pthread_create(&ptid, NULL, dvb_table_input, tda);
 }
 
@@ -304,7 +528,9 @@ dvb_tdt_destroy(th_dvb_adapter_t *tda, th_dvb_mux_instance_t *tdmi,
 {
   LIST_REMOVE(tdt, tdt_link);
 
-  if(tdt->tdt_fd == -1) {
+  if(tdt->tdt_sw) {
+    dvb_table_sw_pid_unref(tda, tdt->tdt_pid);
+  } else if(tdt->tdt_fd == -1) {
     TAILQ_REMOVE(&tdmi->tdmi_table_queue, tdt, tdt_pending_link);
   } else {
     epoll_ctl(tda->tda_table_epollfd, EPOLL_CTL_DEL, tdt->tdt_fd, NULL);
@@ -357,6 +583,13 @@ tdt_add(th_dvb_mux_instance_t *tdmi, struct dmx_sct_filter_params *fparams,
   tdt->tdt_fparams = fparams;
   LIST_INSERT_HEAD(&tdmi->tdmi_tables, tdt, tdt_link);
   tdt->tdt_fd = -1;
+
+  if(tdmi->tdmi_adapter->tda_sw_tables) {
+    tdt->tdt_sw = 1;
+    dvb_table_sw_pid_ref(tdmi->tdmi_adapter, pid);
+    return;
+  }
+
   TAILQ_INSERT_TAIL(&tdmi->tdmi_table_queue, tdt, tdt_pending_link);
 
   tdt_open_fd(tdmi, tdt);
@@ -1407,5 +1640,6 @@ dvb_table_flush_all(th_dvb_mux_instance_t *tdmi)
 
   while((tdt = LIST_FIRST(&tdmi->tdmi_tables)) != NULL)
     dvb_tdt_destroy(tda, tdmi, tdt);
-  
+
+  dvb_table_sw_flush(tda);
 }
@@ -62,7 +62,7 @@ dvb_transport_open_demuxers(th_dvb_adapter_t *tda, service_t *t)
       continue;
 
     fd = tvh_open(tda->tda_demux_path, O_RDWR, 0);
-    st->es_cc_valid = 0;
+    service_stream_hot(st)->esh_cc_valid = 0;
 
     if(fd == -1) {
       st->es_demuxer_fd = -1;
@@ -314,6 +314,40 @@ dvb_transport_quality(service_t *t)
 }
 
 
+/**
+ * Cost of starting the service, see service_find()
+ */
+static int
+dvb_transport_start_cost(service_t *t)
+{
+  th_dvb_mux_instance_t *tdmi = t->s_dvb_mux_instance;
+  th_dvb_adapter_t *tda = tdmi->tdmi_adapter;
+  service_t *s;
+  int cost, w;
+
+  lock_assert(&global_lock);
+
+  if(tda->tda_mux_current == tdmi)
+    return 0; /* Already tuned, no zap */
+
+  /* Expected zap time, 2 points per 100 ms, assume 1s if not known */
+  cost = 20 + MIN(tda->tda_zap_avg ?: 1000, 5000) / 50;
+
+  if(tda->tda_mux_current != NULL) {
+    w = service_compute_weight(&tda->tda_transports);
+    if(w == 0) {
+      cost += 10; /* Idle scanning */
+    } else {
+      /* Someone has to be kicked off, prefer the least loaded one */
+      cost += 100 + w;
+      LIST_FOREACH(s, &tda->tda_transports, s_active_link)
+	cost += 10;
+    }
+  }
+  return cost;
+}
+
+
 /**
  * Generate a descriptive name for the source
  */
@@ -399,6 +433,7 @@ dvb_transport_find(th_dvb_mux_instance_t *tdmi, uint16_t sid, int pmt_pid,
   t->s_setsourceinfo = dvb_transport_setsourceinfo;
   t->s_quality_index = dvb_transport_quality;
   t->s_grace_period  = dvb_grace_period;
+  t->s_start_cost    = dvb_transport_start_cost;
 
   t->s_dvb_mux_instance = tdmi;
   LIST_INSERT_HEAD(&tdmi->tdmi_transports, t, s_group_link);
@@ -485,8 +520,21 @@ int
 dvb_transport_get_signal_status(service_t *t, signal_status_t *status)
 {
   th_dvb_mux_instance_t *tdmi = t->s_dvb_mux_instance;
+  th_dvb_adapter_t *tda = tdmi->tdmi_adapter;
+  dvb_fe_snapshot_t fs;
 
   status->status_text = dvb_mux_status(tdmi);
+
+  if(tda->tda_mux_current == tdmi) {
+    /* Live values from the frontend monitor */
+    dvb_fe_snapshot_get(tda, &fs);
+    status->snr       = fs.fs_snr;
+    status->signal    = fs.fs_signal;
+    status->ber       = fs.fs_ber;
+    status->unc       = fs.fs_unc;
+    return 0;
+  }
+
   status->snr         = tdmi->tdmi_snr;
   status->signal      = tdmi->tdmi_signal;
   status->ber         = tdmi->tdmi_ber;
@@ -96,6 +96,10 @@ typedef struct dvr_entry {
 
   LIST_ENTRY(dvr_entry) de_global_link;
   int de_id;
+
+  /* HTSP change sequence numbers, see htsp.c */
+  uint32_t de_htsp_created;
+  uint32_t de_htsp_seq;
   
   channel_t *de_channel;
   LIST_ENTRY(dvr_entry) de_channel_link;
@@ -163,8 +167,6 @@ typedef struct dvr_entry {
 
   th_subscription_t *de_s;
   streaming_queue_t de_sq;
-  streaming_target_t *de_tsfix;
-  streaming_target_t *de_gh;
   
   /**
    * Initialized upon SUBSCRIPTION_TRANSPORT_RUN
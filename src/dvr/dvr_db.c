@@ -28,6 +28,7 @@
 #include "dvr.h"
 #include "notify.h"
 #include "htsp.h"
+#include "upnp/tv_upnp_browse.h"
 #include "streaming.h"
 
 static int de_tally;
@@ -245,6 +246,7 @@ dvr_entry_link(dvr_entry_t *de)
     gtimer_arm_abs(&de->de_timer, dvr_timer_start_recording, de, preamble);
   }
   htsp_dvr_entry_add(de);
+  tv_upnp_browse_dvr_entry_update(de);
 }
 
 
@@ -415,6 +417,7 @@ dvr_entry_remove(dvr_entry_t *de)
   hts_settings_remove("dvr/log/%d", de->de_id);
 
   htsp_dvr_entry_delete(de);
+  tv_upnp_browse_dvr_entry_delete(de);
 
   gtimer_disarm(&de->de_timer);
 
@@ -623,6 +626,7 @@ dvr_entry_update(dvr_entry_t *de, const char* de_title, int de_start, int de_sto
 
   dvr_entry_save(de);
   htsp_dvr_entry_update(de);
+  tv_upnp_browse_dvr_entry_update(de);
   dvr_entry_notify(de);
 
   tvhlog(LOG_INFO, "dvr", "\"%s\" on \"%s\": Updated Timer", de->de_title, de->de_channel->ch_name);
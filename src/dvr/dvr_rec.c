@@ -30,10 +30,9 @@
 #include "dvr.h"
 #include "spawn.h"
 #include "service.h"
-#include "plumbing/tsfix.h"
-#include "plumbing/globalheaders.h"
 
 #include "mkmux.h"
+#include "upnp/tv_upnp_browse.h"
 
 /**
  *
@@ -73,12 +72,9 @@ dvr_rec_subscribe(dvr_entry_t *de)
   else
     weight = 300;
 
-  de->de_gh = globalheaders_create(&de->de_sq.sq_st);
-
-  de->de_tsfix = tsfix_create(de->de_gh);
-
   de->de_s = subscription_create_from_channel(de->de_channel, weight,
-					      buf, de->de_tsfix, 0);
+					      buf, &de->de_sq.sq_st,
+					      SUBSCRIPTION_NORMALIZED);
 }
 
 /**
@@ -96,9 +92,6 @@ dvr_rec_unsubscribe(dvr_entry_t *de, int stopcode)
   pthread_join(de->de_thread, NULL);
   de->de_s = NULL;
 
-  tsfix_destroy(de->de_tsfix);
-  globalheaders_destroy(de->de_gh);
-
   de->de_last_error = stopcode;
 }
 
@@ -252,6 +245,7 @@ pvr_generate_filename(dvr_entry_t *de)
   }
 
   tvh_str_set(&de->de_filename, fullname);
+  tv_upnp_browse_dvr_entry_update(de);
 
   free(filename);
   return 0;
@@ -480,6 +474,7 @@ dvr_thread(void *aux)
       }
       break;
 
+    case SMT_SKIP:
     case SMT_MPEGTS:
       break;
 
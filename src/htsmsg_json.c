@@ -136,6 +136,144 @@ htsmsg_json_serialize(htsmsg_t *msg, htsbuf_queue_t *hq, int pretty)
 
 
 
+/**
+ * Separator and name of the next value
+ */
+static void
+json_name(json_writer_t *jw, const char *name)
+{
+  uint32_t bit = 1 << jw->jw_depth;
+
+  if(jw->jw_nonempty & bit)
+    htsbuf_append(jw->jw_hq, ",", 1);
+  jw->jw_nonempty |= bit;
+
+  if(!(jw->jw_islist & bit)) {
+    htsmsg_json_encode_string(name ?: "noname", jw->jw_hq);
+    htsbuf_append(jw->jw_hq, ":", 1);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+json_begin(json_writer_t *jw, const char *name, int islist)
+{
+  uint32_t bit;
+
+  json_name(jw, name);
+  htsbuf_append(jw->jw_hq, islist ? "[" : "{", 1);
+
+  jw->jw_depth++;
+  assert(jw->jw_depth < 32);
+  bit = 1 << jw->jw_depth;
+  jw->jw_nonempty &= ~bit;
+  if(islist)
+    jw->jw_islist |= bit;
+  else
+    jw->jw_islist &= ~bit;
+}
+
+
+/**
+ *
+ */
+void
+json_writer_init(json_writer_t *jw, htsbuf_queue_t *hq)
+{
+  jw->jw_hq = hq;
+  jw->jw_depth = 0;
+  jw->jw_islist = 1;
+  jw->jw_nonempty = 0;
+}
+
+
+/**
+ *
+ */
+void
+json_begin_map(json_writer_t *jw, const char *name)
+{
+  json_begin(jw, name, 0);
+}
+
+
+/**
+ *
+ */
+void
+json_end_map(json_writer_t *jw)
+{
+  assert(jw->jw_depth > 0);
+  jw->jw_depth--;
+  htsbuf_append(jw->jw_hq, "}", 1);
+}
+
+
+/**
+ *
+ */
+void
+json_begin_list(json_writer_t *jw, const char *name)
+{
+  json_begin(jw, name, 1);
+}
+
+
+/**
+ *
+ */
+void
+json_end_list(json_writer_t *jw)
+{
+  assert(jw->jw_depth > 0);
+  jw->jw_depth--;
+  htsbuf_append(jw->jw_hq, "]", 1);
+}
+
+
+/**
+ *
+ */
+void
+json_add_str(json_writer_t *jw, const char *name, const char *str)
+{
+  if(str == NULL)
+    return;
+  json_name(jw, name);
+  htsmsg_json_encode_string(str, jw->jw_hq);
+}
+
+
+/**
+ *
+ */
+void
+json_add_s64(json_writer_t *jw, const char *name, int64_t v)
+{
+  char buf[30];
+  int l;
+
+  json_name(jw, name);
+  l = snprintf(buf, sizeof(buf), "%" PRId64, v);
+  htsbuf_append(jw->jw_hq, buf, l);
+}
+
+
+/**
+ * Embed a complete htsmsg
+ */
+void
+json_add_msg(json_writer_t *jw, const char *name, htsmsg_t *msg)
+{
+  json_name(jw, name);
+  htsmsg_json_write(msg, jw->jw_hq, msg->hm_islist, 0, 0);
+}
+
+
+
 static const char *htsmsg_json_parse_value(const char *s, 
 					   htsmsg_t *parent, char *name);
 
@@ -29,4 +29,34 @@ htsmsg_t *htsmsg_json_deserialize(const char *src);
 
 int htsmsg_json_serialize(htsmsg_t *msg, htsbuf_queue_t *hq, int pretty);
 
+/**
+ * Streaming JSON writer
+ *
+ * Writes JSON straight to a htsbuf queue without building a htsmsg
+ * tree first. 'name' is ignored for values inside lists and at the
+ * top level. NULL strings are omitted.
+ */
+typedef struct json_writer {
+  htsbuf_queue_t *jw_hq;
+  int jw_depth;
+  uint32_t jw_islist;    /* One bit per depth */
+  uint32_t jw_nonempty;  /* One bit per depth */
+} json_writer_t;
+
+void json_writer_init(json_writer_t *jw, htsbuf_queue_t *hq);
+
+void json_begin_map(json_writer_t *jw, const char *name);
+
+void json_end_map(json_writer_t *jw);
+
+void json_begin_list(json_writer_t *jw, const char *name);
+
+void json_end_list(json_writer_t *jw);
+
+void json_add_str(json_writer_t *jw, const char *name, const char *str);
+
+void json_add_s64(json_writer_t *jw, const char *name, int64_t v);
+
+void json_add_msg(json_writer_t *jw, const char *name, htsmsg_t *msg);
+
 #endif /* HTSMSG_JSON_H_ */
@@ -39,6 +39,7 @@
 #include "streaming.h"
 #include "psi.h"
 #include "htsmsg_binary.h"
+#include "timeshift.h"
 
 #include <sys/statvfs.h>
 #include "settings.h"
@@ -46,7 +47,7 @@
 
 static void *htsp_server;
 
-#define HTSP_PROTO_VERSION 5
+#define HTSP_PROTO_VERSION 6
 
 #define HTSP_PRIV_MASK (ACCESS_STREAMING)
 
@@ -61,6 +62,39 @@ TAILQ_HEAD(htsp_msg_q_queue, htsp_msg_q);
 
 static struct htsp_connection_list htsp_async_connections;
 
+/**
+ * Change sequence for incremental async sync.
+ *
+ * Every add / update of a tag, channel or dvr entry stamps the object
+ * with a new sequence number and every deletion leaves a tombstone.
+ * A client that reconnects passes the last sequence number it has seen
+ * (and the epoch it got it from) and only receives what changed since.
+ *
+ * All of this is protected by global_lock
+ */
+#define HTSP_SYNC_CHUNK     100   /* Objects sent per global_lock hold */
+#define HTSP_TOMBSTONES_MAX 4096
+
+#define HTSP_CHANGED(seq, since) ((since) == 0 || (seq) > (since))
+
+#define HTSP_OBJ_TAG     0
+#define HTSP_OBJ_CHANNEL 1
+#define HTSP_OBJ_DVR     2
+
+typedef struct htsp_tombstone {
+  TAILQ_ENTRY(htsp_tombstone) ht_link;
+  int ht_type;
+  uint32_t ht_id;
+  uint32_t ht_seq;
+} htsp_tombstone_t;
+
+static TAILQ_HEAD(, htsp_tombstone) htsp_tombstones =
+  TAILQ_HEAD_INITIALIZER(htsp_tombstones);
+static int htsp_tombstone_count;
+static uint32_t htsp_tombstone_horizon; /* Older deletions are forgotten */
+static uint32_t htsp_change_seq;
+static uint32_t htsp_sync_epoch;
+
 static void htsp_streaming_input(void *opaque, streaming_message_t *sm);
 
 
@@ -77,7 +111,9 @@ typedef struct htsp_msg {
   pktbuf_t *hm_pb;      /* For keeping reference to packet payload.
 			   hm_msg can contain messages that points
 			   to packet payload so to avoid copy we
-			   keep a reference here */
+			   keep a reference here.
+			   If hm_msg is NULL, hm_pb is an already serialized
+			   message shared between all async connections */
 } htsp_msg_t;
 
 
@@ -440,48 +476,223 @@ htsp_reply(htsp_connection_t *htsp, htsmsg_t *in, htsmsg_t *out)
 
 
 /**
- * Switch the HTSP connection into async mode
+ *
+ */
+static uint32_t
+htsp_change(void)
+{
+  lock_assert(&global_lock);
+  return ++htsp_change_seq;
+}
+
+
+/**
+ *
+ */
+static void
+htsp_tombstone_add(int type, uint32_t id)
+{
+  htsp_tombstone_t *ht = malloc(sizeof(htsp_tombstone_t));
+
+  ht->ht_type = type;
+  ht->ht_id = id;
+  ht->ht_seq = htsp_change();
+  TAILQ_INSERT_TAIL(&htsp_tombstones, ht, ht_link);
+
+  if(++htsp_tombstone_count > HTSP_TOMBSTONES_MAX) {
+    ht = TAILQ_FIRST(&htsp_tombstones);
+    htsp_tombstone_horizon = ht->ht_seq;
+    TAILQ_REMOVE(&htsp_tombstones, ht, ht_link);
+    htsp_tombstone_count--;
+    free(ht);
+  }
+}
+
+
+/**
+ *
  */
 static htsmsg_t *
-htsp_method_async(htsp_connection_t *htsp, htsmsg_t *in)
+htsp_build_channel_current(channel_t *ch)
 {
+  htsmsg_t *m = htsmsg_create_map();
+  htsmsg_add_str(m, "method", "channelUpdate");
+  htsmsg_add_u32(m, "channelId", ch->ch_id);
+
+  htsmsg_add_u32(m, "eventId",
+		 ch->ch_epg_current ? ch->ch_epg_current->e_id : 0);
+  htsmsg_add_u32(m, "nextEventId",
+		 ch->ch_epg_next ? ch->ch_epg_next->e_id : 0);
+  return m;
+}
+
+
+/**
+ * Give other threads a chance to grab global_lock every
+ * HTSP_SYNC_CHUNK objects during initial sync
+ */
+static void
+htsp_sync_yield(int *cnt)
+{
+  if(++*cnt < HTSP_SYNC_CHUNK)
+    return;
+  *cnt = 0;
+  pthread_mutex_unlock(&global_lock);
+  sched_yield();
+  pthread_mutex_lock(&global_lock);
+}
+
+
+/**
+ * Send everything that changed after 'since' (everything if 0).
+ * Object ids are collected first since global_lock is dropped
+ * between chunks and objects may go away meanwhile.
+ */
+static void
+htsp_sync_delta(htsp_connection_t *htsp, uint32_t since)
+{
+  htsp_tombstone_t *ht;
   channel_t *ch;
   channel_tag_t *ct;
   dvr_entry_t *de;
   htsmsg_t *m;
+  int *ids, n = 0, i, cnt = 0;
 
-  /* First, just OK the async request */
-  htsp_reply(htsp, in, htsmsg_create_map()); 
-
-  if(htsp->htsp_async_mode)
-    return NULL; /* already in async mode */
-
-  htsp->htsp_async_mode = 1;
+  /* Deletions first, an object may have been deleted and recreated */
+  if(since)
+    TAILQ_FOREACH(ht, &htsp_tombstones, ht_link) {
+      if(ht->ht_seq <= since)
+	continue;
+      m = htsmsg_create_map();
+      switch(ht->ht_type) {
+      case HTSP_OBJ_TAG:
+	htsmsg_add_u32(m, "tagId", ht->ht_id);
+	htsmsg_add_str(m, "method", "tagDelete");
+	break;
+      case HTSP_OBJ_CHANNEL:
+	htsmsg_add_u32(m, "channelId", ht->ht_id);
+	htsmsg_add_str(m, "method", "channelDelete");
+	break;
+      case HTSP_OBJ_DVR:
+	htsmsg_add_u32(m, "id", ht->ht_id);
+	htsmsg_add_str(m, "method", "dvrEntryDelete");
+	break;
+      }
+      htsp_send_message(htsp, m, NULL);
+    }
 
-  /* Send all enabled and external tags */
+  /* Send all new enabled and external tags */
   TAILQ_FOREACH(ct, &channel_tags, ct_link)
-    if(ct->ct_enabled && !ct->ct_internal)
+    if(ct->ct_enabled && !ct->ct_internal &&
+       HTSP_CHANGED(ct->ct_htsp_created, since))
       htsp_send_message(htsp, htsp_build_tag(ct, "tagAdd", 0), NULL);
-  
-  /* Send all channels */
+
+  /* Send all changed channels */
   RB_FOREACH(ch, &channel_name_tree, ch_name_link)
-    htsp_send_message(htsp, htsp_build_channel(ch, "channelAdd"), NULL);
-    
-  /* Send all enabled and external tags (now with channel mappings) */
+    n++;
+  ids = malloc(sizeof(int) * (n + 1));
+  n = 0;
+  RB_FOREACH(ch, &channel_name_tree, ch_name_link)
+    if(HTSP_CHANGED(ch->ch_htsp_seq, since) || ch->ch_htsp_epg_seq > since)
+      ids[n++] = ch->ch_id;
+
+  for(i = 0; i < n; i++) {
+    if((ch = channel_find_by_identifier(ids[i])) == NULL)
+      continue;
+    if(HTSP_CHANGED(ch->ch_htsp_seq, since))
+      m = htsp_build_channel(ch, HTSP_CHANGED(ch->ch_htsp_created, since) ?
+			     "channelAdd" : "channelUpdate");
+    else
+      m = htsp_build_channel_current(ch);
+    htsp_send_message(htsp, m, NULL);
+    htsp_sync_yield(&cnt);
+  }
+  free(ids);
+
+  /* Send all changed enabled and external tags (now with channel mappings) */
   TAILQ_FOREACH(ct, &channel_tags, ct_link)
-    if(ct->ct_enabled && !ct->ct_internal)
+    if(ct->ct_enabled && !ct->ct_internal &&
+       HTSP_CHANGED(ct->ct_htsp_seq, since))
       htsp_send_message(htsp, htsp_build_tag(ct, "tagUpdate", 1), NULL);
 
-  /* Send all DVR entries */
+  /* Send all changed DVR entries */
+  n = 0;
   LIST_FOREACH(de, &dvrentries, de_global_link)
-    htsp_send_message(htsp, htsp_build_dvrentry(de, "dvrEntryAdd"), NULL);
+    n++;
+  ids = malloc(sizeof(int) * (n + 1));
+  n = 0;
+  LIST_FOREACH(de, &dvrentries, de_global_link)
+    if(HTSP_CHANGED(de->de_htsp_seq, since))
+      ids[n++] = de->de_id;
+
+  for(i = 0; i < n; i++) {
+    if((de = dvr_entry_find_by_id(ids[i])) == NULL ||
+       !HTSP_CHANGED(de->de_htsp_seq, since))
+      continue;
+    m = htsp_build_dvrentry(de, HTSP_CHANGED(de->de_htsp_created, since) ?
+			    "dvrEntryAdd" : "dvrEntryUpdate");
+    htsp_send_message(htsp, m, NULL);
+    htsp_sync_yield(&cnt);
+  }
+  free(ids);
+}
+
+
+/**
+ * Switch the HTSP connection into async mode
+ *
+ * If the client supplies 'syncEpoch' and 'changeSeq' from an earlier
+ * session it only gets what changed since then. If that is not
+ * possible (server restarted, too many deletions since) a full sync
+ * is done and 'fullSync' is set in the reply, telling the client to
+ * drop whatever it has cached.
+ */
+static htsmsg_t *
+htsp_method_async(htsp_connection_t *htsp, htsmsg_t *in)
+{
+  htsmsg_t *m;
+  uint32_t epoch, since, target;
+  int full;
+
+  if(htsmsg_get_u32(in, "syncEpoch", &epoch) ||
+     htsmsg_get_u32(in, "changeSeq", &since))
+    epoch = since = 0;
+
+  full = since == 0 || epoch != htsp_sync_epoch ||
+    since < htsp_tombstone_horizon || since > htsp_change_seq;
+  if(full)
+    since = 0;
+
+  /* First, just OK the async request */
+  m = htsmsg_create_map();
+  if(!htsp->htsp_async_mode) {
+    htsmsg_add_u32(m, "syncEpoch", htsp_sync_epoch);
+    htsmsg_add_u32(m, "fullSync", full);
+  }
+  htsp_reply(htsp, in, m);
+
+  if(htsp->htsp_async_mode)
+    return NULL; /* already in async mode */
+
+  /**
+   * global_lock is released now and then during sync, so keep going
+   * until nothing has changed behind our back
+   */
+  do {
+    target = htsp_change_seq;
+    htsp_sync_delta(htsp, since);
+    since = target;
+  } while(since != htsp_change_seq);
 
   /* Notify that initial sync has been completed */
   m = htsmsg_create_map();
   htsmsg_add_str(m, "method", "initialSyncCompleted");
+  htsmsg_add_u32(m, "syncEpoch", htsp_sync_epoch);
+  htsmsg_add_u32(m, "changeSeq", htsp_change_seq);
   htsp_send_message(htsp, m, NULL);
 
   /* Insert in list so it will get all updates */
+  htsp->htsp_async_mode = 1;
   LIST_INSERT_HEAD(&htsp_async_connections, htsp, htsp_async_link);
 
   return NULL;
@@ -852,6 +1063,8 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
   uint32_t chid, sid, weight;
   channel_t *ch;
   htsp_subscription_t *hs;
+  htsmsg_t *r;
+  int flags = 0;
 
   if(htsmsg_get_u32(in, "channelId", &chid))
     return htsp_error("Missing argument 'channeId'");
@@ -864,11 +1077,17 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
 
   weight = htsmsg_get_u32_or_default(in, "weight", 150);
 
+  r = htsmsg_create_map();
+  if(htsmsg_get_u32_or_default(in, "timeshift", 0) && timeshift_enabled()) {
+    flags |= SUBSCRIPTION_TIMESHIFT;
+    htsmsg_add_u32(r, "timeshiftPeriod", timeshift_max_duration());
+  }
+
   /*
    * We send the reply now to avoid the user getting the 'subscriptionStart'
    * async message before the reply to 'subscribe'.
    */
-  htsp_reply(htsp, in, htsmsg_create_map());
+  htsp_reply(htsp, in, r);
 
   /* Initialize the HTSP subscription structure */
 
@@ -883,11 +1102,103 @@ htsp_method_subscribe(htsp_connection_t *htsp, htsmsg_t *in)
 
   hs->hs_s = subscription_create_from_channel(ch, weight,
 					      htsp->htsp_logname,
-					      &hs->hs_input, 0);
+					      &hs->hs_input, flags);
   return NULL;
 }
 
 
+/**
+ * Find the timeshift reader of a subscription
+ */
+static struct timeshift_reader *
+htsp_timeshift_reader(htsp_connection_t *htsp, htsmsg_t *in,
+		      htsmsg_t **err)
+{
+  htsp_subscription_t *hs;
+  uint32_t sid;
+
+  if(htsmsg_get_u32(in, "subscriptionId", &sid)) {
+    *err = htsp_error("Missing argument 'subscriptionId'");
+    return NULL;
+  }
+
+  LIST_FOREACH(hs, &htsp->htsp_subscriptions, hs_link)
+    if(hs->hs_sid == sid)
+      break;
+
+  if(hs == NULL) {
+    *err = htsp_error("Requested subscription does not exist");
+    return NULL;
+  }
+
+  if(hs->hs_s->ths_timeshift == NULL) {
+    *err = htsp_error("Subscription is not timeshifting");
+    return NULL;
+  }
+  return hs->hs_s->ths_timeshift;
+}
+
+
+/**
+ * Seek in a timeshifting subscription, 'time' (us) is relative to
+ * the current position
+ */
+static htsmsg_t *
+htsp_method_subscriptionSeek(htsp_connection_t *htsp, htsmsg_t *in)
+{
+  struct timeshift_reader *rd;
+  htsmsg_t *err;
+  int64_t time;
+
+  if((rd = htsp_timeshift_reader(htsp, in, &err)) == NULL)
+    return err;
+
+  if(htsmsg_get_s64(in, "time", &time))
+    return htsp_error("Missing argument 'time'");
+
+  timeshift_reader_seek(rd, time);
+  return htsmsg_create_map();
+}
+
+
+/**
+ * Set speed of a timeshifting subscription in percent, 0 pauses
+ */
+static htsmsg_t *
+htsp_method_subscriptionSpeed(htsp_connection_t *htsp, htsmsg_t *in)
+{
+  struct timeshift_reader *rd;
+  htsmsg_t *err;
+  int32_t speed;
+
+  if((rd = htsp_timeshift_reader(htsp, in, &err)) == NULL)
+    return err;
+
+  if(htsmsg_get_s32(in, "speed", &speed))
+    return htsp_error("Missing argument 'speed'");
+
+  timeshift_reader_speed(rd, speed);
+  return htsmsg_create_map();
+}
+
+
+/**
+ * Return a timeshifting subscription to live
+ */
+static htsmsg_t *
+htsp_method_subscriptionLive(htsp_connection_t *htsp, htsmsg_t *in)
+{
+  struct timeshift_reader *rd;
+  htsmsg_t *err;
+
+  if((rd = htsp_timeshift_reader(htsp, in, &err)) == NULL)
+    return err;
+
+  timeshift_reader_live(rd);
+  return htsmsg_create_map();
+}
+
+
 /**
  * Request unsubscription for a channel
  */
@@ -1029,6 +1340,9 @@ struct {
   { "subscribe", htsp_method_subscribe, ACCESS_STREAMING},
   { "unsubscribe", htsp_method_unsubscribe, ACCESS_STREAMING},
   { "subscriptionChangeWeight", htsp_method_change_weight, ACCESS_STREAMING},
+  { "subscriptionSeek", htsp_method_subscriptionSeek, ACCESS_STREAMING},
+  { "subscriptionSpeed", htsp_method_subscriptionSpeed, ACCESS_STREAMING},
+  { "subscriptionLive", htsp_method_subscriptionLive, ACCESS_STREAMING},
   { "addDvrEntry", htsp_method_addDvrEntry, ACCESS_RECORDER},
   { "updateDvrEntry", htsp_method_updateDvrEntry, ACCESS_RECORDER},
   { "cancelDvrEntry", htsp_method_cancelDvrEntry, ACCESS_RECORDER},
@@ -1243,21 +1557,28 @@ htsp_write_scheduler(void *aux)
 
     pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
-    r = htsmsg_binary_serialize(hm->hm_msg, &dptr, &dlen, INT32_MAX);
+    if(hm->hm_msg == NULL) {
+      /* Pre-serialized broadcast, see htsp_async_send() */
+      dptr = pktbuf_ptr(hm->hm_pb);
+      dlen = pktbuf_len(hm->hm_pb);
+    } else {
+      r = htsmsg_binary_serialize(hm->hm_msg, &dptr, &dlen, INT32_MAX);
+    }
 
 #if 0
     if(hm->hm_pktref) {
       usleep(hm->hm_payloadsize * 3);
     }
 #endif
-    htsp_msg_destroy(hm);
    
     /* ignore return value */ 
     r = write(htsp->htsp_fd, dptr, dlen);
     if(r != dlen)
       tvhlog(LOG_INFO, "htsp", "%s: Write error -- %s", 
 	     htsp->htsp_logname, strerror(errno));
-    free(dptr);
+    if(hm->hm_msg != NULL)
+      free(dptr);
+    htsp_msg_destroy(hm);
     pthread_mutex_lock(&htsp->htsp_out_mutex);
     if(r != dlen) 
       break;
@@ -1344,6 +1665,7 @@ htsp_serve(int fd, void *opaque, struct sockaddr_in *source,
 void
 htsp_init(void)
 {
+  htsp_sync_epoch = time(NULL);
   htsp_server = tcp_server_create(9982, htsp_serve, NULL);
 }
 
@@ -1354,10 +1676,32 @@ static void
 htsp_async_send(htsmsg_t *m)
 {
   htsp_connection_t *htsp;
+  pktbuf_t *pb;
+  void *dptr;
+  size_t dlen;
 
-  LIST_FOREACH(htsp, &htsp_async_connections, htsp_async_link)
-    htsp_send_message(htsp, htsmsg_copy(m), NULL);
+  if(LIST_FIRST(&htsp_async_connections) == NULL) {
+    htsmsg_destroy(m);
+    return;
+  }
+
+  htsmsg_add_u32(m, "changeSeq", htsp_change_seq);
+
+  /**
+   * Serialize once and let all connections share the result. The
+   * message is the same for everyone, so there is no need to copy
+   * and encode it for each and every client.
+   */
+  if(htsmsg_binary_serialize(m, &dptr, &dlen, INT32_MAX) < 0) {
+    htsmsg_destroy(m);
+    return;
+  }
   htsmsg_destroy(m);
+
+  pb = pktbuf_make(dptr, dlen);
+  LIST_FOREACH(htsp, &htsp_async_connections, htsp_async_link)
+    htsp_send(htsp, NULL, pb, &htsp->htsp_hmq_ctrl, 0);
+  pktbuf_ref_dec(pb);
 }
 
 
@@ -1370,19 +1714,8 @@ htsp_async_send(htsmsg_t *m)
 void
 htsp_channel_update_current(channel_t *ch)
 {
-  htsmsg_t *m;
-  time_t now;
-
-  time(&now);
-  m = htsmsg_create_map();
-  htsmsg_add_str(m, "method", "channelUpdate");
-  htsmsg_add_u32(m, "channelId", ch->ch_id);
-
-  htsmsg_add_u32(m, "eventId",
-		 ch->ch_epg_current ? ch->ch_epg_current->e_id : 0);
-  htsmsg_add_u32(m, "nextEventId",
-		 ch->ch_epg_next ? ch->ch_epg_next->e_id : 0);
-  htsp_async_send(m);
+  ch->ch_htsp_epg_seq = htsp_change();
+  htsp_async_send(htsp_build_channel_current(ch));
 }
 
 /**
@@ -1391,6 +1724,7 @@ htsp_channel_update_current(channel_t *ch)
 void
 htsp_channel_add(channel_t *ch)
 {
+  ch->ch_htsp_created = ch->ch_htsp_seq = htsp_change();
   htsp_async_send(htsp_build_channel(ch, "channelAdd"));
 }
 
@@ -1401,6 +1735,7 @@ htsp_channel_add(channel_t *ch)
 void
 htsp_channel_update(channel_t *ch)
 {
+  ch->ch_htsp_seq = htsp_change();
   htsp_async_send(htsp_build_channel(ch, "channelUpdate"));
 }
 
@@ -1412,6 +1747,7 @@ void
 htsp_channel_delete(channel_t *ch)
 {
   htsmsg_t *m = htsmsg_create_map();
+  htsp_tombstone_add(HTSP_OBJ_CHANNEL, ch->ch_id);
   htsmsg_add_u32(m, "channelId", ch->ch_id);
   htsmsg_add_str(m, "method", "channelDelete");
   htsp_async_send(m);
@@ -1424,6 +1760,7 @@ htsp_channel_delete(channel_t *ch)
 void
 htsp_tag_add(channel_tag_t *ct)
 {
+  ct->ct_htsp_created = ct->ct_htsp_seq = htsp_change();
   htsp_async_send(htsp_build_tag(ct, "tagAdd", 1));
 }
 
@@ -1434,6 +1771,7 @@ htsp_tag_add(channel_tag_t *ct)
 void
 htsp_tag_update(channel_tag_t *ct)
 {
+  ct->ct_htsp_seq = htsp_change();
   htsp_async_send(htsp_build_tag(ct, "tagUpdate", 1));
 }
 
@@ -1445,6 +1783,7 @@ void
 htsp_tag_delete(channel_tag_t *ct)
 {
   htsmsg_t *m = htsmsg_create_map();
+  htsp_tombstone_add(HTSP_OBJ_TAG, ct->ct_identifier);
   htsmsg_add_u32(m, "tagId", ct->ct_identifier);
   htsmsg_add_str(m, "method", "tagDelete");
   htsp_async_send(m);
@@ -1457,6 +1796,7 @@ htsp_tag_delete(channel_tag_t *ct)
 void
 htsp_dvr_entry_add(dvr_entry_t *de)
 {
+  de->de_htsp_created = de->de_htsp_seq = htsp_change();
   htsp_async_send(htsp_build_dvrentry(de, "dvrEntryAdd"));
 }
 
@@ -1467,6 +1807,7 @@ htsp_dvr_entry_add(dvr_entry_t *de)
 void
 htsp_dvr_entry_update(dvr_entry_t *de)
 {
+  de->de_htsp_seq = htsp_change();
   htsp_async_send(htsp_build_dvrentry(de, "dvrEntryUpdate"));
 }
 
@@ -1478,6 +1819,7 @@ void
 htsp_dvr_entry_delete(dvr_entry_t *de)
 {
   htsmsg_t *m = htsmsg_create_map();
+  htsp_tombstone_add(HTSP_OBJ_DVR, de->de_id);
   htsmsg_add_u32(m, "id", de->de_id);
   htsmsg_add_str(m, "method", "dvrEntryDelete");
   htsp_async_send(m);
@@ -1717,6 +2059,31 @@ htsp_subscription_service_status(htsp_subscription_t *hs, int status)
   }
 }
 
+/**
+ * Timeshift position changed, drop what is queued from the old
+ * position and tell the client. 'shift' is the new distance to
+ * live in ms.
+ */
+static void
+htsp_subscription_skip(htsp_subscription_t *hs, int shift)
+{
+  htsp_connection_t *htsp = hs->hs_htsp;
+  htsmsg_t *m;
+
+  pthread_mutex_lock(&htsp->htsp_out_mutex);
+  htsp_flush_queue(htsp, &hs->hs_q);
+  hs->hs_q.hmq_length = 0;
+  hs->hs_q.hmq_payload = 0;
+  pthread_mutex_unlock(&htsp->htsp_out_mutex);
+
+  m = htsmsg_create_map();
+  htsmsg_add_str(m, "method", "subscriptionSkip");
+  htsmsg_add_u32(m, "subscriptionId", hs->hs_sid);
+  htsmsg_add_s64(m, "shift", (int64_t)shift * 1000);
+  htsp_send(htsp, m, NULL, &hs->hs_q, 0);
+}
+
+
 /**
  *
  */
@@ -1747,6 +2114,10 @@ htsp_streaming_input(void *opaque, streaming_message_t *sm)
     htsp_subscription_status(hs,  streaming_code2txt(sm->sm_code));
     break;
 
+  case SMT_SKIP:
+    htsp_subscription_skip(hs, sm->sm_code);
+    break;
+
   case SMT_MPEGTS:
     break;
 
@@ -16,11 +16,13 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <assert.h>
 
@@ -41,12 +43,109 @@
 #include "psi.h"
 #include "settings.h"
 
-static int iptv_thread_running;
-static int iptv_epollfd;
-static pthread_mutex_t iptv_recvmutex;
+#define IPTV_BATCH       32   /* Datagrams per recvmmsg() call */
+#define IPTV_PKT_SIZE    8192 /* Max datagram size, 7 TS packets + RTP is 1328 */
+#define IPTV_MAX_THREADS 64
+#define IPTV_MAX_SLOTS   64   /* Services per socket, one bit each */
+
+/**
+ * A socket joined to a multicast group. All services on the same
+ * (interface, group, port) share one socket, the datagrams are only
+ * received and stripped once and the TS packets are fanned out to
+ * the services by PID
+ *
+ * Sockets are owned by a shard and may only be looked up via the
+ * shard's fd map with ish_mutex held
+ */
+typedef struct iptv_socket {
+  LIST_ENTRY(iptv_socket) is_link;  /* iptv_sockets, global_lock */
+  int is_fd;
+  struct iptv_shard *is_shard;
+  char *is_name;
+
+  char *is_iface;
+  struct in_addr is_group;
+  struct in6_addr is_group6;
+  uint16_t is_port;
+
+  /* Protected by global_lock and ish_mutex, reading needs either */
+  struct service_list is_services;
+  int is_nservices;
+
+  /* For each PID the services (bit per slot in is_slots) that want
+     it, protected by ish_mutex */
+  uint64_t is_pidmask[8192];
+  service_t *is_slots[IPTV_MAX_SLOTS];
+
+  uint32_t is_drops;          /* Dropped by the kernel (SO_RXQ_OVFL) */
+  uint32_t is_drops_reported;
+  time_t is_drops_report_time;
+  int64_t is_truncated;       /* Datagrams larger than IPTV_PKT_SIZE */
+  int64_t is_datagrams;
+} iptv_socket_t;
+
+/**
+ * A receive thread and the sockets assigned to it
+ */
+typedef struct iptv_shard {
+  pthread_t ish_tid;
+  int ish_epollfd;
+  int ish_nsockets;           /* Protected by global_lock */
+
+  pthread_mutex_t ish_mutex;
+  iptv_socket_t **ish_fdmap;  /* fd -> socket */
+  int ish_fdmap_size;
+
+  /* recvmmsg() state, only touched by the shard's thread */
+  struct mmsghdr ish_msgs[IPTV_BATCH];
+  struct iovec ish_iov[IPTV_BATCH];
+  uint8_t ish_cmsg[IPTV_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+  uint8_t *ish_buf;
+} iptv_shard_t;
+
+static int iptv_nthreads = 1;
+static iptv_shard_t *iptv_shards;
+static LIST_HEAD(, iptv_socket) iptv_sockets;
 
 struct service_list iptv_all_services; /* All IPTV services */
-static struct service_list iptv_active_services; /* Currently enabled */
+
+/**
+ * Rebuild the per PID service masks of a socket
+ *
+ * ish_mutex must be held
+ */
+static void
+iptv_socket_update_pids(iptv_socket_t *is)
+{
+  elementary_stream_t *st;
+  service_t *t;
+  uint64_t bit;
+  int slot = 0;
+
+  memset(is->is_pidmask, 0, sizeof(is->is_pidmask));
+  memset(is->is_slots, 0, sizeof(is->is_slots));
+
+  LIST_FOREACH(t, &is->is_services, s_active_link) {
+    if(slot == IPTV_MAX_SLOTS) {
+      tvhlog(LOG_ERR, "IPTV", "%s: More than %d services on one group, "
+	     "\"%s\" will not receive any data",
+	     is->is_name, IPTV_MAX_SLOTS, t->s_identifier);
+      continue;
+    }
+
+    is->is_slots[slot] = t;
+    bit = 1ULL << slot++;
+
+    pthread_mutex_lock(&t->s_stream_mutex);
+    is->is_pidmask[0] |= bit;
+    is->is_pidmask[t->s_pmt_pid & 0x1fff] |= bit;
+    is->is_pidmask[t->s_pcr_pid & 0x1fff] |= bit;
+    TAILQ_FOREACH(st, &t->s_components, es_link)
+      is->is_pidmask[st->es_pid & 0x1fff] |= bit;
+    pthread_mutex_unlock(&t->s_stream_mutex);
+  }
+}
+
 
 /**
  * PAT parser. We only parse a single program. CRC has already been verified
@@ -66,7 +165,10 @@ iptv_got_pat(const uint8_t *ptr, size_t len, void *aux)
     pmt     = (ptr[2] & 0x1f) << 8 | ptr[3];
 
     if(prognum != 0) {
-      t->s_pmt_pid = pmt;
+      if(t->s_pmt_pid != pmt) {
+	t->s_pmt_pid = pmt;
+	iptv_socket_update_pids(t->s_iptv_socket);
+      }
       return;
     }
     ptr += 4;
@@ -89,108 +191,388 @@ iptv_got_pmt(const uint8_t *ptr, size_t len, void *aux)
   pthread_mutex_lock(&t->s_stream_mutex);
   psi_parse_pmt(t, ptr + 3, len - 3, 0, 1);
   pthread_mutex_unlock(&t->s_stream_mutex);
+
+  iptv_socket_update_pids(t->s_iptv_socket);
 }
 
 
 /**
- * Handle a single TS packet for the given IPTV service
+ * Deliver the packets of a datagram wanted by the service in 'slot'.
+ * PAT and PMT are handled here, everything else goes to the demuxer
+ * in one batch (split around PSI packets to keep the order).
  */
 static void
-iptv_ts_input(service_t *t, const uint8_t *tsb)
+iptv_service_input(iptv_socket_t *is, int slot, const tsdesc_t *tsd, int n)
 {
-  uint16_t pid = ((tsb[1] & 0x1f) << 8) | tsb[2];
-
-  if(pid == 0) {
+  service_t *t = is->is_slots[slot];
+  uint64_t bit = 1ULL << slot;
+  tsdesc_t sel[IPTV_PKT_SIZE / 188];
+  int i, k = 0, pid;
+
+  for(i = 0; i < n; i++, tsd++) {
+    pid = tsd->tsd_pid;
+    if(!(is->is_pidmask[pid] & bit))
+      continue;
 
-    if(t->s_pat_section == NULL)
-      t->s_pat_section = calloc(1, sizeof(psi_section_t));
-    psi_section_reassemble(t->s_pat_section, tsb, 1, iptv_got_pat, t);
+    if(pid == 0) {
+      ts_recv_packets(t, sel, k);
+      k = 0;
+      if(t->s_pat_section == NULL)
+	t->s_pat_section = calloc(1, sizeof(psi_section_t));
+      psi_section_reassemble(t->s_pat_section, tsd->tsd_tsb, 1,
+			     iptv_got_pat, t);
+
+    } else if(pid == t->s_pmt_pid) {
+      ts_recv_packets(t, sel, k);
+      k = 0;
+      if(t->s_pmt_section == NULL)
+	t->s_pmt_section = calloc(1, sizeof(psi_section_t));
+      psi_section_reassemble(t->s_pmt_section, tsd->tsd_tsb, 1,
+			     iptv_got_pmt, t);
 
-  } else if(pid == t->s_pmt_pid) {
+    } else {
+      sel[k++] = *tsd;
+    }
+  }
+  ts_recv_packets(t, sel, k);
+}
 
-    if(t->s_pmt_section == NULL)
-      t->s_pmt_section = calloc(1, sizeof(psi_section_t));
-    psi_section_reassemble(t->s_pmt_section, tsb, 1, iptv_got_pmt, t);
 
+/**
+ * Strip RTP header (if any) and fan out the TS packets of a datagram
+ * to the services that want them
+ */
+static void
+iptv_datagram_input(iptv_socket_t *is, uint8_t *tsb, int r)
+{
+  tsdesc_t tsd[IPTV_PKT_SIZE / 188];
+  uint64_t mask = 0;
+  uint8_t *buf;
+  int j, n, hlen;
+
+  if(r > 1 && tsb[0] == 0x47 && (r % 188) == 0) {
+    /* Looks like raw TS in UDP */
+    buf = tsb;
   } else {
-    ts_recv_packet1(t, tsb, NULL);
-  } 
+    /* Check for valid RTP packets */
+    if(r < 12)
+      return;
+
+    if((tsb[0] & 0xc0) != 0x80)
+      return;
+
+    if((tsb[1] & 0x7f) != 33)
+      return;
+
+    hlen = (tsb[0] & 0xf) * 4 + 12;
+
+    if(tsb[0] & 0x10) {
+      // Extension (X bit) == true
+
+      if(r < hlen + 4)
+	return; // Packet size < hlen + extension header
+
+      // Skip over extension header (last 2 bytes of header is length)
+      hlen += ((tsb[hlen + 2] << 8) | tsb[hlen + 3]) * 4;
+      // Add the extension header itself (EHL does not inc header)
+      hlen += 4;
+    }
+
+    if(r < hlen || (r - hlen) % 188 != 0)
+      return;
+
+    buf = tsb + hlen;
+    r -= hlen;
+  }
+
+  /* Parse the headers once, then hand each service only its PIDs */
+  n = MIN(r / 188, IPTV_PKT_SIZE / 188);
+  ts_parse_packets(buf, n, tsd);
+
+  for(j = 0; j < n; j++)
+    mask |= is->is_pidmask[tsd[j].tsd_pid];
+
+  while(mask) {
+    j = __builtin_ctzll(mask);
+    mask &= mask - 1;
+    iptv_service_input(is, j, tsd, n);
+  }
+}
+
+
+/**
+ * Read one batch of datagrams from a socket
+ *
+ * ish_mutex must be held
+ */
+static void
+iptv_socket_read(iptv_shard_t *ish, iptv_socket_t *is)
+{
+  struct mmsghdr *mm;
+  int i, n;
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *cm;
+#endif
+
+  for(i = 0; i < IPTV_BATCH; i++) {
+    mm = &ish->ish_msgs[i];
+    mm->msg_hdr.msg_control = ish->ish_cmsg[i];
+    mm->msg_hdr.msg_controllen = sizeof(ish->ish_cmsg[i]);
+    mm->msg_hdr.msg_flags = 0;
+  }
+
+  n = recvmmsg(is->is_fd, ish->ish_msgs, IPTV_BATCH, MSG_DONTWAIT, NULL);
+  if(n <= 0)
+    return;
+
+  is->is_datagrams += n;
+
+  for(i = 0; i < n; i++) {
+    mm = &ish->ish_msgs[i];
+
+#ifdef SO_RXQ_OVFL
+    for(cm = CMSG_FIRSTHDR(&mm->msg_hdr); cm != NULL;
+	cm = CMSG_NXTHDR(&mm->msg_hdr, cm))
+      if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+	memcpy(&is->is_drops, CMSG_DATA(cm), sizeof(uint32_t));
+#endif
+
+    if(mm->msg_hdr.msg_flags & MSG_TRUNC) {
+      is->is_truncated++;
+      continue;
+    }
+
+    iptv_datagram_input(is, ish->ish_iov[i].iov_base, mm->msg_len);
+  }
+
+  if(is->is_drops != is->is_drops_reported &&
+     dispatch_clock - is->is_drops_report_time >= 10) {
+    tvhlog(LOG_WARNING, "IPTV", "%s: %u datagrams dropped by kernel, "
+	   "receive buffer overrun",
+	   is->is_name,
+	   is->is_drops - is->is_drops_reported);
+    is->is_drops_reported = is->is_drops;
+    is->is_drops_report_time = dispatch_clock;
+  }
 }
 
 
 /**
- * Main epoll() based input thread for IPTV
+ * epoll() based input thread, one per shard
  */
 static void *
 iptv_thread(void *aux)
 {
-  int nfds, fd, r, j, hlen;
-  uint8_t tsb[65536], *buf;
-  struct epoll_event ev;
-  service_t *t;
+  iptv_shard_t *ish = aux;
+  struct epoll_event ev[IPTV_BATCH];
+  iptv_socket_t *is;
+  int nfds, fd, i;
 
   while(1) {
-    nfds = epoll_wait(iptv_epollfd, &ev, 1, -1);
+    nfds = epoll_wait(ish->ish_epollfd, ev, IPTV_BATCH, -1);
     if(nfds == -1) {
+      if(errno == EINTR)
+	continue;
       tvhlog(LOG_ERR, "IPTV", "epoll() error -- %s, sleeping 1 second",
 	     strerror(errno));
       sleep(1);
       continue;
     }
 
-    if(nfds < 1)
-      continue;
+    for(i = 0; i < nfds; i++) {
+      fd = ev[i].data.fd;
 
-    fd = ev.data.fd;
-    r = read(fd, tsb, sizeof(tsb));
+      pthread_mutex_lock(&ish->ish_mutex);
+      if(fd < ish->ish_fdmap_size && (is = ish->ish_fdmap[fd]) != NULL)
+	iptv_socket_read(ish, is);
+      pthread_mutex_unlock(&ish->ish_mutex);
+    }
+  }
+  return NULL;
+}
 
-    if(r > 1 && tsb[0] == 0x47 && (r % 188) == 0) {
-      /* Looks like raw TS in UDP */
-      buf = tsb;
-    } else {
-      /* Check for valid RTP packets */
-      if(r < 12)
-	continue;
 
-      if((tsb[0] & 0xc0) != 0x80)
-	continue;
+/**
+ * Start the receive threads, done on first service start
+ */
+static void
+iptv_shards_start(void)
+{
+  iptv_shard_t *ish;
+  struct msghdr *mh;
+  int i, j;
+
+  iptv_shards = calloc(iptv_nthreads, sizeof(iptv_shard_t));
+
+  for(i = 0; i < iptv_nthreads; i++) {
+    ish = &iptv_shards[i];
+    pthread_mutex_init(&ish->ish_mutex, NULL);
+    ish->ish_epollfd = epoll_create(10);
+    ish->ish_buf = malloc(IPTV_BATCH * IPTV_PKT_SIZE);
+
+    for(j = 0; j < IPTV_BATCH; j++) {
+      ish->ish_iov[j].iov_base = ish->ish_buf + j * IPTV_PKT_SIZE;
+      ish->ish_iov[j].iov_len  = IPTV_PKT_SIZE;
+      mh = &ish->ish_msgs[j].msg_hdr;
+      mh->msg_iov = &ish->ish_iov[j];
+      mh->msg_iovlen = 1;
+    }
+    pthread_create(&ish->ish_tid, NULL, iptv_thread, ish);
+  }
 
-      if((tsb[1] & 0x7f) != 33)
-	continue;
-      
-      hlen = (tsb[0] & 0xf) * 4 + 12;
+  if(iptv_nthreads > 1)
+    tvhlog(LOG_INFO, "IPTV", "Using %d receive threads", iptv_nthreads);
+}
 
-      if(tsb[0] & 0x10) {
-	// Extension (X bit) == true
 
-	if(r < hlen + 4)
-	  continue; // Packet size < hlen + extension header
+/**
+ * Find the socket already joined to the service's group, if any
+ */
+static iptv_socket_t *
+iptv_socket_find(service_t *t)
+{
+  iptv_socket_t *is;
+
+  LIST_FOREACH(is, &iptv_sockets, is_link)
+    if(is->is_port == t->s_iptv_port &&
+       is->is_group.s_addr == t->s_iptv_group.s_addr &&
+       !memcmp(&is->is_group6, &t->s_iptv_group6, sizeof(struct in6_addr)) &&
+       !strcmp(is->is_iface ?: "", t->s_iptv_iface ?: ""))
+      return is;
+  return NULL;
+}
 
-	// Skip over extension header (last 2 bytes of header is length)
-	hlen += ((tsb[hlen + 2] << 8) | tsb[hlen + 3]) * 4;
-	// Add the extension header itself (EHL does not inc header)
-	hlen += 4;
-      }
 
-      if(r < hlen || (r - hlen) % 188 != 0)
-	continue;
+/**
+ * Add a service to a socket's fan-out list
+ */
+static void
+iptv_socket_attach(iptv_socket_t *is, service_t *t)
+{
+  pthread_mutex_lock(&is->is_shard->ish_mutex);
+  LIST_INSERT_HEAD(&is->is_services, t, s_active_link);
+  is->is_nservices++;
+  t->s_iptv_socket = is;
+  t->s_iptv_fd = is->is_fd;
+  iptv_socket_update_pids(is);
+  pthread_mutex_unlock(&is->is_shard->ish_mutex);
+}
 
-      buf = tsb + hlen;
-      r -= hlen;
-    }
 
-    pthread_mutex_lock(&iptv_recvmutex);
-    
-    LIST_FOREACH(t, &iptv_active_services, s_active_link) {
-      if(t->s_iptv_fd != fd)
-	continue;
-      
-      for(j = 0; j < r; j += 188)
-	iptv_ts_input(t, buf + j);
-    }
-    pthread_mutex_unlock(&iptv_recvmutex);
+/**
+ * Create the shared socket for a group and assign it to the least
+ * loaded shard
+ */
+static iptv_socket_t *
+iptv_socket_create(service_t *t, int fd)
+{
+  iptv_shard_t *ish;
+  iptv_socket_t *is;
+  struct epoll_event ev;
+  char straddr[INET6_ADDRSTRLEN], name[256];
+  int i, n;
+
+  if(iptv_shards == NULL)
+    iptv_shards_start();
+
+  ish = &iptv_shards[0];
+  for(i = 1; i < iptv_nthreads; i++)
+    if(iptv_shards[i].ish_nsockets < ish->ish_nsockets)
+      ish = &iptv_shards[i];
+
+  if(t->s_iptv_group.s_addr != 0)
+    inet_ntop(AF_INET, &t->s_iptv_group, straddr, sizeof(straddr));
+  else
+    inet_ntop(AF_INET6, &t->s_iptv_group6, straddr, sizeof(straddr));
+  snprintf(name, sizeof(name), "%s/%s:%d",
+	   t->s_iptv_iface ?: "", straddr, t->s_iptv_port);
+
+  is = calloc(1, sizeof(iptv_socket_t));
+  is->is_fd = fd;
+  is->is_shard = ish;
+  is->is_name = strdup(name);
+  is->is_iface = t->s_iptv_iface ? strdup(t->s_iptv_iface) : NULL;
+  is->is_group = t->s_iptv_group;
+  is->is_group6 = t->s_iptv_group6;
+  is->is_port = t->s_iptv_port;
+
+  pthread_mutex_lock(&ish->ish_mutex);
+  if(fd >= ish->ish_fdmap_size) {
+    n = MAX(fd + 1, ish->ish_fdmap_size * 2);
+    ish->ish_fdmap = realloc(ish->ish_fdmap, n * sizeof(iptv_socket_t *));
+    memset(ish->ish_fdmap + ish->ish_fdmap_size, 0,
+	   (n - ish->ish_fdmap_size) * sizeof(iptv_socket_t *));
+    ish->ish_fdmap_size = n;
   }
-  return NULL;
+  ish->ish_fdmap[fd] = is;
+  pthread_mutex_unlock(&ish->ish_mutex);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if(epoll_ctl(ish->ish_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    tvhlog(LOG_ERR, "IPTV", "\"%s\" cannot add to epoll set -- %s", 
+	   t->s_identifier, strerror(errno));
+    pthread_mutex_lock(&ish->ish_mutex);
+    ish->ish_fdmap[fd] = NULL;
+    pthread_mutex_unlock(&ish->ish_mutex);
+    free(is->is_iface);
+    free(is->is_name);
+    free(is);
+    return NULL;
+  }
+
+  ish->ish_nsockets++;
+  LIST_INSERT_HEAD(&iptv_sockets, is, is_link);
+  return is;
+}
+
+
+/**
+ * Remove a service from its socket. Returns the socket if this was
+ * the last service on it. The receive thread will no longer touch it
+ * and the caller should leave the group, close the fd and call
+ * iptv_socket_destroy()
+ */
+static iptv_socket_t *
+iptv_socket_detach(service_t *t)
+{
+  iptv_socket_t *is = t->s_iptv_socket;
+  iptv_shard_t *ish = is->is_shard;
+
+  pthread_mutex_lock(&ish->ish_mutex);
+  LIST_REMOVE(t, s_active_link);
+  t->s_iptv_socket = NULL;
+  t->s_iptv_fd = -1;
+  if(--is->is_nservices == 0)
+    ish->ish_fdmap[is->is_fd] = NULL;
+  else
+    iptv_socket_update_pids(is);
+  pthread_mutex_unlock(&ish->ish_mutex);
+
+  if(is->is_nservices > 0)
+    return NULL;
+
+  LIST_REMOVE(is, is_link);
+  ish->ish_nsockets--;
+  return is;
+}
+
+
+/**
+ *
+ */
+static void
+iptv_socket_destroy(iptv_socket_t *is)
+{
+  tvhlog(LOG_DEBUG, "IPTV", "%s: received %lld datagrams, "
+	 "%u dropped by kernel, %lld truncated",
+	 is->is_name, (long long)is->is_datagrams, is->is_drops,
+	 (long long)is->is_truncated);
+
+  free(is->is_iface);
+  free(is->is_name);
+  free(is);
 }
 
 
@@ -200,7 +582,6 @@ iptv_thread(void *aux)
 static int
 iptv_service_start(service_t *t, unsigned int weight, int force_start)
 {
-  pthread_t tid;
   int fd;
   char straddr[INET6_ADDRSTRLEN];
   struct ip_mreqn m;
@@ -208,14 +589,14 @@ iptv_service_start(service_t *t, unsigned int weight, int force_start)
   struct sockaddr_in sin;
   struct sockaddr_in6 sin6;
   struct ifreq ifr;
-  struct epoll_event ev;
+  iptv_socket_t *is;
 
   assert(t->s_iptv_fd == -1);
 
-  if(iptv_thread_running == 0) {
-    iptv_thread_running = 1;
-    iptv_epollfd = epoll_create(10);
-    pthread_create(&tid, NULL, iptv_thread, NULL);
+  /* Already receiving this group for another service */
+  if((is = iptv_socket_find(t)) != NULL) {
+    iptv_socket_attach(is, t);
+    return 0;
   }
 
   /* Now, open the real socket for UDP */
@@ -307,21 +688,17 @@ iptv_service_start(service_t *t, unsigned int weight, int force_start)
 	   "Can not icrease UDP receive buffer size to %d -- %s",
 	   resize, strerror(errno));
 
-  memset(&ev, 0, sizeof(ev));
-  ev.events = EPOLLIN;
-  ev.data.fd = fd;
-  if(epoll_ctl(iptv_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-    tvhlog(LOG_ERR, "IPTV", "\"%s\" cannot add to epoll set -- %s", 
-	   t->s_identifier, strerror(errno));
+#ifdef SO_RXQ_OVFL
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+#endif
+
+  if((is = iptv_socket_create(t, fd)) == NULL) {
     close(fd);
     return -1;
   }
 
-  t->s_iptv_fd = fd;
-
-  pthread_mutex_lock(&iptv_recvmutex);
-  LIST_INSERT_HEAD(&iptv_active_services, t, s_active_link);
-  pthread_mutex_unlock(&iptv_recvmutex);
+  iptv_socket_attach(is, t);
   return 0;
 }
 
@@ -343,60 +720,54 @@ static void
 iptv_service_stop(service_t *t)
 {
   struct ifreq ifr;
-
-  pthread_mutex_lock(&iptv_recvmutex);
-  LIST_REMOVE(t, s_active_link);
-  pthread_mutex_unlock(&iptv_recvmutex);
+  iptv_socket_t *is;
 
   assert(t->s_iptv_fd >= 0);
 
+  /* Other services still receiving from the group */
+  if((is = iptv_socket_detach(t)) == NULL)
+    return;
+
   /* First, resolve interface name */
   memset(&ifr, 0, sizeof(ifr));
-  snprintf(ifr.ifr_name, IFNAMSIZ, "%s", t->s_iptv_iface);
+  snprintf(ifr.ifr_name, IFNAMSIZ, "%s", is->is_iface);
   ifr.ifr_name[IFNAMSIZ - 1] = 0;
-  if(ioctl(t->s_iptv_fd, SIOCGIFINDEX, &ifr)) {
-    tvhlog(LOG_ERR, "IPTV", "\"%s\" cannot find interface %s",
-	   t->s_identifier, t->s_iptv_iface);
+  if(ioctl(is->is_fd, SIOCGIFINDEX, &ifr)) {
+    tvhlog(LOG_ERR, "IPTV", "%s: cannot find interface %s",
+	   is->is_name, is->is_iface);
   }
 
-  if(t->s_iptv_group.s_addr != 0) {
+  if(is->is_group.s_addr != 0) {
 
     struct ip_mreqn m;
     memset(&m, 0, sizeof(m));
     /* Leave multicast group */
-    m.imr_multiaddr.s_addr = t->s_iptv_group.s_addr;
+    m.imr_multiaddr.s_addr = is->is_group.s_addr;
     m.imr_address.s_addr = 0;
     m.imr_ifindex = ifr.ifr_ifindex;
     
-    if(setsockopt(t->s_iptv_fd, SOL_IP, IP_DROP_MEMBERSHIP, &m,
+    if(setsockopt(is->is_fd, SOL_IP, IP_DROP_MEMBERSHIP, &m,
 		  sizeof(struct ip_mreqn)) == -1) {
-      tvhlog(LOG_ERR, "IPTV", "\"%s\" cannot leave %s -- %s",
-	     t->s_identifier, inet_ntoa(m.imr_multiaddr), strerror(errno));
+      tvhlog(LOG_ERR, "IPTV", "%s: cannot leave group -- %s",
+	     is->is_name, strerror(errno));
     }
   } else {
-    char straddr[INET6_ADDRSTRLEN];
 
     struct ipv6_mreq m6;
     memset(&m6, 0, sizeof(m6));
 
-    m6.ipv6mr_multiaddr = t->s_iptv_group6;
+    m6.ipv6mr_multiaddr = is->is_group6;
     m6.ipv6mr_interface = ifr.ifr_ifindex;
 
-    if(setsockopt(t->s_iptv_fd, SOL_IPV6, IPV6_DROP_MEMBERSHIP, &m6,
+    if(setsockopt(is->is_fd, SOL_IPV6, IPV6_DROP_MEMBERSHIP, &m6,
 		  sizeof(struct ipv6_mreq)) == -1) {
-      inet_ntop(AF_INET6, m6.ipv6mr_multiaddr.s6_addr,
-		straddr, sizeof(straddr));
-
-      tvhlog(LOG_ERR, "IPTV", "\"%s\" cannot leave %s -- %s",
-	     t->s_identifier, straddr, strerror(errno));
+      tvhlog(LOG_ERR, "IPTV", "%s: cannot leave group -- %s",
+	     is->is_name, strerror(errno));
     }
-
-
-
   }
-  close(t->s_iptv_fd); // Automatically removes fd from epoll set
+  close(is->is_fd); // Automatically removes fd from epoll set
 
-  t->s_iptv_fd = -1;
+  iptv_socket_destroy(is);
 }
 
 
@@ -613,6 +984,14 @@ iptv_service_load(void)
 void
 iptv_input_init(void)
 {
-  pthread_mutex_init(&iptv_recvmutex, NULL);
+  htsmsg_t *m;
+  uint32_t u32;
+
+  if((m = hts_settings_load("iptv/config")) != NULL) {
+    if(!htsmsg_get_u32(m, "threads", &u32) && u32 > 0)
+      iptv_nthreads = MIN(u32, IPTV_MAX_THREADS);
+    htsmsg_destroy(m);
+  }
+
   iptv_service_load();
 }
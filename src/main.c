@@ -54,10 +54,16 @@
 #include "avahi.h"
 #include "iptv_input.h"
 #include "service.h"
+#include "packet.h"
+#include "streaming.h"
 #include "v4l.h"
 #include "trap.h"
 #include "settings.h"
+#include "atomic.h"
 #include "ffdecsa/FFdecsa.h"
+#include "tvcsa.h"
+#include "timeshift.h"
+#include "teletext.h"
 #include "upnp/tv_upnp.h"
 
 int running;
@@ -175,6 +181,16 @@ usage(const char *argv0)
   printf(" -j <id>         Statically join the given transport id\n");
   printf(" -r <tsfile>     Read the given transport stream file and present\n"
 	 "                 found services as channels\n");
+  printf(" -b <speed>[,<sink>]\n"
+	 "                 With -r, replay the file once at <speed> times\n"
+	 "                 real time (0 = unpaced) through tsfix,\n"
+	 "                 globalheaders and a sink (null or mkv:<dir>),\n"
+	 "                 print throughput and per stage CPU time and exit\n");
+  printf(" -B <services>   Benchmark CSA descrambling of 1 to <services>\n"
+	 "                 simulated services and exit\n");
+  printf(" -T <tsfile>:<pid>[:<page>,...]\n"
+	 "                 Benchmark decoding of teletext <pid> in <tsfile>\n"
+	 "                 with the given subtitle pages and exit\n");
   printf(" -A              Immediately call abort()\n");
 
   printf("\n");
@@ -241,16 +257,19 @@ main(int argc, char **argv)
   sigset_t set;
   const char *homedir;
   const char *rawts_input = NULL;
+  const char *rawts_bench = NULL;
   const char *join_transport = NULL;
   const char *confpath = NULL;
   char *p, *endp;
   uint32_t adapter_mask = 0xffffffff;
   int crash = 0;
+  int csa_bench = 0;
+  char *tt_bench = NULL;
 
   // make sure the timezone is set
   tzset();
 
-  while((c = getopt(argc, argv, "Aa:fp:u:g:c:Chdr:j:s")) != -1) {
+  while((c = getopt(argc, argv, "Aa:b:B:fp:u:g:c:Chdr:j:sT:")) != -1) {
     switch(c) {
     case 'a':
       adapter_mask = 0x0;
@@ -302,14 +321,40 @@ main(int argc, char **argv)
     case 'r':
       rawts_input = optarg;
       break;
+    case 'b':
+      rawts_bench = optarg;
+      break;
     case 'j':
       join_transport = optarg;
       break;
+    case 'B':
+      csa_bench = atoi(optarg);
+      break;
+    case 'T':
+      tt_bench = optarg;
+      break;
     default:
       usage(argv[0]);
     }
   }
 
+  if(csa_bench > 0) {
+    ffdecsa_init();
+    tvcsa_benchmark(csa_bench);
+    exit(0);
+  }
+
+  if(tt_bench != NULL) {
+    if((p = strchr(tt_bench, ':')) == NULL)
+      usage(argv[0]);
+    *p++ = 0;
+    endp = strchr(p, ':');
+    pkt_init();
+    streaming_init();
+    teletext_benchmark(tt_bench, atoi(p), endp != NULL ? endp + 1 : NULL);
+    exit(0);
+  }
+
   signal(SIGPIPE, handle_sigpipe);
 
   grp = getgrnam(groupnam ?: "video");
@@ -357,6 +402,8 @@ main(int argc, char **argv)
 
   hts_settings_init(confpath);
 
+  tvhlog_init();
+
   pthread_mutex_init(&ffmpeg_lock, NULL);
   pthread_mutex_init(&fork_lock, NULL);
   pthread_mutex_init(&global_lock, NULL);
@@ -370,10 +417,16 @@ main(int argc, char **argv)
   /**
    * Initialize subsystems
    */
+  pkt_init();
+
+  streaming_init();
+
   xmltv_init();   /* Must be initialized before channels */
 
   service_init();
 
+  timeshift_init();
+
   channels_init();
 
   access_init(createdefault);
@@ -405,7 +458,7 @@ main(int argc, char **argv)
   ffdecsa_init();
 
   if(rawts_input != NULL)
-    rawts_init(rawts_input);
+    rawts_init(rawts_input, rawts_bench);
 
   if(join_transport != NULL)
     subscription_dummy_join(join_transport, 1);
@@ -447,12 +500,16 @@ main(int argc, char **argv)
 
   epg_save();
 
+  hts_settings_flush();
+
   //#ifdef CONFIG_UPNP
     tv_upnp_deinit();
   //#endif
 
   tvhlog(LOG_NOTICE, "STOP", "Exiting HTS Tvheadend");
 
+  tvhlog_stop();
+
   if(forkaway)
     unlink("/var/run/tvheadend.pid");
 
@@ -472,23 +529,132 @@ static const char *logtxtmeta[8][2] = {
   {"DEBUG",     "\033[32m"},
 };
 
+
 /**
- * Internal log function
+ * Log levels
+ *
+ * Each subsystem has a level cap (log/config), messages above it are
+ * discarded by tvhlog() before they are formatted. On top of that
+ * LOG_DEBUG is only let through if somebody wants it (console,
+ * syslog or a web client with debug enabled).
+ *
+ * tvhlog_level_min / max are the lowest and highest level any
+ * subsystem lets through, so the per subsystem lookup is only done
+ * for levels in between.
+ */
+int tvhlog_level_min = LOG_DEBUG;
+int tvhlog_level_max = LOG_DEBUG;
+
+typedef struct tvhlog_subsys {
+  char *ls_name;
+  int ls_level;
+} tvhlog_subsys_t;
+
+static tvhlog_subsys_t *tvhlog_subsys;
+static int tvhlog_num_subsys;
+static int tvhlog_default_level = LOG_DEBUG;
+static volatile int tvhlog_comet_debug_cnt;
+
+
+/**
+ * Highest level any log destination currently wants
+ */
+static int
+tvhlog_sink_level(void)
+{
+  if(log_debug_to_syslog || (log_stderr && log_debug_to_console) ||
+     tvhlog_comet_debug_cnt > 0)
+    return LOG_DEBUG;
+  return LOG_INFO;
+}
+
+
+/**
+ *
  */
 static void
-tvhlogv(int notify, int severity, const char *subsys, const char *fmt,
-	va_list ap)
+tvhlog_update_levels(void)
 {
-  char buf[2048];
-  char buf2[2048];
-  char t[50];
-  int l;
-  struct tm tm;
-  time_t now;
+  int i, sink = tvhlog_sink_level();
+  int lo = tvhlog_default_level, hi = tvhlog_default_level;
 
-  l = snprintf(buf, sizeof(buf), "%s: ", subsys);
+  for(i = 0; i < tvhlog_num_subsys; i++) {
+    lo = MIN(lo, tvhlog_subsys[i].ls_level);
+    hi = MAX(hi, tvhlog_subsys[i].ls_level);
+  }
+  tvhlog_level_min = MIN(lo, sink);
+  tvhlog_level_max = MIN(hi, sink);
+}
+
+
+/**
+ *
+ */
+int
+tvhlog_subsys_level(const char *subsys)
+{
+  int i;
+
+  for(i = 0; i < tvhlog_num_subsys; i++)
+    if(!strcmp(tvhlog_subsys[i].ls_name, subsys))
+      return MIN(tvhlog_subsys[i].ls_level, tvhlog_level_max);
+  return MIN(tvhlog_default_level, tvhlog_level_max);
+}
 
-  vsnprintf(buf + l, sizeof(buf) - l, fmt, ap);
+
+/**
+ * A web client switched debug logging on (1) or off (-1)
+ */
+void
+tvhlog_comet_debug(int delta)
+{
+  atomic_add(&tvhlog_comet_debug_cnt, delta);
+  tvhlog_update_levels();
+}
+
+
+/**
+ * Log queue
+ *
+ * Messages are formatted by the caller straight into a slot of a
+ * fixed size ring and everything else (time stamps, syslog, stderr,
+ * comet) is done by the log thread. Slots carry a sequence number so
+ * producers only need a compare-and-swap on the head to claim one.
+ * If the ring is full the message is dropped and counted.
+ */
+#define TVHLOG_QUEUE_SIZE 512  /* Must be a power of 2 */
+#define TVHLOG_MSG_SIZE   2048
+
+typedef struct tvhlog_msg {
+  volatile unsigned int lm_seq;
+  int lm_severity;
+  int lm_notify;
+  time_t lm_time;
+  char lm_buf[TVHLOG_MSG_SIZE];
+} tvhlog_msg_t;
+
+static tvhlog_msg_t *tvhlog_queue;
+static volatile unsigned int tvhlog_head;
+static unsigned int tvhlog_tail;
+static volatile int tvhlog_dropped;
+static int tvhlog_dropped_total;
+
+static pthread_t tvhlog_tid;
+static volatile int tvhlog_running;
+static volatile int tvhlog_waiting;
+static pthread_mutex_t tvhlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tvhlog_cond = PTHREAD_COND_INITIALIZER;
+
+
+/**
+ * Write a formatted message to all destinations
+ */
+static void
+tvhlog_output(int notify, int severity, time_t now, const char *buf)
+{
+  char buf2[TVHLOG_MSG_SIZE + 50];
+  char t[50];
+  struct tm tm;
 
   if(log_debug_to_syslog || severity < LOG_DEBUG)
     syslog(severity, "%s", buf);
@@ -496,10 +662,9 @@ tvhlogv(int notify, int severity, const char *subsys, const char *fmt,
   /**
    * Send notification to Comet (Push interface to web-clients)
    */
-  if(notify) {
+  if(notify && (severity < LOG_DEBUG || tvhlog_comet_debug_cnt > 0)) {
     htsmsg_t *m;
 
-    time(&now);
     localtime_r(&now, &tm);
     strftime(t, sizeof(t), "%b %d %H:%M:%S", &tm);
 
@@ -531,11 +696,215 @@ tvhlogv(int notify, int severity, const char *subsys, const char *fmt,
 }
 
 
+/**
+ * Format into buf
+ */
+static void
+tvhlog_format(char *buf, size_t size, const char *subsys,
+	      const char *fmt, va_list ap)
+{
+  int l = snprintf(buf, size, "%s: ", subsys);
+  vsnprintf(buf + l, size - l, fmt, ap);
+}
+
+
+/**
+ * Returns the next message to output, or NULL if the queue is empty
+ */
+static tvhlog_msg_t *
+tvhlog_peek(void)
+{
+  tvhlog_msg_t *lm = &tvhlog_queue[tvhlog_tail & (TVHLOG_QUEUE_SIZE - 1)];
+
+  if((int)(lm->lm_seq - (tvhlog_tail + 1)) < 0)
+    return NULL;
+  __sync_synchronize();
+  return lm;
+}
+
+
+/**
+ * Give the slot back to the producers
+ */
+static void
+tvhlog_release(tvhlog_msg_t *lm)
+{
+  __sync_synchronize();
+  lm->lm_seq = tvhlog_tail + TVHLOG_QUEUE_SIZE;
+  tvhlog_tail++;
+}
+
+
 /**
  *
  */
+static void
+tvhlog_report_drops(void)
+{
+  char buf[100];
+  int n = tvhlog_dropped;
+
+  if(n == 0)
+    return;
+  atomic_add(&tvhlog_dropped, -n);
+  tvhlog_dropped_total += n;
+
+  snprintf(buf, sizeof(buf),
+	   "log: %d messages dropped, queue full (%d in total)",
+	   n, tvhlog_dropped_total);
+  tvhlog_output(1, LOG_WARNING, time(NULL), buf);
+}
+
+
+/**
+ *
+ */
+static void *
+tvhlog_thread(void *aux)
+{
+  tvhlog_msg_t *lm;
+  struct timespec ts;
+
+  while(1) {
+    while((lm = tvhlog_peek()) != NULL) {
+      tvhlog_output(lm->lm_notify, lm->lm_severity, lm->lm_time, lm->lm_buf);
+      tvhlog_release(lm);
+    }
+
+    tvhlog_report_drops();
+
+    if(!tvhlog_running)
+      break;
+
+    pthread_mutex_lock(&tvhlog_mutex);
+    tvhlog_waiting = 1;
+    __sync_synchronize();
+    if(tvhlog_peek() == NULL && tvhlog_running) {
+      /* Timeout is only a safety net, producers signal us */
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait(&tvhlog_cond, &tvhlog_mutex, &ts);
+    }
+    tvhlog_waiting = 0;
+    pthread_mutex_unlock(&tvhlog_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ * Start the log thread and load log levels from settings
+ */
+void
+tvhlog_init(void)
+{
+  htsmsg_t *m, *s;
+  htsmsg_field_t *f;
+  uint32_t u32;
+  int i;
+
+  if((m = hts_settings_load("log/config")) != NULL) {
+    if(!htsmsg_get_u32(m, "level", &u32))
+      tvhlog_default_level = MIN(u32, LOG_DEBUG);
+
+    if((s = htsmsg_get_map(m, "subsystems")) != NULL) {
+      HTSMSG_FOREACH(f, s)
+	tvhlog_num_subsys++;
+      tvhlog_subsys = calloc(tvhlog_num_subsys, sizeof(tvhlog_subsys_t));
+      i = 0;
+      HTSMSG_FOREACH(f, s) {
+	if(htsmsg_get_u32(s, f->hmf_name, &u32))
+	  continue;
+	tvhlog_subsys[i].ls_name = strdup(f->hmf_name);
+	tvhlog_subsys[i].ls_level = MIN(u32, LOG_DEBUG);
+	i++;
+      }
+      tvhlog_num_subsys = i;
+    }
+    htsmsg_destroy(m);
+  }
+  tvhlog_update_levels();
+
+  tvhlog_queue = calloc(TVHLOG_QUEUE_SIZE, sizeof(tvhlog_msg_t));
+  for(i = 0; i < TVHLOG_QUEUE_SIZE; i++)
+    tvhlog_queue[i].lm_seq = i;
+
+  tvhlog_running = 1;
+  pthread_create(&tvhlog_tid, NULL, tvhlog_thread, NULL);
+}
+
+
+/**
+ * Output everything still queued and go back to logging directly
+ */
+void
+tvhlog_stop(void)
+{
+  if(!tvhlog_running)
+    return;
+
+  pthread_mutex_lock(&tvhlog_mutex);
+  tvhlog_running = 0;
+  pthread_cond_signal(&tvhlog_cond);
+  pthread_mutex_unlock(&tvhlog_mutex);
+  pthread_join(tvhlog_tid, NULL);
+}
+
+
+/**
+ * Internal log function
+ */
+static void
+tvhlogv(int notify, int severity, const char *subsys, const char *fmt,
+	va_list ap)
+{
+  char buf[TVHLOG_MSG_SIZE];
+  tvhlog_msg_t *lm;
+  unsigned int pos;
+  int d;
+
+  if(!tvhlog_running) {
+    tvhlog_format(buf, sizeof(buf), subsys, fmt, ap);
+    tvhlog_output(notify, severity, time(NULL), buf);
+    return;
+  }
+
+  /* Claim a slot */
+  while(1) {
+    pos = tvhlog_head;
+    lm = &tvhlog_queue[pos & (TVHLOG_QUEUE_SIZE - 1)];
+    d = lm->lm_seq - pos;
+    if(d == 0) {
+      if(atomic_cas(&tvhlog_head, pos, pos + 1))
+	break;
+    } else if(d < 0) {
+      atomic_add(&tvhlog_dropped, 1);
+      return;
+    }
+  }
+
+  lm->lm_severity = severity;
+  lm->lm_notify = notify;
+  lm->lm_time = time(NULL);
+  tvhlog_format(lm->lm_buf, sizeof(lm->lm_buf), subsys, fmt, ap);
+
+  __sync_synchronize();
+  lm->lm_seq = pos + 1;
+  __sync_synchronize();
+
+  if(tvhlog_waiting) {
+    pthread_mutex_lock(&tvhlog_mutex);
+    pthread_cond_signal(&tvhlog_cond);
+    pthread_mutex_unlock(&tvhlog_mutex);
+  }
+}
+
+
+/**
+ * Use the tvhlog() macro, it checks the log level first
+ */
 void
-tvhlog(int severity, const char *subsys, const char *fmt, ...)
+tvhlog0(int severity, const char *subsys, const char *fmt, ...)
 {
   va_list ap;
   va_start(ap, fmt);
@@ -546,17 +915,20 @@ tvhlog(int severity, const char *subsys, const char *fmt, ...)
 
 /**
  * May be invoked from a forked process so we can't do any notification
- * to comet directly.
+ * to comet directly. Always logs directly, the log thread does not
+ * exist in a forked process.
  *
  * @todo Perhaps do it via a pipe?
  */
 void
 tvhlog_spawn(int severity, const char *subsys, const char *fmt, ...)
 {
+  char buf[TVHLOG_MSG_SIZE];
   va_list ap;
   va_start(ap, fmt);
-  tvhlogv(0, severity, subsys, fmt, ap);
+  tvhlog_format(buf, sizeof(buf), subsys, fmt, ap);
   va_end(ap);
+  tvhlog_output(0, severity, time(NULL), buf);
 }
 
 
@@ -0,0 +1,322 @@
+/*
+ *  Object pools
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tvheadend.h"
+#include "atomic.h"
+#include "mempool.h"
+
+#define MEMPOOL_MAX   16          /* Max number of pools */
+#define MEMPOOL_CACHE 64          /* Max objects cached per thread and pool */
+#define MEMPOOL_SLAB  (256 * 1024)
+
+/**
+ * Buffer size classes for mempool_buf_get()
+ */
+static const size_t mempool_buf_sizes[] = {
+  256, 1024, 4096, 16384, 65536
+};
+#define MEMPOOL_BUF_CLASSES \
+  (sizeof(mempool_buf_sizes) / sizeof(mempool_buf_sizes[0]))
+
+typedef struct mempool_obj {
+  struct mempool_obj *next;
+} mempool_obj_t;
+
+struct mempool {
+  const char *mp_name;
+  size_t mp_size;
+  int mp_index;
+  int mp_cachemax;      /* Objects kept per thread */
+  int mp_slabobjs;      /* Objects per slab */
+
+  pthread_mutex_t mp_mutex;
+  mempool_obj_t *mp_depot;  /* Free objects not in any thread cache */
+  int mp_total;
+
+  volatile int mp_live;
+  int mp_peak;
+};
+
+/**
+ * Per thread cache, one stack of free objects per pool
+ */
+typedef struct mempool_cache {
+  int mc_count;
+  void *mc_objs[MEMPOOL_CACHE];
+} mempool_cache_t;
+
+static __thread mempool_cache_t *mempool_tcache;
+static pthread_key_t mempool_key;
+
+static mempool_t *mempools[MEMPOOL_MAX];
+static int mempool_count;
+static pthread_mutex_t mempool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mempool_once = PTHREAD_ONCE_INIT;
+
+static mempool_t *mempool_buf_pools[MEMPOOL_BUF_CLASSES];
+
+
+/**
+ * Give up to 'n' objects from the cache back to the depot
+ */
+static void
+mempool_drain(mempool_t *mp, mempool_cache_t *mc, int n)
+{
+  mempool_obj_t *o;
+
+  pthread_mutex_lock(&mp->mp_mutex);
+  while(n-- > 0 && mc->mc_count > 0) {
+    o = mc->mc_objs[--mc->mc_count];
+    o->next = mp->mp_depot;
+    mp->mp_depot = o;
+  }
+  pthread_mutex_unlock(&mp->mp_mutex);
+}
+
+
+/**
+ * Thread exit, return everything cached to the depots. The cache is
+ * forgotten so pool use later on (from other destructors) creates a
+ * new one, which is then released by another destructor round
+ */
+static void
+mempool_thread_exit(void *aux)
+{
+  mempool_cache_t *tc = aux;
+  int i;
+
+  for(i = 0; i < mempool_count; i++)
+    mempool_drain(mempools[i], &tc[i], MEMPOOL_CACHE);
+  mempool_tcache = NULL;
+  free(tc);
+}
+
+
+/**
+ *
+ */
+static mempool_t *
+mempool_create0(const char *name, size_t size)
+{
+  mempool_t *mp = calloc(1, sizeof(mempool_t));
+  mp->mp_name = name;
+  mp->mp_size = (MAX(size, sizeof(mempool_obj_t)) + 15) & ~15;
+  mp->mp_slabobjs = MAX(1, MEMPOOL_SLAB / mp->mp_size);
+  mp->mp_cachemax = MIN(MEMPOOL_CACHE, MAX(4, mp->mp_slabobjs / 4));
+  pthread_mutex_init(&mp->mp_mutex, NULL);
+
+  pthread_mutex_lock(&mempool_mutex);
+  assert(mempool_count < MEMPOOL_MAX);
+  mp->mp_index = mempool_count;
+  mempools[mempool_count++] = mp;
+  pthread_mutex_unlock(&mempool_mutex);
+  return mp;
+}
+
+
+/**
+ *
+ */
+static void
+mempool_init(void)
+{
+  int i;
+
+  pthread_key_create(&mempool_key, mempool_thread_exit);
+
+  for(i = 0; i < MEMPOOL_BUF_CLASSES; i++)
+    mempool_buf_pools[i] = mempool_create0("buffer", mempool_buf_sizes[i]);
+}
+
+
+/**
+ *
+ */
+mempool_t *
+mempool_create(const char *name, size_t size)
+{
+  pthread_once(&mempool_once, mempool_init);
+  return mempool_create0(name, size);
+}
+
+
+/**
+ *
+ */
+static mempool_cache_t *
+mempool_cache(mempool_t *mp)
+{
+  mempool_cache_t *tc = mempool_tcache;
+
+  if(tc == NULL) {
+    tc = calloc(MEMPOOL_MAX, sizeof(mempool_cache_t));
+    mempool_tcache = tc;
+    pthread_setspecific(mempool_key, tc);
+  }
+  return &tc[mp->mp_index];
+}
+
+
+/**
+ * Fill half of the cache from the depot, allocate a new slab if
+ * the depot is empty
+ */
+static void
+mempool_refill(mempool_t *mp, mempool_cache_t *mc)
+{
+  mempool_obj_t *o;
+  uint8_t *slab;
+  int i, n = MAX(1, mp->mp_cachemax / 2);
+
+  pthread_mutex_lock(&mp->mp_mutex);
+
+  if(mp->mp_depot == NULL) {
+    slab = malloc(mp->mp_slabobjs * mp->mp_size);
+    for(i = 0; i < mp->mp_slabobjs; i++) {
+      o = (mempool_obj_t *)(slab + i * mp->mp_size);
+      o->next = mp->mp_depot;
+      mp->mp_depot = o;
+    }
+    mp->mp_total += mp->mp_slabobjs;
+  }
+
+  while(n-- > 0 && (o = mp->mp_depot) != NULL) {
+    mp->mp_depot = o->next;
+    mc->mc_objs[mc->mc_count++] = o;
+  }
+  pthread_mutex_unlock(&mp->mp_mutex);
+}
+
+
+/**
+ *
+ */
+void *
+mempool_get(mempool_t *mp)
+{
+  mempool_cache_t *mc = mempool_cache(mp);
+  int n;
+
+  if(mc->mc_count == 0)
+    mempool_refill(mp, mc);
+
+  n = atomic_add(&mp->mp_live, 1) + 1;
+  if(n > mp->mp_peak)
+    mp->mp_peak = n;
+
+  return mc->mc_objs[--mc->mc_count];
+}
+
+
+/**
+ *
+ */
+void *
+mempool_get_zero(mempool_t *mp)
+{
+  void *ptr = mempool_get(mp);
+  memset(ptr, 0, mp->mp_size);
+  return ptr;
+}
+
+
+/**
+ *
+ */
+void
+mempool_put(mempool_t *mp, void *ptr)
+{
+  mempool_cache_t *mc = mempool_cache(mp);
+
+  if(mc->mc_count >= mp->mp_cachemax)
+    mempool_drain(mp, mc, mp->mp_cachemax / 2);
+
+  mc->mc_objs[mc->mc_count++] = ptr;
+  atomic_add(&mp->mp_live, -1);
+}
+
+
+/**
+ *
+ */
+static mempool_t *
+mempool_buf_pool(size_t size)
+{
+  int i;
+
+  pthread_once(&mempool_once, mempool_init);
+
+  for(i = 0; i < MEMPOOL_BUF_CLASSES; i++)
+    if(size <= mempool_buf_sizes[i])
+      return mempool_buf_pools[i];
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void *
+mempool_buf_get(size_t size)
+{
+  mempool_t *mp = mempool_buf_pool(size);
+  return mp != NULL ? mempool_get(mp) : malloc(size);
+}
+
+
+/**
+ * 'size' must be the size the buffer was allocated with
+ */
+void
+mempool_buf_put(void *ptr, size_t size)
+{
+  mempool_t *mp = mempool_buf_pool(size);
+
+  if(mp != NULL)
+    mempool_put(mp, ptr);
+  else
+    free(ptr);
+}
+
+
+/**
+ *
+ */
+int
+mempool_get_stats(mempool_stats_t *v, int max)
+{
+  mempool_t *mp;
+  int i;
+
+  pthread_mutex_lock(&mempool_mutex);
+  for(i = 0; i < mempool_count && i < max; i++) {
+    mp = mempools[i];
+    v[i].mps_name  = mp->mp_name;
+    v[i].mps_size  = mp->mp_size;
+    v[i].mps_live  = mp->mp_live;
+    v[i].mps_peak  = mp->mp_peak;
+    v[i].mps_total = mp->mp_total;
+  }
+  pthread_mutex_unlock(&mempool_mutex);
+  return i;
+}
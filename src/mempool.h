@@ -0,0 +1,65 @@
+/*
+ *  Object pools
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMPOOL_H__
+#define MEMPOOL_H__
+
+#include <stddef.h>
+
+/**
+ * Fixed size object pool
+ *
+ * Objects are carved out of large slabs that are never returned to
+ * the system, so the streaming path does not fragment the heap. Each
+ * thread keeps a small cache of free objects per pool. Objects freed
+ * by another thread than the one that allocated them (the normal
+ * case for packets) end up in the freeing thread's cache and surplus
+ * objects go back to a shared depot.
+ */
+typedef struct mempool mempool_t;
+
+mempool_t *mempool_create(const char *name, size_t size);
+
+void *mempool_get(mempool_t *mp);
+
+void *mempool_get_zero(mempool_t *mp);
+
+void mempool_put(mempool_t *mp, void *ptr);
+
+/**
+ * Variable size buffers from a set of size classed pools
+ * Buffers larger than the largest class come from malloc()
+ */
+void *mempool_buf_get(size_t size);
+
+void mempool_buf_put(void *ptr, size_t size);
+
+/**
+ * Statistics
+ */
+typedef struct mempool_stats {
+  const char *mps_name;
+  size_t mps_size;    /* Object size */
+  int mps_live;       /* Objects handed out */
+  int mps_peak;       /* High-water mark of mps_live */
+  int mps_total;      /* Objects allocated from the system */
+} mempool_stats_t;
+
+int mempool_get_stats(mempool_stats_t *v, int max);
+
+#endif /* MEMPOOL_H__ */
@@ -21,6 +21,23 @@
 #include "packet.h"
 #include "string.h"
 #include "atomic.h"
+#include "mempool.h"
+
+static mempool_t *pkt_pool;
+static mempool_t *pktref_pool;
+static mempool_t *pktbuf_pool;
+
+
+/**
+ *
+ */
+void
+pkt_init(void)
+{
+  pkt_pool    = mempool_create("th_pkt_t",    sizeof(th_pkt_t));
+  pktref_pool = mempool_create("th_pktref_t", sizeof(th_pktref_t));
+  pktbuf_pool = mempool_create("pktbuf_t",    sizeof(pktbuf_t));
+}
 
 /*
  *
@@ -33,7 +50,13 @@ pkt_destroy(th_pkt_t *pkt)
 
   if(pkt->pkt_header != NULL)
     pktbuf_ref_dec(pkt->pkt_header);
-  free(pkt);
+
+  if(pkt->pkt_avcc != NULL)
+    pkt_ref_dec(pkt->pkt_avcc);
+
+  if(pkt->pkt_merged != NULL)
+    pkt_ref_dec(pkt->pkt_merged);
+  mempool_put(pkt_pool, pkt);
 }
 
 
@@ -46,7 +69,7 @@ pkt_alloc(const void *data, size_t datalen, int64_t pts, int64_t dts)
 {
   th_pkt_t *pkt;
 
-  pkt = calloc(1, sizeof(th_pkt_t));
+  pkt = mempool_get_zero(pkt_pool);
   if(datalen)
     pkt->pkt_payload = pktbuf_alloc(data, datalen);
   pkt->pkt_dts = dts;
@@ -96,7 +119,7 @@ pktref_clear_queue(struct th_pktref_queue *q)
   while((pr = TAILQ_FIRST(q)) != NULL) {
     TAILQ_REMOVE(q, pr, pr_link);
     pkt_ref_dec(pr->pr_pkt);
-    free(pr);
+    mempool_put(pktref_pool, pr);
   }
 }
 
@@ -107,7 +130,7 @@ pktref_clear_queue(struct th_pktref_queue *q)
 void
 pktref_enqueue(struct th_pktref_queue *q, th_pkt_t *pkt)
 {
-  th_pktref_t *pr = malloc(sizeof(th_pktref_t));
+  th_pktref_t *pr = mempool_get(pktref_pool);
   pr->pr_pkt = pkt;
   TAILQ_INSERT_TAIL(q, pr, pr_link);
 }
@@ -121,13 +144,59 @@ pktref_remove(struct th_pktref_queue *q, th_pktref_t *pr)
 {
   TAILQ_REMOVE(q, pr, pr_link);
   pkt_ref_dec(pr->pr_pkt);
-  free(pr);
+  mempool_put(pktref_pool, pr);
 }
 
 
 /**
  *
  */
+void
+pktref_free(th_pktref_t *pr)
+{
+  mempool_put(pktref_pool, pr);
+}
+
+
+/**
+ * Return a new reference to the memoized packet in *memo, or NULL
+ */
+th_pkt_t *
+pkt_memo_get(th_pkt_t **memo)
+{
+  th_pkt_t *n = *(th_pkt_t * volatile *)memo;
+  if(n != NULL)
+    pkt_ref_inc(n);
+  return n;
+}
+
+
+/**
+ * Memoize 'n' in *memo unless someone else beat us to it.
+ * Returns the memoized packet with a reference for the caller, the
+ * caller's reference to 'n' is consumed.
+ */
+th_pkt_t *
+pkt_memo_set(th_pkt_t **memo, th_pkt_t *n)
+{
+  th_pkt_t *o;
+
+  pkt_ref_inc(n);
+  if(atomic_cas_ptr((void * volatile *)memo, NULL, n))
+    return n;
+
+  /* Lost the race, use the winner's */
+  pkt_ref_dec(n);
+  pkt_ref_dec(n);
+  o = pkt_memo_get(memo);
+  return o;
+}
+
+
+/**
+ * The merged packet is memoized on 'pkt' so this is only done once
+ * no matter how many consumers the packet has
+ */
 th_pkt_t *
 pkt_merge_header(th_pkt_t *pkt)
 {
@@ -137,11 +206,12 @@ pkt_merge_header(th_pkt_t *pkt)
   if(pkt->pkt_header == NULL)
     return pkt;
 
-  n = malloc(sizeof(th_pkt_t));
-  *n = *pkt;
+  if((n = pkt_memo_get(&pkt->pkt_merged)) != NULL) {
+    pkt_ref_dec(pkt);
+    return n;
+  }
 
-  n->pkt_refcount = 1;
-  n->pkt_header = NULL;
+  n = pkt_copy_nodata(pkt);
 
   s = pktbuf_len(pkt->pkt_payload) + pktbuf_len(pkt->pkt_header);
   n->pkt_payload = pktbuf_alloc(NULL, s);
@@ -154,6 +224,7 @@ pkt_merge_header(th_pkt_t *pkt)
 	 pktbuf_ptr(pkt->pkt_payload),
 	 pktbuf_len(pkt->pkt_payload));
 
+  n = pkt_memo_set(&pkt->pkt_merged, n);
   pkt_ref_dec(pkt);
   return n;
 }
@@ -166,10 +237,12 @@ pkt_merge_header(th_pkt_t *pkt)
 th_pkt_t *
 pkt_copy_shallow(th_pkt_t *pkt)
 {
-  th_pkt_t *n = malloc(sizeof(th_pkt_t));
+  th_pkt_t *n = mempool_get(pkt_pool);
   *n = *pkt;
 
   n->pkt_refcount = 1;
+  n->pkt_avcc = NULL;
+  n->pkt_merged = NULL;
 
   if(n->pkt_header)
     pktbuf_ref_inc(n->pkt_header);
@@ -181,13 +254,31 @@ pkt_copy_shallow(th_pkt_t *pkt)
 }
 
 
+/**
+ * Copy of the packet's metadata without header and payload
+ */
+th_pkt_t *
+pkt_copy_nodata(th_pkt_t *pkt)
+{
+  th_pkt_t *n = mempool_get(pkt_pool);
+  *n = *pkt;
+
+  n->pkt_refcount = 1;
+  n->pkt_header = NULL;
+  n->pkt_payload = NULL;
+  n->pkt_avcc = NULL;
+  n->pkt_merged = NULL;
+  return n;
+}
+
+
 /**
  *
  */
 th_pktref_t *
 pktref_create(th_pkt_t *pkt)
 {
-  th_pktref_t *pr = malloc(sizeof(th_pktref_t));
+  th_pktref_t *pr = mempool_get(pktref_pool);
   pr->pr_pkt = pkt;
   return pr;
 }
@@ -198,8 +289,11 @@ void
 pktbuf_ref_dec(pktbuf_t *pb)
 {
   if((atomic_add(&pb->pb_refcount, -1)) == 1) {
-    free(pb->pb_data);
-    free(pb);
+    if(!pb->pb_pooled)
+      free(pb->pb_data);
+    else if(pb->pb_data != NULL)
+      mempool_buf_put(pb->pb_data, pb->pb_size);
+    mempool_put(pktbuf_pool, pb);
   }
 }
 
@@ -212,12 +306,14 @@ pktbuf_ref_inc(pktbuf_t *pb)
 pktbuf_t *
 pktbuf_alloc(const void *data, size_t size)
 {
-  pktbuf_t *pb = malloc(sizeof(pktbuf_t));
+  pktbuf_t *pb = mempool_get(pktbuf_pool);
   pb->pb_refcount = 1;
   pb->pb_size = size;
+  pb->pb_pooled = 1;
+  pb->pb_data = NULL;
 
   if(size > 0) {
-    pb->pb_data = malloc(size);
+    pb->pb_data = mempool_buf_get(size);
     if(data != NULL)
       memcpy(pb->pb_data, data, size);
   }
@@ -227,9 +323,10 @@ pktbuf_alloc(const void *data, size_t size)
 pktbuf_t *
 pktbuf_make(void *data, size_t size)
 {
-  pktbuf_t *pb = malloc(sizeof(pktbuf_t));
+  pktbuf_t *pb = mempool_get(pktbuf_pool);
   pb->pb_refcount = 1;
   pb->pb_size = size;
+  pb->pb_pooled = 0;
   pb->pb_data = data;
   return pb;
 }
@@ -22,6 +22,7 @@
 
 typedef struct pktbuf {
   int pb_refcount;
+  int pb_pooled;   /* pb_data is from mempool_buf_get() */
   uint8_t *pb_data;
   size_t pb_size;
 } pktbuf_t;
@@ -56,6 +57,15 @@ typedef struct th_pkt {
   pktbuf_t *pkt_payload;
   pktbuf_t *pkt_header;
 
+  /**
+   * Memoized alternate representations of this packet, each holds
+   * a reference. Set once (atomically) by the first consumer that
+   * needs it so other consumers of the same packet get it for free.
+   * Never copied along with the packet.
+   */
+  struct th_pkt *pkt_avcc;    /* H264 converted to AVCC, see avc.c */
+  struct th_pkt *pkt_merged;  /* Header merged into payload */
+
 } th_pkt_t;
 
 
@@ -71,6 +81,8 @@ typedef struct th_pktref {
 /**
  *
  */
+void pkt_init(void);
+
 void pkt_ref_dec(th_pkt_t *pkt);
 
 void pkt_ref_inc(th_pkt_t *pkt);
@@ -84,6 +96,9 @@ void pktref_enqueue(struct th_pktref_queue *q, th_pkt_t *pkt);
 
 void pktref_remove(struct th_pktref_queue *q, th_pktref_t *pr);
 
+// Free the reference only, the packet's reference count is untouched
+void pktref_free(th_pktref_t *pr);
+
 
 th_pkt_t *pkt_alloc(const void *data, size_t datalen, int64_t pts, int64_t dts);
 
@@ -91,6 +106,12 @@ th_pkt_t *pkt_merge_header(th_pkt_t *pkt);
 
 th_pkt_t *pkt_copy_shallow(th_pkt_t *pkt);
 
+th_pkt_t *pkt_copy_nodata(th_pkt_t *pkt);
+
+th_pkt_t *pkt_memo_get(th_pkt_t **memo);
+
+th_pkt_t *pkt_memo_set(th_pkt_t **memo, th_pkt_t *n);
+
 th_pktref_t *pktref_create(th_pkt_t *pkt);
 
 void pktbuf_ref_dec(pktbuf_t *pb);
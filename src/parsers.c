@@ -33,6 +33,7 @@
 #include "bitstream.h"
 #include "packet.h"
 #include "streaming.h"
+#include "timeshift.h"
 
 #define PTS_MASK 0x1ffffffffLL
 //#define PTS_MASK 0x7ffffLL
@@ -1350,6 +1351,10 @@ parser_deliver(service_t *t, elementary_stream_t *st, th_pkt_t *pkt)
   streaming_pad_deliver(&t->s_streaming_pad, sm);
   streaming_msg_free(sm);
 
+  service_gop_cache_add(t, st, pkt);
+  if(t->s_timeshift != NULL)
+    timeshift_write(t->s_timeshift, pkt);
+
   /* Decrease our own reference to the packet */
   pkt_ref_dec(pkt);
 
@@ -212,7 +212,8 @@ gh_hold(globalheaders_t *gh, streaming_message_t *sm)
     pr = pktref_create(pkt);
     TAILQ_INSERT_TAIL(&gh->gh_holdq, pr, pr_link);
 
-    free(sm);
+    sm->sm_data = NULL;
+    streaming_msg_free(sm);
 
     if(!headers_complete(gh, gh_queue_delay(gh))) 
       break;
@@ -228,7 +229,7 @@ gh_hold(globalheaders_t *gh, streaming_message_t *sm)
       sm = streaming_msg_create_pkt(pr->pr_pkt);
       streaming_target_deliver2(gh->gh_output, sm);
       pkt_ref_dec(pr->pr_pkt);
-      free(pr);
+      pktref_free(pr);
     }
     gh->gh_passthru = 1;
     break;
@@ -247,6 +248,7 @@ gh_hold(globalheaders_t *gh, streaming_message_t *sm)
   case SMT_EXIT:
   case SMT_SERVICE_STATUS:
   case SMT_NOSTART:
+  case SMT_SKIP:
   case SMT_MPEGTS:
     streaming_target_deliver2(gh->gh_output, sm);
     break;
@@ -274,6 +276,7 @@ gh_pass(globalheaders_t *gh, streaming_message_t *sm)
   case SMT_EXIT:
   case SMT_SERVICE_STATUS:
   case SMT_NOSTART:
+  case SMT_SKIP:
   case SMT_MPEGTS:
     streaming_target_deliver2(gh->gh_output, sm);
     break;
@@ -0,0 +1,264 @@
+/**
+ *  Shared timestamp fixup and global header stage
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include "tvheadend.h"
+#include "streaming.h"
+#include "service.h"
+#include "normalize.h"
+#include "tsfix.h"
+#include "globalheaders.h"
+#include "packet.h"
+
+/**
+ * Per subscriber end of the chain
+ *
+ * A subscriber joining a running chain starts at the next key frame
+ * and gets its own time base, so its timestamps start at 0 just as
+ * if it had its own tsfix.
+ */
+typedef struct nz_sub {
+  LIST_ENTRY(nz_sub) ns_link;
+  streaming_target_t ns_input;    /* Connected to nz_pad */
+  streaming_target_t *ns_output;  /* The subscriber */
+  int64_t ns_tsref;               /* PTS_UNSET until first key frame */
+  int ns_hasvideo;
+} nz_sub_t;
+
+
+/**
+ * One tsfix -> globalheaders chain per service, fanned out to all
+ * subscribers that asked for normalized output. This way packets are
+ * timestamp fixed and header converted once, no matter how many
+ * recordings there are of the same service.
+ *
+ * All access is done with the service's s_stream_mutex held
+ */
+typedef struct normalizer {
+  streaming_target_t nz_input;    /* Connected to the service pad */
+
+  streaming_target_t *nz_tsfix;
+  streaming_target_t *nz_gh;
+
+  streaming_target_t nz_output;   /* Output of globalheaders */
+
+  streaming_pad_t nz_pad;         /* Fan out to subscribers */
+
+  /**
+   * Last start message emitted by globalheaders. Given to late joiners
+   * so they get the complete (header holding) start right away
+   */
+  streaming_message_t *nz_start;
+
+  LIST_HEAD(, nz_sub) nz_subs;
+
+} normalizer_t;
+
+
+/**
+ *
+ */
+static void
+normalize_input(void *opaque, streaming_message_t *sm)
+{
+  normalizer_t *nz = opaque;
+  streaming_target_deliver(nz->nz_tsfix, sm);
+}
+
+
+/**
+ *
+ */
+static void
+normalize_output(void *opaque, streaming_message_t *sm)
+{
+  normalizer_t *nz = opaque;
+
+  switch(sm->sm_type) {
+  case SMT_START:
+    if(nz->nz_start != NULL)
+      streaming_msg_free(nz->nz_start);
+    nz->nz_start = streaming_msg_clone(sm);
+    break;
+
+  case SMT_STOP:
+    if(nz->nz_start != NULL)
+      streaming_msg_free(nz->nz_start);
+    nz->nz_start = NULL;
+    break;
+
+  default:
+    break;
+  }
+
+  streaming_pad_deliver(&nz->nz_pad, sm);
+  streaming_msg_free(sm);
+}
+
+
+/**
+ *
+ */
+static void
+nz_sub_start(nz_sub_t *ns, const streaming_start_t *ss)
+{
+  int i;
+
+  ns->ns_tsref = PTS_UNSET;
+  ns->ns_hasvideo = 0;
+  for(i = 0; i < ss->ss_num_components; i++)
+    if(SCT_ISVIDEO(ss->ss_components[i].ssc_type))
+      ns->ns_hasvideo = 1;
+}
+
+
+/**
+ * Drop everything up to the first key frame and rebase the
+ * timestamps on it
+ */
+static void
+nz_sub_input(void *opaque, streaming_message_t *sm)
+{
+  nz_sub_t *ns = opaque;
+  th_pkt_t *pkt, *n;
+
+  switch(sm->sm_type) {
+  case SMT_START:
+    nz_sub_start(ns, sm->sm_data);
+    break;
+
+  case SMT_PACKET:
+    pkt = sm->sm_data;
+
+    if(ns->ns_tsref == PTS_UNSET) {
+      if(ns->ns_hasvideo && pkt->pkt_frametype != PKT_I_FRAME) {
+	streaming_msg_free(sm);
+	return;
+      }
+      ns->ns_tsref = pkt->pkt_dts;
+    }
+
+    if(pkt->pkt_dts < ns->ns_tsref) {
+      /* Packet from before the key frame we started at */
+      streaming_msg_free(sm);
+      return;
+    }
+
+    if(ns->ns_tsref == 0)
+      break;
+
+    n = pkt_copy_shallow(pkt);
+    n->pkt_dts -= ns->ns_tsref;
+    if(n->pkt_pts != PTS_UNSET)
+      n->pkt_pts -= ns->ns_tsref;
+
+    streaming_msg_free(sm);
+    sm = streaming_msg_create_pkt(n);
+    pkt_ref_dec(n);
+    break;
+
+  default:
+    break;
+  }
+
+  streaming_target_deliver(ns->ns_output, sm);
+}
+
+
+/**
+ * Connect 'st' to the normalized output of the service, the chain is
+ * created on demand
+ */
+void
+normalize_attach(service_t *t, streaming_target_t *st)
+{
+  normalizer_t *nz = t->s_normalizer;
+  nz_sub_t *ns;
+  int created = 0;
+
+  lock_assert(&t->s_stream_mutex);
+
+  if(nz == NULL) {
+    nz = calloc(1, sizeof(normalizer_t));
+    streaming_pad_init(&nz->nz_pad);
+
+    streaming_target_init(&nz->nz_output, normalize_output, nz, 0);
+    nz->nz_gh = globalheaders_create(&nz->nz_output);
+    nz->nz_tsfix = tsfix_create(nz->nz_gh);
+
+    streaming_target_init(&nz->nz_input, normalize_input, nz,
+			  SMT_TO_MASK(SMT_MPEGTS));
+    streaming_target_connect(&t->s_streaming_pad, &nz->nz_input);
+
+    t->s_normalizer = nz;
+    created = 1;
+  }
+
+  ns = calloc(1, sizeof(nz_sub_t));
+  ns->ns_output = st;
+  ns->ns_tsref = PTS_UNSET;
+  streaming_target_init(&ns->ns_input, nz_sub_input, ns, 0);
+  LIST_INSERT_HEAD(&nz->nz_subs, ns, ns_link);
+  streaming_target_connect(&nz->nz_pad, &ns->ns_input);
+
+  if(created) {
+    // The service pad only carries a start message when the service
+    // (re)starts, so feed the chain one if the service is running
+    if(TAILQ_FIRST(&t->s_components) != NULL)
+      streaming_target_deliver(&nz->nz_input,
+			       streaming_msg_create_data(SMT_START,
+				 service_build_stream_start(t)));
+
+  } else if(nz->nz_start != NULL) {
+    nz_sub_input(ns, streaming_msg_clone(nz->nz_start));
+  }
+}
+
+
+/**
+ * Disconnect 'st', the chain is torn down with the last subscriber
+ */
+void
+normalize_detach(service_t *t, streaming_target_t *st)
+{
+  normalizer_t *nz = t->s_normalizer;
+  nz_sub_t *ns;
+
+  lock_assert(&t->s_stream_mutex);
+  assert(nz != NULL);
+
+  LIST_FOREACH(ns, &nz->nz_subs, ns_link)
+    if(ns->ns_output == st)
+      break;
+  assert(ns != NULL);
+
+  streaming_target_disconnect(&nz->nz_pad, &ns->ns_input);
+  LIST_REMOVE(ns, ns_link);
+  free(ns);
+
+  if(nz->nz_pad.sp_ntargets > 0)
+    return;
+
+  streaming_target_disconnect(&t->s_streaming_pad, &nz->nz_input);
+  tsfix_destroy(nz->nz_tsfix);
+  globalheaders_destroy(nz->nz_gh);
+  if(nz->nz_start != NULL)
+    streaming_msg_free(nz->nz_start);
+  free(nz);
+  t->s_normalizer = NULL;
+}
@@ -0,0 +1,30 @@
+/**
+ *  Shared timestamp fixup and global header stage
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NORMALIZE_H__
+#define NORMALIZE_H__
+
+#include "tvheadend.h"
+
+struct service;
+
+void normalize_attach(struct service *t, streaming_target_t *st);
+
+void normalize_detach(struct service *t, streaming_target_t *st);
+
+#endif // NORMALIZE_H__
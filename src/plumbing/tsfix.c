@@ -269,7 +269,7 @@ recover_pts(tsfix_t *tf, tfstream_t *tfs, th_pkt_t *pkt)
 
     TAILQ_REMOVE(&tf->tf_ptsq, pr, pr_link);
     normalize_ts(tf, tfs, pkt);
-    free(pr);
+    pktref_free(pr);
   }
 }
 
@@ -364,6 +364,7 @@ tsfix_input(void *opaque, streaming_message_t *sm)
   case SMT_EXIT:
   case SMT_SERVICE_STATUS:
   case SMT_NOSTART:
+  case SMT_SKIP:
   case SMT_MPEGTS:
     break;
   }
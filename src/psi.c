@@ -27,6 +27,7 @@
 #include "dvb/dvb_support.h"
 #include "tsdemux.h"
 #include "parsers.h"
+#include "teletext.h"
 
 static int
 psi_section_reassemble0(psi_section_t *ps, const uint8_t *data, 
@@ -615,6 +616,7 @@ psi_parse_pmt(service_t *t, const uint8_t *ptr, int len, int chksvcid,
       // Jernej: I don't know why. But it seems that sometimes the stream is created with a wrong es_type??
       if(st->es_type != hts_stream_type) {
         st->es_type = hts_stream_type;
+        service_stream_hot(st)->esh_type = hts_stream_type;
       }
 
       st->es_delete_me = 0;
@@ -685,6 +687,8 @@ psi_parse_pmt(service_t *t, const uint8_t *ptr, int len, int chksvcid,
     
     service_request_save(t, 0);
 
+    teletext_update_interest(t);
+
     // Only restart if something that our clients worry about did change
     if(update & !(PMT_UPDATE_NEW_CA_STREAM |
 		  PMT_UPDATE_NEW_CAID |
@@ -694,6 +698,9 @@ psi_parse_pmt(service_t *t, const uint8_t *ptr, int len, int chksvcid,
 	service_restart(t, had_components);
     }
   }
+
+  if(t->s_status == SERVICE_RUNNING && t->s_zap_pmt == 0)
+    t->s_zap_pmt = getmonoclock();
   return 0;
 }
 
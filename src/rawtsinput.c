@@ -20,8 +20,13 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -33,6 +38,50 @@
 #include "psi.h"
 #include "tsdemux.h"
 #include "channels.h"
+#include "subscriptions.h"
+#include "plumbing/tsfix.h"
+#include "plumbing/globalheaders.h"
+#include "dvr/dvr.h"
+#include "dvr/mkmux.h"
+
+/**
+ * Benchmark pipeline stages. Each stage is preceded by a timing target
+ * that measures the thread CPU time spent delivering to it (and everything
+ * behind it), so the cost of a single stage is the difference between
+ * two consecutive stages.
+ */
+#define RAWTS_STAGE_TSFIX         0
+#define RAWTS_STAGE_GLOBALHEADERS 1
+#define RAWTS_STAGE_SINK          2
+#define RAWTS_STAGES              3
+
+typedef struct rawts_stage {
+  streaming_target_t rs_input;
+  streaming_target_t *rs_output;
+  int64_t rs_cpu;
+} rawts_stage_t;
+
+
+/**
+ * Per service benchmark subscription
+ */
+typedef struct rawts_bench {
+  LIST_ENTRY(rawts_bench) rb_link;
+
+  struct rawts *rb_rawts;
+  service_t *rb_service;
+  th_subscription_t *rb_sub;
+
+  rawts_stage_t rb_stages[RAWTS_STAGES];
+  streaming_target_t *rb_tsfix;
+  streaming_target_t *rb_gh;
+  streaming_target_t rb_sink;
+
+  mk_mux_t *rb_mkm;
+  int64_t rb_frames;
+
+} rawts_bench_t;
+
 
 typedef struct rawts {
   int rt_fd;
@@ -44,9 +93,176 @@ typedef struct rawts {
 
   int rt_pcr_pid;
 
+  /**
+   * Benchmark mode. The file is replayed once at rt_speed times
+   * real time (0 = as fast as possible) and all services are
+   * subscribed to and fed through tsfix, globalheaders and a sink.
+   */
+  int rt_bench;
+  int rt_speed;
+  char *rt_mkvdir;  /* NULL = null sink */
+  LIST_HEAD(, rawts_bench) rt_benches;
+
 } rawts_t;
 
 
+/**
+ *
+ */
+static int64_t
+rawts_cputime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/**
+ *
+ */
+static void
+rawts_stage_input(void *opaque, streaming_message_t *sm)
+{
+  rawts_stage_t *rs = opaque;
+  int64_t t0 = rawts_cputime();
+
+  streaming_target_deliver(rs->rs_output, sm);
+  rs->rs_cpu += rawts_cputime() - t0;
+}
+
+
+/**
+ *
+ */
+static void
+rawts_sink_close(rawts_bench_t *rb)
+{
+  if(rb->rb_mkm == NULL)
+    return;
+  mk_mux_close(rb->rb_mkm);
+  rb->rb_mkm = NULL;
+}
+
+
+/**
+ * Final stage, either drops everything or muxes into a MKV file
+ */
+static void
+rawts_sink_input(void *opaque, streaming_message_t *sm)
+{
+  rawts_bench_t *rb = opaque;
+  rawts_t *rt = rb->rb_rawts;
+  dvr_entry_t de;
+  char path[512];
+
+  switch(sm->sm_type) {
+  case SMT_START:
+    if(rt->rt_mkvdir == NULL)
+      break;
+
+    rawts_sink_close(rb);
+    snprintf(path, sizeof(path), "%s/%s_%04x.mkv", rt->rt_mkvdir,
+	     rt->rt_identifier, rb->rb_service->s_dvb_service_id);
+
+    memset(&de, 0, sizeof(de));
+    de.de_title = path;
+    rb->rb_mkm = mk_mux_create(path, sm->sm_data, &de, 0);
+    if(rb->rb_mkm == NULL)
+      tvhlog(LOG_ERR, "rawts", "Unable to create %s -- %s",
+	     path, strerror(errno));
+    break;
+
+  case SMT_PACKET:
+    rb->rb_frames++;
+    if(rb->rb_mkm != NULL) {
+      mk_mux_write_pkt(rb->rb_mkm, sm->sm_data);
+      sm->sm_data = NULL;
+    }
+    break;
+
+  case SMT_STOP:
+    rawts_sink_close(rb);
+    break;
+
+  default:
+    break;
+  }
+  streaming_msg_free(sm);
+}
+
+
+/**
+ * Subscribe to the service and setup the timed pipeline behind it
+ */
+static void
+rawts_bench_create(rawts_t *rt, service_t *t)
+{
+  rawts_bench_t *rb = calloc(1, sizeof(rawts_bench_t));
+  rawts_stage_t *rs = rb->rb_stages;
+  char name[100];
+
+  lock_assert(&global_lock);
+
+  rb->rb_rawts = rt;
+  rb->rb_service = t;
+
+  streaming_target_init(&rb->rb_sink, rawts_sink_input, rb, 0);
+
+  rs[RAWTS_STAGE_SINK].rs_output = &rb->rb_sink;
+  rb->rb_gh = globalheaders_create(&rs[RAWTS_STAGE_SINK].rs_input);
+
+  rs[RAWTS_STAGE_GLOBALHEADERS].rs_output = rb->rb_gh;
+  rb->rb_tsfix = tsfix_create(&rs[RAWTS_STAGE_GLOBALHEADERS].rs_input);
+
+  rs[RAWTS_STAGE_TSFIX].rs_output = rb->rb_tsfix;
+
+  streaming_target_init(&rs[RAWTS_STAGE_SINK].rs_input,
+			rawts_stage_input, &rs[RAWTS_STAGE_SINK], 0);
+  streaming_target_init(&rs[RAWTS_STAGE_GLOBALHEADERS].rs_input,
+			rawts_stage_input, &rs[RAWTS_STAGE_GLOBALHEADERS], 0);
+  streaming_target_init(&rs[RAWTS_STAGE_TSFIX].rs_input,
+			rawts_stage_input, &rs[RAWTS_STAGE_TSFIX], 0);
+
+  LIST_INSERT_HEAD(&rt->rt_benches, rb, rb_link);
+
+  snprintf(name, sizeof(name), "rawts benchmark %04x", t->s_dvb_service_id);
+  rb->rb_sub = subscription_create_from_service(t, name,
+						&rs[RAWTS_STAGE_TSFIX].rs_input,
+						0);
+}
+
+
+/**
+ * Tear down all benchmark subscriptions, this flushes the sinks. The
+ * CPU time of each stage and the frame count are summed up in
+ * 'stages' and 'frames'
+ */
+static void
+rawts_bench_destroy_all(rawts_t *rt, int64_t *stages, int64_t *frames)
+{
+  rawts_bench_t *rb;
+  int i;
+
+  pthread_mutex_lock(&global_lock);
+  while((rb = LIST_FIRST(&rt->rt_benches)) != NULL) {
+    if(rb->rb_sub != NULL)
+      subscription_unsubscribe(rb->rb_sub);
+    tsfix_destroy(rb->rb_tsfix);
+    globalheaders_destroy(rb->rb_gh);
+    rawts_sink_close(rb);
+
+    for(i = 0; i < RAWTS_STAGES; i++)
+      stages[i] += rb->rb_stages[i].rs_cpu;
+    *frames += rb->rb_frames;
+
+    LIST_REMOVE(rb, rb_link);
+    free(rb);
+  }
+  pthread_mutex_unlock(&global_lock);
+}
+
+
 /**
  *
  */
@@ -147,6 +363,9 @@ rawts_service_add(rawts_t *rt, uint16_t sid, int pmt_pid)
   ch = channel_find_by_name(tmp, 1, 0);
 
   service_map_channel(t, ch, 0);
+
+  if(rt->rt_bench)
+    rawts_bench_create(rt, t);
   return t;
 }
 
@@ -228,7 +447,7 @@ rawts_pat(rawts_t *rt, const uint8_t *tsb)
  *
  */
 static void
-process_ts_packet(rawts_t *rt, uint8_t *tsb)
+process_ts_packet(rawts_t *rt, const uint8_t *tsb)
 {
   uint16_t pid;
   service_t *t;
@@ -247,7 +466,7 @@ process_ts_packet(rawts_t *rt, uint8_t *tsb)
 
     ts_recv_packet1(t, tsb, &pcr);
 
-    if(pcr != PTS_UNSET) {
+    if(pcr != PTS_UNSET && rt->rt_speed != 0) {
       
       if(rt->rt_pcr_pid == 0)
 	rt->rt_pcr_pid = pid;
@@ -261,7 +480,7 @@ process_ts_packet(rawts_t *rt, uint8_t *tsb)
 
 	  if(delta > 90000)
 	    delta = 90000;
-	  delta *= 11;
+	  delta = delta * 11 / rt->rt_speed;
 	  d = delta + t->s_pcr_last_realtime;
 	  slp.tv_sec  =  d / 1000000;
 	  slp.tv_nsec = (d % 1000000) * 1000;
@@ -307,11 +526,98 @@ raw_ts_reader(void *aux)
 /**
  *
  */
+static void
+rawts_bench_report(rawts_t *rt, int64_t packets, int resync,
+		   int64_t wall, int64_t cpu, const int64_t *stages,
+		   int64_t frames)
+{
+  if(wall < 1)
+    wall = 1;
+
+  tvhlog(LOG_NOTICE, "rawts",
+	 "%"PRId64" packets (%d resyncs) in %"PRId64" ms: "
+	 "%"PRId64" packets/s, %.2f MB/s",
+	 packets, resync, wall / 1000, packets * 1000000 / wall,
+	 packets * 188.0 / wall);
+
+  tvhlog(LOG_NOTICE, "rawts",
+	 "CPU time (ms): total %"PRId64", demux/parse %"PRId64", "
+	 "tsfix %"PRId64", globalheaders %"PRId64", %s sink %"PRId64
+	 " (%"PRId64" frames)",
+	 cpu / 1000,
+	 (cpu - stages[RAWTS_STAGE_TSFIX]) / 1000,
+	 (stages[RAWTS_STAGE_TSFIX] - stages[RAWTS_STAGE_GLOBALHEADERS]) / 1000,
+	 (stages[RAWTS_STAGE_GLOBALHEADERS] - stages[RAWTS_STAGE_SINK]) / 1000,
+	 rt->rt_mkvdir ? "mkv" : "null",
+	 stages[RAWTS_STAGE_SINK] / 1000, frames);
+}
+
+
+/**
+ * Replay the (mmap'ed) file once, then report and exit
+ */
+static void *
+raw_ts_bench(void *aux)
+{
+  rawts_t *rt = aux;
+  struct stat st;
+  const uint8_t *map;
+  size_t off = 0;
+  int64_t packets = 0, wall, cpu;
+  int64_t stages[RAWTS_STAGES] = {0}, frames = 0;
+  int resync = 0;
+
+  if(fstat(rt->rt_fd, &st) || st.st_size < 188) {
+    tvhlog(LOG_ERR, "rawts", "Unable to stat input file or file too short");
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, rt->rt_fd, 0);
+  if(map == MAP_FAILED) {
+    tvhlog(LOG_ERR, "rawts", "Unable to mmap input file -- %s",
+	   strerror(errno));
+    return NULL;
+  }
+  posix_madvise((void *)map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  wall = getmonoclock();
+  cpu  = rawts_cputime();
+
+  while(off + 188 <= st.st_size) {
+    if(map[off] != 0x47) {
+      off++;
+      resync++;
+      continue;
+    }
+    process_ts_packet(rt, map + off);
+    off += 188;
+    packets++;
+  }
+
+  rawts_bench_destroy_all(rt, stages, &frames);
+
+  cpu  = rawts_cputime() - cpu;
+  wall = getmonoclock() - wall;
+
+  munmap((void *)map, st.st_size);
+
+  rawts_bench_report(rt, packets, resync, wall, cpu, stages, frames);
+  kill(getpid(), SIGTERM);
+  return NULL;
+}
+
+
+/**
+ * 'bench' is NULL for normal (looped, real time) operation, otherwise
+ * it's <speed>[,<sink>] where speed is a multiple of real time (0 for
+ * unpaced) and sink is 'null' (default) or 'mkv:<directory>'
+ */
 void
-rawts_init(const char *filename)
+rawts_init(const char *filename, const char *bench)
 {
   pthread_t ptid;
   rawts_t *rt;
+  const char *sink;
   int fd = tvh_open(filename, O_RDONLY, 0);
 
   if(fd == -1) {
@@ -321,8 +627,30 @@ rawts_init(const char *filename)
 
   rt = calloc(1, sizeof(rawts_t));
   rt->rt_fd = fd;
+  rt->rt_speed = 1;
 
   rt->rt_identifier = strdup("rawts");
 
+  if(bench != NULL) {
+    rt->rt_bench = 1;
+    rt->rt_speed = atoi(bench);
+    if(rt->rt_speed < 0)
+      rt->rt_speed = 0;
+
+    if((sink = strchr(bench, ',')) != NULL) {
+      sink++;
+      if(!strncmp(sink, "mkv:", 4) && sink[4])
+	rt->rt_mkvdir = strdup(sink + 4);
+      else if(strcmp(sink, "null"))
+	tvhlog(LOG_ERR, "rawts", "Unknown sink '%s', using null sink", sink);
+    }
+
+    tvhlog(LOG_NOTICE, "rawts", "Benchmarking %s at %dx real time "
+	   "(0 = unpaced), %s sink",
+	   filename, rt->rt_speed, rt->rt_mkvdir ? "mkv" : "null");
+    pthread_create(&ptid, NULL, raw_ts_bench, rt);
+    return;
+  }
+
   pthread_create(&ptid, NULL, raw_ts_reader, rt);
 }
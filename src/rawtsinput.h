@@ -1,4 +1,4 @@
 
 
-void rawts_init(const char *filename);
+void rawts_init(const char *filename, const char *bench);
 
@@ -47,20 +47,30 @@
 #include "atomic.h"
 #include "dvb/dvb.h"
 #include "htsp.h"
+#include "settings.h"
+#include "timeshift.h"
 
 #define SERVICE_HASH_WIDTH 101
+#define PTS_MASK 0x1ffffffffLL
 
 static struct service_list servicehash[SERVICE_HASH_WIDTH];
 
 static void service_data_timeout(void *aux);
 
+/**
+ * GOP cache limits, from 'maxsize' (kB) and 'maxduration' (ms) in
+ * service/gopcache. A maxsize of 0 disables the cache.
+ */
+static size_t service_gop_cache_max_bytes = 8 * 1024 * 1024;
+static int64_t service_gop_cache_max_duration = 5 * 90000;
+
 /**
  *
  */
 static void
 stream_init(elementary_stream_t *st)
 {
-  st->es_cc_valid = 0;
+  service_stream_hot(st)->esh_cc_valid = 0;
 
   st->es_startcond = 0xffffffff;
   st->es_curdts = PTS_UNSET;
@@ -110,6 +120,24 @@ stream_clean(elementary_stream_t *st)
 }
 
 
+/**
+ * Remove the stream's slot from s_es_hot, the last slot is moved
+ * into the hole
+ */
+static void
+stream_hot_remove(service_t *t, elementary_stream_t *st)
+{
+  elementary_stream_hot_t *esh;
+  int last = --t->s_es_hot_count;
+
+  if(st->es_slot != last) {
+    esh = &t->s_es_hot[st->es_slot];
+    *esh = t->s_es_hot[last];
+    esh->esh_stream->es_slot = st->es_slot;
+  }
+}
+
+
 /**
  *
  */
@@ -119,6 +147,7 @@ service_stream_destroy(service_t *t, elementary_stream_t *st)
   if(t->s_status == SERVICE_RUNNING)
     stream_clean(st);
   TAILQ_REMOVE(&t->s_components, st, es_link);
+  stream_hot_remove(t, st);
   free(st->es_nicename);
   free(st);
 }
@@ -152,6 +181,8 @@ service_stop(service_t *t)
   TAILQ_FOREACH(st, &t->s_components, es_link)
     stream_clean(st);
 
+  service_gop_cache_flush(t);
+
   t->s_status = SERVICE_IDLE;
 
   pthread_mutex_unlock(&t->s_stream_mutex);
@@ -198,6 +229,9 @@ service_start(service_t *t, unsigned int weight, int force_start)
   assert(t->s_status != SERVICE_RUNNING);
   t->s_streaming_status = 0;
   t->s_pcr_drift = 0;
+  t->s_zap_start = getmonoclock();
+  t->s_zap_input = 0;
+  t->s_zap_pmt = 0;
 
   if((r = t->s_start_feed(t, weight, force_start)))
     return r;
@@ -276,32 +310,48 @@ service_get_quality(service_t *t)
 
 
 
+/**
+ * Candidate for service_find()
+ */
+typedef struct service_candidate {
+  service_t *sc_service;
+  int sc_quality;
+  int sc_prio;
+} service_candidate_t;
+
+
 /**
  *  a - b  -> lowest number first
  */
 static int
 servicecmp(const void *A, const void *B)
 {
-  service_t *a = *(service_t **)A;
-  service_t *b = *(service_t **)B;
+  const service_candidate_t *a = A;
+  const service_candidate_t *b = B;
 
-  int q = service_get_quality(a) - service_get_quality(b);
+  int q = a->sc_quality - b->sc_quality;
 
   if(q != 0)
     return q; /* Quality precedes priority */
 
-  return service_get_prio(a) - service_get_prio(b);
+  return a->sc_prio - b->sc_prio;
 }
 
 
 /**
+ * Find and start a service for the channel
  *
+ * Candidates are ordered by quality, then by priority (source type,
+ * scrambling, host connection) plus the cost of starting them. The
+ * start cost prefers adapters already tuned to the right mux, then
+ * idle adapters with short zap times, then the least loaded ones.
  */
 service_t *
 service_find(channel_t *ch, unsigned int weight, const char *loginfo,
 	       int *errorp, service_t *skip)
 {
-  service_t *t, **vec;
+  service_t *t;
+  service_candidate_t *vec;
   int cnt = 0, i, r, off;
   int err = 0;
 
@@ -312,7 +362,7 @@ service_find(channel_t *ch, unsigned int weight, const char *loginfo,
   LIST_FOREACH(t, &ch->ch_services, s_ch_link)
     cnt++;
 
-  vec = alloca(cnt * sizeof(service_t *));
+  vec = alloca(cnt * sizeof(service_candidate_t));
   cnt = 0;
   LIST_FOREACH(t, &ch->ch_services, s_ch_link) {
 
@@ -334,20 +384,29 @@ service_find(channel_t *ch, unsigned int weight, const char *loginfo,
       }
       continue;
     }
-    vec[cnt++] = t;
+    vec[cnt].sc_service = t;
+    vec[cnt].sc_quality = service_get_quality(t);
+    vec[cnt].sc_prio = service_get_prio(t) +
+      (t->s_start_cost != NULL ? t->s_start_cost(t) : 0);
+
+    if(loginfo != NULL)
+      tvhlog(LOG_DEBUG, "Service", "%s: Candidate \"%s\" quality %d, "
+	     "priority %d", loginfo, service_nicename(t),
+	     -vec[cnt].sc_quality, vec[cnt].sc_prio);
+    cnt++;
   }
 
   /* Sort services, lower priority should come come earlier in the vector
      (i.e. it will be more favoured when selecting a service */
 
-  qsort(vec, cnt, sizeof(service_t *), servicecmp);
+  qsort(vec, cnt, sizeof(service_candidate_t), servicecmp);
 
   // Skip up to the service that the caller didn't want
   // If the sorting above is not stable that might mess up things
   // temporary. But it should resolve itself eventually
   if(skip != NULL) {
     for(i = 0; i < cnt; i++) {
-      if(skip == t)
+      if(skip == vec[i].sc_service)
 	break;
     }
     off = i + 1;
@@ -357,7 +416,7 @@ service_find(channel_t *ch, unsigned int weight, const char *loginfo,
 
   /* First, try all services without stealing */
   for(i = off; i < cnt; i++) {
-    t = vec[i];
+    t = vec[i].sc_service;
     if(t->s_status == SERVICE_RUNNING) 
       return t;
     if((r = service_start(t, 0, 0)) == 0)
@@ -371,7 +430,7 @@ service_find(channel_t *ch, unsigned int weight, const char *loginfo,
      transponders */
 
   for(i = off; i < cnt; i++) {
-    t = vec[i];
+    t = vec[i].sc_service;
     if((r = service_start(t, weight, 0)) == 0)
       return t;
     *errorp = r;
@@ -472,6 +531,9 @@ service_destroy(service_t *t)
     free(st->es_nicename);
     free(st);
   }
+  free(t->s_es_hot);
+  t->s_es_hot = NULL;
+  t->s_es_hot_count = 0;
 
   free(t->s_pat_section);
   free(t->s_pmt_section);
@@ -507,6 +569,7 @@ service_create(const char *identifier, int type, int source_type)
   t->s_dvb_default_charset = NULL;
   t->s_dvb_eit_enable = 1;
   TAILQ_INIT(&t->s_components);
+  TAILQ_INIT(&t->s_gop_cache);
 
   streaming_pad_init(&t->s_streaming_pad);
 
@@ -591,6 +654,7 @@ service_stream_create(service_t *t, int pid,
 			streaming_component_type_t type)
 {
   elementary_stream_t *st;
+  elementary_stream_hot_t *esh;
   int i = 0;
   int idx = 0;
   lock_assert(&t->s_stream_mutex);
@@ -612,6 +676,18 @@ service_stream_create(service_t *t, int pid,
   st->es_service = t;
 
   st->es_pid = pid;
+
+  if(t->s_es_hot_count == t->s_es_hot_size) {
+    t->s_es_hot_size = MAX(8, t->s_es_hot_size * 2);
+    t->s_es_hot = realloc(t->s_es_hot,
+			  t->s_es_hot_size * sizeof(elementary_stream_hot_t));
+  }
+  st->es_slot = t->s_es_hot_count++;
+  esh = &t->s_es_hot[st->es_slot];
+  memset(esh, 0, sizeof(elementary_stream_hot_t));
+  esh->esh_pid = pid;
+  esh->esh_type = type;
+  esh->esh_stream = st;
   st->es_demuxer_fd = -1;
 
   avgstat_init(&st->es_rate, 10);
@@ -631,20 +707,33 @@ service_stream_create(service_t *t, int pid,
 
 
 /**
- * Add a new stream to a service
+ * Find the per packet state for a PID
+ */
+elementary_stream_hot_t *
+service_stream_hot_find(service_t *t, int pid)
+{
+  elementary_stream_hot_t *esh = t->s_es_hot;
+  int i;
+
+  for(i = 0; i < t->s_es_hot_count; i++, esh++)
+    if(esh->esh_pid == pid)
+      return esh;
+  return NULL;
+}
+
+
+/**
+ * Find a stream by PID
  */
 elementary_stream_t *
 service_stream_find(service_t *t, int pid)
 {
-  elementary_stream_t *st;
+  elementary_stream_hot_t *esh;
  
   lock_assert(&t->s_stream_mutex);
 
-  TAILQ_FOREACH(st, &t->s_components, es_link) {
-    if(st->es_pid == pid)
-      return st;
-  }
-  return NULL;
+  esh = service_stream_hot_find(t, pid);
+  return esh != NULL ? esh->esh_stream : NULL;
 }
 
 
@@ -781,6 +870,9 @@ service_set_streaming_status_flags(service_t *t, int set)
 
   t->s_streaming_status = n;
 
+  if(n & TSS_INPUT_HARDWARE && t->s_zap_input == 0)
+    t->s_zap_input = getmonoclock();
+
   tvhlog(LOG_DEBUG, "Service", "%s: Status changed to %s%s%s%s%s%s%s",
 	 service_nicename(t),
 	 n & TSS_INPUT_HARDWARE ? "[Hardware input] " : "",
@@ -811,6 +903,11 @@ service_restart(service_t *t, int had_components)
   streaming_message_t *sm;
   lock_assert(&t->s_stream_mutex);
 
+  /* Component indices may change, cached packets are of no use */
+  service_gop_cache_flush(t);
+  if(t->s_timeshift != NULL)
+    timeshift_flush(t->s_timeshift);
+
   if(had_components) {
     sm = streaming_msg_create_code(SMT_STOP, SM_CODE_SOURCE_RECONFIGURED);
     streaming_pad_deliver(&t->s_streaming_pad, sm);
@@ -953,6 +1050,78 @@ service_saver(void *aux)
 }
 
 
+/**
+ * Drop all cached packets, the cache stays empty until the next
+ * I-frame
+ *
+ * s_stream_mutex must be held
+ */
+void
+service_gop_cache_flush(service_t *t)
+{
+  pktref_clear_queue(&t->s_gop_cache);
+  t->s_gop_cache_bytes = 0;
+  t->s_gop_cache_valid = 0;
+}
+
+
+/**
+ * Add a packet delivered on the service's streaming pad to the GOP
+ * cache. An I-frame on the first video stream restarts the cache.
+ * If the GOP grows beyond the configured size or duration the cache
+ * is dropped until the next I-frame.
+ *
+ * s_stream_mutex must be held
+ */
+void
+service_gop_cache_add(service_t *t, elementary_stream_t *st, th_pkt_t *pkt)
+{
+  elementary_stream_t *v;
+  size_t size;
+  int64_t d = 0;
+
+  if(service_gop_cache_max_bytes == 0)
+    return;
+
+  if(pkt->pkt_frametype == PKT_I_FRAME && SCT_ISVIDEO(st->es_type)) {
+    TAILQ_FOREACH(v, &t->s_components, es_link)
+      if(SCT_ISVIDEO(v->es_type))
+	break;
+
+    if(v == st) {
+      service_gop_cache_flush(t);
+      t->s_gop_cache_valid = 1;
+      t->s_gop_cache_dts = pkt->pkt_dts;
+    }
+  }
+
+  if(!t->s_gop_cache_valid)
+    return;
+
+  size = sizeof(th_pkt_t) +
+    (pkt->pkt_payload != NULL ? pktbuf_len(pkt->pkt_payload) : 0) +
+    (pkt->pkt_header  != NULL ? pktbuf_len(pkt->pkt_header)  : 0);
+
+  if(pkt->pkt_dts != PTS_UNSET && t->s_gop_cache_dts != PTS_UNSET) {
+    /* Signed 33 bit difference, audio muxed right after the I-frame
+       may be slightly behind it */
+    d = (pkt->pkt_dts - t->s_gop_cache_dts) & PTS_MASK;
+    if(d > PTS_MASK / 2)
+      d -= PTS_MASK + 1;
+  }
+
+  if(t->s_gop_cache_bytes + size > service_gop_cache_max_bytes ||
+     d > service_gop_cache_max_duration) {
+    service_gop_cache_flush(t);
+    return;
+  }
+
+  pkt_ref_inc(pkt);
+  pktref_enqueue(&t->s_gop_cache, pkt);
+  t->s_gop_cache_bytes += size;
+}
+
+
 /**
  *
  */
@@ -960,6 +1129,17 @@ void
 service_init(void)
 {
   pthread_t tid;
+  htsmsg_t *m;
+  uint32_t u32;
+
+  if((m = hts_settings_load("service/gopcache")) != NULL) {
+    if(!htsmsg_get_u32(m, "maxsize", &u32))
+      service_gop_cache_max_bytes = (size_t)u32 * 1024;
+    if(!htsmsg_get_u32(m, "maxduration", &u32))
+      service_gop_cache_max_duration = (int64_t)u32 * 90;
+    htsmsg_destroy(m);
+  }
+
   TAILQ_INIT(&pending_save_queue);
   pthread_mutex_init(&pending_save_mutex, NULL);
   pthread_cond_init(&pending_save_cond, NULL);
@@ -66,38 +66,66 @@ typedef struct caid {
 
 } caid_t;
 
+/**
+ * Per packet state of a stream
+ *
+ * Kept in a dense array per service (s_es_hot) so the demuxer can
+ * find the stream for a PID and check its continuity counter without
+ * walking s_components and touching every elementary_stream_t.
+ * Entries move when streams are removed, use service_stream_hot()
+ * and don't keep pointers to them across calls that may add or
+ * remove streams.
+ */
+typedef struct elementary_stream_hot {
+  int16_t esh_pid;
+  uint8_t esh_cc;            /* Next expected CC */
+  uint8_t esh_cc_valid;      /* Is CC valid at all? */
+  uint8_t esh_type;          /* Copy of es_type */
+  struct elementary_stream *esh_stream;
+} elementary_stream_hot_t;
+
+
 /**
  * Stream, one media component for a service.
+ *
+ * Fields used for every packet of the stream come first, static
+ * metadata and statistics last
  */
 typedef struct elementary_stream {
 
-  TAILQ_ENTRY(elementary_stream) es_link;
-  int es_position;
   struct service *es_service;
+  int es_slot;               /* Index in s_es_hot */
 
   streaming_component_type_t es_type;
   int es_index;
 
-  uint16_t es_aspect_num;
-  uint16_t es_aspect_den;
+  int16_t es_pid;
 
-  char es_lang[4];           /* ISO 639 3-letter language code */
-  uint16_t es_composition_id;
-  uint16_t es_ancillary_id;
+  /* For service stream packet reassembly */
 
-  int16_t es_pid;
-  uint16_t es_parent_pid;    /* For subtitle streams originating from 
-				a teletext stream. this is the pid
-				of the teletext stream */
+  sbuf_t es_buf;
 
-  uint8_t es_cc;             /* Last CC */
-  uint8_t es_cc_valid;       /* Is CC valid at all? */
+  uint32_t es_startcond;
+  uint32_t es_startcode;
+  uint32_t es_startcode_offset;
+  int es_parser_state;
+  int es_parser_ptr;
+  void *es_priv;          /* Parser private data */
 
-  avgstat_t es_cc_errors;
-  avgstat_t es_rate;
+  struct th_pkt *es_curpkt;
+  int64_t es_curpts;
+  int64_t es_curdts;
+  int64_t es_prevdts;
+  int64_t es_nextdts;
+  int es_frame_duration;
+  int es_width;
+  int es_height;
 
-  int es_demuxer_fd;
-  int es_peak_presentation_delay; /* Max seen diff. of DTS and PTS */
+  int es_incomplete;
+  int es_ssc_intercept;
+  int es_ssc_ptr;
+
+  int es_meta_change;
 
   struct psi_section *es_section;
   int es_section_docrc;           /* Set if we should verify CRC on tables */
@@ -111,38 +139,32 @@ typedef struct elementary_stream {
   int64_t es_pcr_last;          /* PCR clock when we saw last PCR */
   int64_t es_pcr_drift;
 
-  /* For service stream packet reassembly */
+  /* Everything below is not touched per packet */
 
-  sbuf_t es_buf;
+  TAILQ_ENTRY(elementary_stream) es_link;
+  int es_position;
 
-  uint32_t es_startcond;
-  uint32_t es_startcode;
-  uint32_t es_startcode_offset;
-  int es_parser_state;
-  int es_parser_ptr;
-  void *es_priv;          /* Parser private data */
+  uint16_t es_aspect_num;
+  uint16_t es_aspect_den;
+
+  char es_lang[4];           /* ISO 639 3-letter language code */
+  uint16_t es_composition_id;
+  uint16_t es_ancillary_id;
+
+  uint16_t es_parent_pid;    /* For subtitle streams originating from 
+				a teletext stream. this is the pid
+				of the teletext stream */
+
+  int es_demuxer_fd;
+  int es_peak_presentation_delay; /* Max seen diff. of DTS and PTS */
 
   sbuf_t es_buf_ps;       // program stream reassembly (analogue adapters)
   sbuf_t es_buf_a;        // Audio packet reassembly
 
   uint8_t *es_global_data;
   int es_global_data_len;
-  int es_incomplete;
-  int es_ssc_intercept;
-  int es_ssc_ptr;
   uint8_t es_ssc_buf[32];
 
-  struct th_pkt *es_curpkt;
-  int64_t es_curpts;
-  int64_t es_curdts;
-  int64_t es_prevdts;
-  int64_t es_nextdts;
-  int es_frame_duration;
-  int es_width;
-  int es_height;
-
-  int es_meta_change;
-
   /* CA ID's on this stream */
   struct caid_list es_caids;
 
@@ -153,16 +175,18 @@ typedef struct elementary_stream {
 
   int es_delete_me;      /* Temporary flag for deleting streams */
 
-  /* Error log limiters */
+  /* Teletext subtitle */ 
+  char es_blank; // Last subtitle was blank
 
-  loglimiter_t es_loglimit_cc;
-  loglimiter_t es_loglimit_pes;
-  
   char *es_nicename;
 
-  /* Teletext subtitle */ 
-  char es_blank; // Last subtitle was blank
+  /* Statistics and error log limiters */
 
+  avgstat_t es_cc_errors;
+  avgstat_t es_rate;
+
+  loglimiter_t es_loglimit_cc;
+  loglimiter_t es_loglimit_pes;
 
 } elementary_stream_t;
 
@@ -276,6 +300,13 @@ typedef struct service {
 
   int (*s_grace_period)(struct service *t);
 
+  /**
+   * Cost of starting the service, see service_find(). 0 if it can be
+   * started without disturbing anything (such as when the tuner is
+   * already on the right mux). May be NULL
+   */
+  int (*s_start_cost)(struct service *t);
+
   void (*s_dtor)(struct service *t);
 
   /*
@@ -336,6 +367,7 @@ typedef struct service {
 
   /**
    * Service probe, see serviceprobe.c for details
+   * 1 = on queue, 2 = currently being probed
    */
   int s_sp_onqueue;
   TAILQ_ENTRY(service) s_sp_link;
@@ -367,6 +399,7 @@ typedef struct service {
   struct in6_addr s_iptv_group6;
   uint16_t s_iptv_port;
   int s_iptv_fd;
+  struct iptv_socket *s_iptv_socket;
 
   /**
    * For per-transport PAT/PMT parsers, allocated on demand
@@ -413,6 +446,15 @@ typedef struct service {
    */			   
   int s_streaming_status;
 
+  /**
+   * Zap timing (getmonoclock()), set when the service is started and
+   * when the first input packet and the first PMT are seen (0 until
+   * then). Protected by s_stream_mutex
+   */
+  int64_t s_zap_start;
+  int64_t s_zap_input;
+  int64_t s_zap_pmt;
+
   // Progress
 #define TSS_INPUT_HARDWARE   0x1
 #define TSS_INPUT_SERVICE    0x2
@@ -464,12 +506,42 @@ typedef struct service {
    */
   struct elementary_stream_queue s_components;
 
+  /**
+   * Per packet state of the components, see elementary_stream_hot_t
+   */
+  elementary_stream_hot_t *s_es_hot;
+  int s_es_hot_count;
+  int s_es_hot_size;
+
 
   /**
    * Delivery pad, this is were we finally deliver all streaming output
    */
   streaming_pad_t s_streaming_pad;
 
+  /**
+   * Shared tsfix + globalheaders chain for subscribers with
+   * SUBSCRIPTION_NORMALIZED, NULL if there are none. See normalize.c
+   */
+  struct normalizer *s_normalizer;
+
+  /**
+   * GOP cache, all packets delivered on s_streaming_pad since the
+   * last video I-frame. Handed to subscribers that link to the
+   * service while it is running so they do not have to wait for
+   * the next I-frame. See service_gop_cache_add()
+   */
+  struct th_pktref_queue s_gop_cache;
+  size_t s_gop_cache_bytes;
+  int64_t s_gop_cache_dts;   /* DTS of the I-frame */
+  int s_gop_cache_valid;     /* Set once an I-frame has been cached */
+
+  /**
+   * Timeshift store, shared by all timeshifting subscribers.
+   * NULL if there are none. See timeshift.c
+   */
+  struct timeshift *s_timeshift;
+
 
   loglimiter_t s_loglimit_tei;
 
@@ -516,6 +588,14 @@ service_t *service_find(struct channel *ch, unsigned int weight,
 
 elementary_stream_t *service_stream_find(service_t *t, int pid);
 
+elementary_stream_hot_t *service_stream_hot_find(service_t *t, int pid);
+
+static inline elementary_stream_hot_t *
+service_stream_hot(elementary_stream_t *st)
+{
+  return &st->es_service->s_es_hot[st->es_slot];
+}
+
 elementary_stream_t *service_stream_create(service_t *t, int pid,
 				     streaming_component_type_t type);
 
@@ -543,6 +623,11 @@ void service_set_enable(service_t *t, int enabled);
 
 void service_restart(service_t *t, int had_components);
 
+void service_gop_cache_add(service_t *t, elementary_stream_t *st,
+			   struct th_pkt *pkt);
+
+void service_gop_cache_flush(service_t *t);
+
 void service_stream_destroy(service_t *t, elementary_stream_t *st);
 
 void service_request_save(service_t *t, int restart);
@@ -33,11 +33,48 @@
 #include "serviceprobe.h"
 #include "streaming.h"
 #include "service.h"
+#include "settings.h"
+#include "notify.h"
+#if ENABLE_LINUXDVB
+#include "dvb/dvb.h"
+#endif
+
+/**
+ * Max number of services probed at the same time, unless overridden
+ * by 'concurrency' in serviceprobe/config
+ */
+#define SERVICEPROBE_DEFAULT_CONCURRENCY 8
+
+/**
+ * A service currently being probed
+ */
+typedef struct serviceprobe {
+  LIST_ENTRY(serviceprobe) sp_link;
+
+  service_t *sp_service;
+  th_subscription_t *sp_s;
+  streaming_target_t sp_st;
+
+  /* Written from the streaming thread (with s_stream_mutex held) */
+  volatile int sp_done;
+  const char *sp_err;
+
+} serviceprobe_t;
 
 /* List of transports to be probed, protected with global_lock */
 static struct service_queue serviceprobe_queue;  
 static pthread_cond_t serviceprobe_cond;
 
+/* Active probes, protected with global_lock */
+static LIST_HEAD(, serviceprobe) serviceprobe_active;
+static int serviceprobe_nactive;
+static int serviceprobe_concurrency = SERVICEPROBE_DEFAULT_CONCURRENCY;
+
+/* Progress of the current batch */
+static int serviceprobe_nqueued;
+static int serviceprobe_ndone;
+static time_t serviceprobe_batch_start;
+
 /**
  *
  */
@@ -55,6 +92,7 @@ serviceprobe_enqueue(service_t *t)
 
   t->s_sp_onqueue = 1;
   TAILQ_INSERT_TAIL(&serviceprobe_queue, t, s_sp_link);
+  serviceprobe_nqueued++;
   pthread_cond_signal(&serviceprobe_cond);
 }
 
@@ -65,9 +103,10 @@ serviceprobe_enqueue(service_t *t)
 void
 serviceprobe_delete(service_t *t)
 {
-  if(!t->s_sp_onqueue)
-    return;
+  if(t->s_sp_onqueue != 1)
+    return; /* Not queued, or currently being probed */
   TAILQ_REMOVE(&serviceprobe_queue, t, s_sp_link);
+  serviceprobe_nqueued--;
   t->s_sp_onqueue = 0;
 }
 
@@ -75,141 +114,344 @@ serviceprobe_delete(service_t *t)
 /**
  *
  */
-static void *
-serviceprobe_thread(void *aux)
+static void
+serviceprobe_notify(void)
+{
+  htsmsg_t *m = htsmsg_create_map();
+  int elapsed = dispatch_clock - serviceprobe_batch_start;
+
+  htsmsg_add_u32(m, "queued", serviceprobe_nqueued);
+  htsmsg_add_u32(m, "active", serviceprobe_nactive);
+  htsmsg_add_u32(m, "done", serviceprobe_ndone);
+  htsmsg_add_u32(m, "rate",
+		 elapsed > 0 ? serviceprobe_ndone * 60 / elapsed : 0);
+  notify_by_msg("serviceprobe", m);
+}
+
+
+/**
+ * Streaming callback, called with s_stream_mutex held so we can not
+ * touch anything but the probe itself here
+ */
+static void
+serviceprobe_input(void *opaque, streaming_message_t *sm)
+{
+  serviceprobe_t *sp = opaque;
+  int status;
+
+  if(sm->sm_type == SMT_SERVICE_STATUS && !sp->sp_done) {
+    status = sm->sm_code;
+
+    if(status & TSS_PACKETS) {
+      sp->sp_err = NULL;
+      sp->sp_done = 1;
+    } else if(status & (TSS_GRACEPERIOD | TSS_ERRORS)) {
+      sp->sp_err = service_tss2text(status);
+      sp->sp_done = 1;
+    }
+
+    if(sp->sp_done)
+      pthread_cond_signal(&serviceprobe_cond);
+  }
+  streaming_msg_free(sm);
+}
+
+
+/**
+ * Return 1 if 't' is received on the same mux (or tuner) as 'u'
+ */
+static int
+serviceprobe_same_mux(service_t *t, service_t *u)
+{
+  if(t->s_type != u->s_type)
+    return 0;
+
+  switch(t->s_type) {
+  case SERVICE_TYPE_DVB:
+    return t->s_dvb_mux_instance == u->s_dvb_mux_instance;
+  case SERVICE_TYPE_V4L:
+    return t->s_v4l_adapter == u->s_v4l_adapter &&
+      t->s_v4l_frequency == u->s_v4l_frequency;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ * Return 1 if starting 't' would retune a tuner used by 'u'
+ */
+static int
+serviceprobe_conflicts(service_t *t, service_t *u)
+{
+  if(t->s_type != u->s_type || serviceprobe_same_mux(t, u))
+    return 0;
+
+  switch(t->s_type) {
+#if ENABLE_LINUXDVB
+  case SERVICE_TYPE_DVB:
+    return t->s_dvb_mux_instance->tdmi_adapter ==
+      u->s_dvb_mux_instance->tdmi_adapter;
+#endif
+  case SERVICE_TYPE_V4L:
+    return t->s_v4l_adapter == u->s_v4l_adapter;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ * Return 1 if the tuner for 't' is already on the right mux
+ */
+static int
+serviceprobe_is_tuned(service_t *t)
+{
+  serviceprobe_t *sp;
+
+#if ENABLE_LINUXDVB
+  if(t->s_type == SERVICE_TYPE_DVB &&
+     t->s_dvb_mux_instance->tdmi_adapter->tda_mux_current ==
+     t->s_dvb_mux_instance)
+    return 1;
+#endif
+
+  LIST_FOREACH(sp, &serviceprobe_active, sp_link)
+    if(serviceprobe_same_mux(t, sp->sp_service))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Return 1 if the tuner for 't' is not used by anyone
+ */
+static int
+serviceprobe_is_idle(service_t *t)
+{
+  serviceprobe_t *sp;
+
+  LIST_FOREACH(sp, &serviceprobe_active, sp_link)
+    if(serviceprobe_conflicts(t, sp->sp_service))
+      return 0;
+
+#if ENABLE_LINUXDVB
+  if(t->s_type == SERVICE_TYPE_DVB &&
+     service_compute_weight(&t->s_dvb_mux_instance->tdmi_adapter->
+			    tda_transports) > 0)
+    return 0;
+#endif
+  return 1;
+}
+
+
+/**
+ * Pick the next service to probe
+ *
+ * Services on a mux that is already tuned go first so a whole mux is
+ * probed in parallel without retuning. Then services whose tuner is
+ * idle, so all free adapters are put to work. Only when nothing else
+ * is being probed do we take over a tuner that is in use (as we always
+ * did before probing was done in parallel).
+ */
+static service_t *
+serviceprobe_pick(void)
 {
   service_t *t;
-  th_subscription_t *s;
-  int was_doing_work = 0;
-  streaming_queue_t sq;
-  streaming_message_t *sm;
-  //  transport_feed_status_t status;
-  int run;
-  const char *err;
-  channel_t *ch;
 
-  pthread_mutex_lock(&global_lock);
+  TAILQ_FOREACH(t, &serviceprobe_queue, s_sp_link)
+    if(serviceprobe_is_tuned(t))
+      return t;
 
-  streaming_queue_init(&sq, 0);
+  TAILQ_FOREACH(t, &serviceprobe_queue, s_sp_link)
+    if(serviceprobe_is_idle(t))
+      return t;
 
-  while(1) {
+  if(serviceprobe_nactive == 0)
+    return TAILQ_FIRST(&serviceprobe_queue);
 
-    while((t = TAILQ_FIRST(&serviceprobe_queue)) == NULL) {
+  return NULL;
+}
 
-      if(was_doing_work) {
-	tvhlog(LOG_INFO, "serviceprobe", "Now idle");
-	was_doing_work = 0;
-      }
-      pthread_cond_wait(&serviceprobe_cond, &global_lock);
-    }
 
-    if(!was_doing_work) {
-      tvhlog(LOG_INFO, "serviceprobe", "Starting");
-      was_doing_work = 1;
-    }
+/**
+ *
+ */
+static void
+serviceprobe_start(service_t *t)
+{
+  serviceprobe_t *sp = calloc(1, sizeof(serviceprobe_t));
+
+  TAILQ_REMOVE(&serviceprobe_queue, t, s_sp_link);
+  serviceprobe_nqueued--;
+
+  tvhlog(LOG_INFO, "serviceprobe", "%20s: checking...",
+	 t->s_svcname);
 
-    tvhlog(LOG_INFO, "serviceprobe", "%20s: checking...",
+  streaming_target_init(&sp->sp_st, serviceprobe_input, sp, 0);
+
+  sp->sp_s = subscription_create_from_service(t, "serviceprobe",
+					      &sp->sp_st, 0);
+  if(sp->sp_s == NULL) {
+    t->s_sp_onqueue = 0;
+    tvhlog(LOG_INFO, "serviceprobe", "%20s: could not subscribe",
 	   t->s_svcname);
+    free(sp);
+    return;
+  }
 
-    s = subscription_create_from_service(t, "serviceprobe", &sq.sq_st, 0);
-    if(s == NULL) {
-      t->s_sp_onqueue = 0;
-      TAILQ_REMOVE(&serviceprobe_queue, t, s_sp_link);
-      tvhlog(LOG_INFO, "serviceprobe", "%20s: could not subscribe",
-	     t->s_svcname);
-      continue;
-    }
+  t->s_sp_onqueue = 2;
+  service_ref(t);
+  sp->sp_service = t;
+  LIST_INSERT_HEAD(&serviceprobe_active, sp, sp_link);
+  serviceprobe_nactive++;
+}
 
-    service_ref(t);
-    pthread_mutex_unlock(&global_lock);
 
-    run = 1;
-    pthread_mutex_lock(&sq.sq_mutex);
+/**
+ * Map a successfully probed service to a channel
+ */
+static void
+serviceprobe_map(service_t *t)
+{
+  const char *str;
+  channel_t *ch;
+
+  ch = channel_find_by_name(t->s_svcname, 1, t->s_channel_number);
+  service_map_channel(t, ch, 1);
+      
+  tvhlog(LOG_INFO, "serviceprobe", "%20s: mapped to channel \"%s\"",
+	 t->s_svcname, t->s_svcname);
 
-    while(run) {
+  if(service_is_tv(t)) {
+    channel_tag_map(ch, channel_tag_find_by_name("TV channels", 1), 1);
+    tvhlog(LOG_INFO, "serviceprobe", "%20s: joined tag \"%s\"",
+	   t->s_svcname, "TV channels");
+  }
 
-      while((sm = TAILQ_FIRST(&sq.sq_queue)) == NULL)
-	pthread_cond_wait(&sq.sq_cond, &sq.sq_mutex);
-      TAILQ_REMOVE(&sq.sq_queue, sm, sm_link);
+  switch(t->s_servicetype) {
+  case ST_SDTV:
+  case ST_AC_SDTV:
+    str = "SDTV";
+    break;
+  case ST_HDTV:
+  case ST_AC_HDTV:
+    str = "HDTV";
+    break;
+  case ST_RADIO:
+    str = "Radio";
+    break;
+  default:
+    str = NULL;
+  }
 
-      pthread_mutex_unlock(&sq.sq_mutex);
+  if(str != NULL) {
+    channel_tag_map(ch, channel_tag_find_by_name(str, 1), 1);
+    tvhlog(LOG_INFO, "serviceprobe", "%20s: joined tag \"%s\"",
+	   t->s_svcname, str);
+  }
 
-      if(sm->sm_type == SMT_SERVICE_STATUS) {
-	int status = sm->sm_code;
+  if(t->s_provider != NULL) {
+    channel_tag_map(ch, channel_tag_find_by_name(t->s_provider, 1), 1);
+    tvhlog(LOG_INFO, "serviceprobe", "%20s: joined tag \"%s\"",
+	   t->s_svcname, t->s_provider);
+  }
+  channel_save(ch);
+}
 
-	if(status & TSS_PACKETS) {
-	  run = 0;
-	  err = NULL;
-	} else if(status & (TSS_GRACEPERIOD | TSS_ERRORS)) {
-	  run = 0;
-	  err = service_tss2text(status);
-	}
-      }
 
-      streaming_msg_free(sm);
-      pthread_mutex_lock(&sq.sq_mutex);
-    }
+/**
+ * Finish all probes that have got a verdict
+ */
+static int
+serviceprobe_reap(void)
+{
+  serviceprobe_t *sp, *next;
+  service_t *t;
+  int n = 0;
 
-    streaming_queue_clear(&sq.sq_queue);
-    pthread_mutex_unlock(&sq.sq_mutex);
+  for(sp = LIST_FIRST(&serviceprobe_active); sp != NULL; sp = next) {
+    next = LIST_NEXT(sp, sp_link);
+    t = sp->sp_service;
 
-    pthread_mutex_lock(&global_lock);
-    subscription_unsubscribe(s);
+    if(!sp->sp_done && t->s_status != SERVICE_ZOMBIE)
+      continue;
+
+    subscription_unsubscribe(sp->sp_s);
 
     if(t->s_status != SERVICE_ZOMBIE) {
 
-      if(err != NULL) {
+      if(!sp->sp_done) {
+	tvhlog(LOG_INFO, "serviceprobe", "%20s: skipped: service deleted",
+	       t->s_svcname);
+      } else if(sp->sp_err != NULL) {
 	tvhlog(LOG_INFO, "serviceprobe", "%20s: skipped: %s",
-	       t->s_svcname, err);
+	       t->s_svcname, sp->sp_err);
       } else if(t->s_ch == NULL) {
-	const char *str;
+	serviceprobe_map(t);
+      }
+    }
+    t->s_sp_onqueue = 0;
+    service_unref(t);
 
-	ch = channel_find_by_name(t->s_svcname, 1, t->s_channel_number);
-	service_map_channel(t, ch, 1);
-      
-	tvhlog(LOG_INFO, "serviceprobe", "%20s: mapped to channel \"%s\"",
-	       t->s_svcname, t->s_svcname);
-
-	if(service_is_tv(t)) {
- 	  channel_tag_map(ch, channel_tag_find_by_name("TV channels", 1), 1);
-	  tvhlog(LOG_INFO, "serviceprobe", "%20s: joined tag \"%s\"",
-		 t->s_svcname, "TV channels");
-	}
-
-	switch(t->s_servicetype) {
-	case ST_SDTV:
-	case ST_AC_SDTV:
-	  str = "SDTV";
-	  break;
-	case ST_HDTV:
-	case ST_AC_HDTV:
-	  str = "HDTV";
-	  break;
-	case ST_RADIO:
-	  str = "Radio";
-	  break;
-	default:
-	  str = NULL;
-	}
-
-	if(str != NULL) {
-	  channel_tag_map(ch, channel_tag_find_by_name(str, 1), 1);
-	  tvhlog(LOG_INFO, "serviceprobe", "%20s: joined tag \"%s\"",
-		 t->s_svcname, str);
-	}
-
-	if(t->s_provider != NULL) {
-	  channel_tag_map(ch, channel_tag_find_by_name(t->s_provider, 1), 1);
-	  tvhlog(LOG_INFO, "serviceprobe", "%20s: joined tag \"%s\"",
-		 t->s_svcname, t->s_provider);
-	}
-	channel_save(ch);
+    LIST_REMOVE(sp, sp_link);
+    serviceprobe_nactive--;
+    serviceprobe_ndone++;
+    free(sp);
+    n++;
+  }
+  return n;
+}
+
+
+/**
+ *
+ */
+static void *
+serviceprobe_thread(void *aux)
+{
+  service_t *t;
+  int was_doing_work = 0;
+  int changed;
+  struct timespec ts;
+
+  pthread_mutex_lock(&global_lock);
+
+  while(1) {
+
+    changed = serviceprobe_reap();
+
+    while(serviceprobe_nactive < serviceprobe_concurrency &&
+	  (t = serviceprobe_pick()) != NULL) {
+
+      if(!was_doing_work) {
+	tvhlog(LOG_INFO, "serviceprobe", "Starting");
+	was_doing_work = 1;
+	serviceprobe_ndone = 0;
+	serviceprobe_batch_start = dispatch_clock;
       }
+      serviceprobe_start(t);
+      changed = 1;
+    }
+
+    if(changed)
+      serviceprobe_notify();
 
-      t->s_sp_onqueue = 0;
-      TAILQ_REMOVE(&serviceprobe_queue, t, s_sp_link);
+    if(was_doing_work && serviceprobe_nactive == 0 &&
+       TAILQ_FIRST(&serviceprobe_queue) == NULL) {
+      tvhlog(LOG_INFO, "serviceprobe", "Now idle, %d services probed in %d s",
+	     serviceprobe_ndone, 
+	     (int)(dispatch_clock - serviceprobe_batch_start));
+      was_doing_work = 0;
     }
-    service_unref(t);
+
+    /**
+     * The streaming callbacks can not take global_lock, so a wakeup
+     * may be missed. Poll once a second to be safe.
+     */
+    ts.tv_sec = time(NULL) + 1;
+    ts.tv_nsec = 0;
+    pthread_cond_timedwait(&serviceprobe_cond, &global_lock, &ts);
   }
   return NULL;
 }
@@ -222,7 +464,17 @@ void
 serviceprobe_init(void)
 {
   pthread_t ptid;
+  htsmsg_t *m;
+  uint32_t u32;
+
+  if((m = hts_settings_load("serviceprobe/config")) != NULL) {
+    if(!htsmsg_get_u32(m, "concurrency", &u32) && u32 > 0)
+      serviceprobe_concurrency = u32;
+    htsmsg_destroy(m);
+  }
+
   pthread_cond_init(&serviceprobe_cond, NULL);
   TAILQ_INIT(&serviceprobe_queue);
+  LIST_INIT(&serviceprobe_active);
   pthread_create(&ptid, NULL, serviceprobe_thread, NULL);
 }
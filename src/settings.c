@@ -26,6 +26,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "htsmsg.h"
 #include "htsmsg_json.h"
@@ -34,6 +35,43 @@
 
 static char *settingspath;
 
+/**
+ * Write-behind
+ *
+ * hts_settings_save() only queues a copy of the record. Saves of the
+ * same path within HTS_SETTINGS_WRITE_DELAY are coalesced into one
+ * write, done from a background thread together with everything else
+ * that is due at the same time.
+ */
+#define HTS_SETTINGS_WRITE_DELAY 3 /* seconds */
+#define HTS_SETTINGS_HASH_SIZE   256
+
+typedef struct hts_settings_pending {
+  LIST_ENTRY(hts_settings_pending) hsp_hash_link;
+  TAILQ_ENTRY(hts_settings_pending) hsp_link;
+  char *hsp_path;      /* Relative to settingspath */
+  htsmsg_t *hsp_record;
+  time_t hsp_due;
+} hts_settings_pending_t;
+
+TAILQ_HEAD(hts_settings_pending_queue, hts_settings_pending);
+
+/* Protects the pending queue and the counters */
+static pthread_mutex_t settings_mutex;
+static pthread_cond_t settings_cond;
+static struct hts_settings_pending_queue settings_pending;
+static LIST_HEAD(, hts_settings_pending) 
+  settings_pending_hash[HTS_SETTINGS_HASH_SIZE];
+
+/* Held while writing a batch, keeps writes of the same path in order */
+static pthread_mutex_t settings_write_mutex;
+
+static int settings_saves;
+static int settings_coalesced;
+static int settings_written;
+
+static void *hts_settings_writer(void *aux);
+
 /**
  *
  */
@@ -80,6 +118,16 @@ hts_settings_init(const char *confpath)
 	   settingspath, getuid(), getgid(), strerror(errno));
     settingspath = NULL;
   }
+
+  pthread_mutex_init(&settings_mutex, NULL);
+  pthread_mutex_init(&settings_write_mutex, NULL);
+  pthread_cond_init(&settings_cond, NULL);
+  TAILQ_INIT(&settings_pending);
+
+  if(settingspath != NULL) {
+    pthread_t ptid;
+    pthread_create(&ptid, NULL, hts_settings_writer, NULL);
+  }
 }
 
 
@@ -87,35 +135,64 @@ hts_settings_init(const char *confpath)
  *
  */
 void
-hts_settings_save(htsmsg_t *record, const char *pathfmt, ...)
+hts_settings_get_stats(int *saves, int *coalesced, int *written)
 {
-  char path[256];
-  char fullpath[256];
-  char fullpath2[256];
-  int x, l, fd;
-  va_list ap;
-  struct stat st;
-  htsbuf_queue_t hq;
-  htsbuf_data_t *hd;
-  char *n;
-  int ok;
+  pthread_mutex_lock(&settings_mutex);
+  *saves = settings_saves;
+  *coalesced = settings_coalesced;
+  *written = settings_written;
+  pthread_mutex_unlock(&settings_mutex);
+}
 
-  if(settingspath == NULL)
-    return;
 
-  va_start(ap, pathfmt);
-  vsnprintf(path, sizeof(path), pathfmt, ap);
-  va_end(ap);
+/**
+ * settings_mutex is held
+ */
+static hts_settings_pending_t *
+hts_settings_pending_find(const char *path)
+{
+  hts_settings_pending_t *hsp;
+  unsigned int hash = tvh_strhash(path, HTS_SETTINGS_HASH_SIZE);
 
-  n = path;
+  LIST_FOREACH(hsp, &settings_pending_hash[hash], hsp_hash_link)
+    if(!strcmp(hsp->hsp_path, path))
+      return hsp;
+  return NULL;
+}
 
-  while(*n) {
-    if(*n == ':' || *n == '?' || *n == '*' || *n > 127 || *n < 32)
-      *n = '_';
-    n++;
-  }
 
-  l = strlen(path);
+/**
+ * settings_mutex is held
+ */
+static void
+hts_settings_pending_unlink(hts_settings_pending_t *hsp)
+{
+  LIST_REMOVE(hsp, hsp_hash_link);
+  TAILQ_REMOVE(&settings_pending, hsp, hsp_link);
+}
+
+
+/**
+ *
+ */
+static void
+hts_settings_pending_free(hts_settings_pending_t *hsp)
+{
+  htsmsg_destroy(hsp->hsp_record);
+  free(hsp->hsp_path);
+  free(hsp);
+}
+
+
+/**
+ * Create all directories leading up to 'path'
+ */
+static int
+hts_settings_makedirs(char *path)
+{
+  char fullpath[256];
+  struct stat st;
+  int x, l = strlen(path);
 
   for(x = 0; x < l; x++) {
     if(path[x] == '/') {
@@ -127,44 +204,278 @@ hts_settings_save(htsmsg_t *record, const char *pathfmt, ...)
       if(stat(fullpath, &st) && mkdir(fullpath, 0700)) {
 	tvhlog(LOG_ALERT, "settings", "Unable to create dir \"%s\": %s",
 	       fullpath, strerror(errno));
-	return;
+	path[x] = '/';
+	return -1;
       }
       path[x] = '/';
     }
   }
+  return 0;
+}
+
+
+/**
+ * Write a record to a temporary file next to its final location and
+ * flush it to disk. Only this file is synced, a file system wide sync
+ * would also wait for recordings on the same disk
+ */
+static int
+hts_settings_write_tmp(hts_settings_pending_t *hsp)
+{
+  char fullpath[256];
+  htsbuf_queue_t hq;
+  htsbuf_data_t *hd;
+  int fd, r = 0;
+
+  if(hts_settings_makedirs(hsp->hsp_path))
+    return -1;
 
-  snprintf(fullpath, sizeof(fullpath), "%s/%s.tmp", settingspath, path);
+  snprintf(fullpath, sizeof(fullpath), "%s/%s.tmp", 
+	   settingspath, hsp->hsp_path);
 
   if((fd = tvh_open(fullpath, O_CREAT | O_TRUNC | O_RDWR, 0700)) < 0) {
     tvhlog(LOG_ALERT, "settings", "Unable to create \"%s\" - %s",
-	    fullpath, strerror(errno));
-    return;
+	   fullpath, strerror(errno));
+    return -1;
   }
 
-  ok = 1;
-
   htsbuf_queue_init(&hq, 0);
-  htsmsg_json_serialize(record, &hq, 1);
+  htsmsg_json_serialize(hsp->hsp_record, &hq, 1);
  
   TAILQ_FOREACH(hd, &hq.hq_q, hd_link)
     if(write(fd, hd->hd_data + hd->hd_data_off, hd->hd_data_len) != 
        hd->hd_data_len) {
       tvhlog(LOG_ALERT, "settings", "Failed to write file \"%s\" - %s",
-	      fullpath, strerror(errno));
-      ok = 0;
+	     fullpath, strerror(errno));
+      r = -1;
       break;
     }
 
+  if(!r && fdatasync(fd)) {
+    tvhlog(LOG_ALERT, "settings", "Failed to sync file \"%s\" - %s",
+	   fullpath, strerror(errno));
+    r = -1;
+  }
+
+  htsbuf_queue_flush(&hq);
   close(fd);
+  if(r)
+    unlink(fullpath);
+  return r;
+}
 
-  snprintf(fullpath2, sizeof(fullpath2), "%s/%s", settingspath, path);
 
-  if(ok)
+/**
+ * Write a batch of records. Each file is written to a temporary file,
+ * synced and renamed into place
+ *
+ * settings_write_mutex is held
+ */
+static void
+hts_settings_write_batch(struct hts_settings_pending_queue *q)
+{
+  char fullpath[256];
+  char fullpath2[256];
+  hts_settings_pending_t *hsp;
+  int n = 0;
+
+  TAILQ_FOREACH(hsp, q, hsp_link) {
+    if(hts_settings_write_tmp(hsp))
+      continue;
+
+    snprintf(fullpath, sizeof(fullpath), "%s/%s.tmp",
+	     settingspath, hsp->hsp_path);
+    snprintf(fullpath2, sizeof(fullpath2), "%s/%s",
+	     settingspath, hsp->hsp_path);
     rename(fullpath, fullpath2);
-  else
-    unlink(fullpath);
-	   
-  htsbuf_queue_flush(&hq);
+    n++;
+  }
+
+  pthread_mutex_lock(&settings_mutex);
+  settings_written += n;
+  pthread_mutex_unlock(&settings_mutex);
+
+  while((hsp = TAILQ_FIRST(q)) != NULL) {
+    TAILQ_REMOVE(q, hsp, hsp_link);
+    hts_settings_pending_free(hsp);
+  }
+}
+
+
+/**
+ * Move pending records to 'q'. If 'prefix' is set only records below
+ * that path are taken, otherwise only those that are due at 'now'
+ * (or all of them if 'now' is 0).
+ *
+ * settings_mutex is held
+ */
+static void
+hts_settings_dequeue(struct hts_settings_pending_queue *q,
+		     const char *prefix, time_t now)
+{
+  hts_settings_pending_t *hsp, *next;
+  int l = prefix ? strlen(prefix) : 0;
+
+  for(hsp = TAILQ_FIRST(&settings_pending); hsp != NULL; hsp = next) {
+    next = TAILQ_NEXT(hsp, hsp_link);
+
+    if(prefix != NULL) {
+      /* Match whole path components, "channels/1" is not a
+	 prefix of "channels/10" */
+      if(strncmp(hsp->hsp_path, prefix, l) ||
+	 (hsp->hsp_path[l] != 0 && hsp->hsp_path[l] != '/' &&
+	  (l == 0 || prefix[l - 1] != '/')))
+	continue;
+    } else if(now && hsp->hsp_due > now) {
+      break; /* Queue is sorted on due time */
+    }
+
+    hts_settings_pending_unlink(hsp);
+    TAILQ_INSERT_TAIL(q, hsp, hsp_link);
+  }
+}
+
+
+/**
+ * Synchronously write pending records, all of them or those below
+ * 'prefix'
+ */
+static void
+hts_settings_flush0(const char *prefix)
+{
+  struct hts_settings_pending_queue q;
+
+  TAILQ_INIT(&q);
+
+  pthread_mutex_lock(&settings_write_mutex);
+  pthread_mutex_lock(&settings_mutex);
+  hts_settings_dequeue(&q, prefix, 0);
+  pthread_mutex_unlock(&settings_mutex);
+  hts_settings_write_batch(&q);
+  pthread_mutex_unlock(&settings_write_mutex);
+}
+
+
+/**
+ * Write all pending records, called on shutdown
+ */
+void
+hts_settings_flush(void)
+{
+  int saves, coalesced, written;
+
+  if(settingspath == NULL)
+    return;
+
+  hts_settings_flush0(NULL);
+
+  hts_settings_get_stats(&saves, &coalesced, &written);
+  tvhlog(LOG_DEBUG, "settings", "%d saves, %d coalesced, %d written",
+	 saves, coalesced, written);
+}
+
+
+/**
+ *
+ */
+static void *
+hts_settings_writer(void *aux)
+{
+  struct hts_settings_pending_queue q;
+  hts_settings_pending_t *hsp;
+  struct timespec ts;
+
+  TAILQ_INIT(&q);
+
+  pthread_mutex_lock(&settings_write_mutex);
+  pthread_mutex_lock(&settings_mutex);
+
+  while(1) {
+
+    if((hsp = TAILQ_FIRST(&settings_pending)) == NULL) {
+      pthread_mutex_unlock(&settings_write_mutex);
+      pthread_cond_wait(&settings_cond, &settings_mutex);
+      pthread_mutex_unlock(&settings_mutex);
+      pthread_mutex_lock(&settings_write_mutex);
+      pthread_mutex_lock(&settings_mutex);
+      continue;
+    }
+
+    if(hsp->hsp_due > time(NULL)) {
+      pthread_mutex_unlock(&settings_write_mutex);
+      ts.tv_sec = hsp->hsp_due;
+      ts.tv_nsec = 0;
+      pthread_cond_timedwait(&settings_cond, &settings_mutex, &ts);
+      pthread_mutex_unlock(&settings_mutex);
+      pthread_mutex_lock(&settings_write_mutex);
+      pthread_mutex_lock(&settings_mutex);
+      continue;
+    }
+
+    hts_settings_dequeue(&q, NULL, time(NULL));
+    pthread_mutex_unlock(&settings_mutex);
+
+    hts_settings_write_batch(&q);
+
+    pthread_mutex_lock(&settings_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ * Queue 'record' for writing. The record is copied so the caller
+ * retains ownership.
+ */
+void
+hts_settings_save(htsmsg_t *record, const char *pathfmt, ...)
+{
+  char path[256];
+  va_list ap;
+  char *n;
+  hts_settings_pending_t *hsp;
+  unsigned int hash;
+
+  if(settingspath == NULL)
+    return;
+
+  va_start(ap, pathfmt);
+  vsnprintf(path, sizeof(path), pathfmt, ap);
+  va_end(ap);
+
+  n = path;
+
+  while(*n) {
+    if(*n == ':' || *n == '?' || *n == '*' || *n > 127 || *n < 32)
+      *n = '_';
+    n++;
+  }
+
+  record = htsmsg_copy(record);
+
+  pthread_mutex_lock(&settings_mutex);
+
+  settings_saves++;
+
+  if((hsp = hts_settings_pending_find(path)) != NULL) {
+    /* Already queued, just replace the record */
+    settings_coalesced++;
+    htsmsg_destroy(hsp->hsp_record);
+    hsp->hsp_record = record;
+  } else {
+    hsp = malloc(sizeof(hts_settings_pending_t));
+    hsp->hsp_path = strdup(path);
+    hsp->hsp_record = record;
+    hsp->hsp_due = time(NULL) + HTS_SETTINGS_WRITE_DELAY;
+
+    hash = tvh_strhash(path, HTS_SETTINGS_HASH_SIZE);
+    LIST_INSERT_HEAD(&settings_pending_hash[hash], hsp, hsp_hash_link);
+    TAILQ_INSERT_TAIL(&settings_pending, hsp, hsp_link);
+    if(TAILQ_FIRST(&settings_pending) == hsp)
+      pthread_cond_signal(&settings_cond);
+  }
+
+  pthread_mutex_unlock(&settings_mutex);
 }
 
 /**
@@ -241,6 +552,9 @@ hts_settings_load(const char *pathfmt, ...)
   if(hts_settings_buildpath(fullpath, sizeof(fullpath), pathfmt, ap) < 0)
     return NULL;
 
+  /* Make sure we read what was last saved */
+  hts_settings_flush0(fullpath + strlen(settingspath) + 1);
+
   if(stat(fullpath, &st) != 0)
     return NULL;
 
@@ -279,10 +593,25 @@ hts_settings_remove(const char *pathfmt, ...)
   char fullpath[256];
   va_list ap;
 
+  hts_settings_pending_t *hsp;
+
   va_start(ap, pathfmt);
   if(hts_settings_buildpath(fullpath, sizeof(fullpath), pathfmt, ap) < 0)
     return;
+
+  /* Drop any pending write, or it would bring the file back */
+  pthread_mutex_lock(&settings_write_mutex);
+  pthread_mutex_lock(&settings_mutex);
+  hsp = hts_settings_pending_find(fullpath + strlen(settingspath) + 1);
+  if(hsp != NULL)
+    hts_settings_pending_unlink(hsp);
+  pthread_mutex_unlock(&settings_mutex);
+
+  if(hsp != NULL)
+    hts_settings_pending_free(hsp);
+
   unlink(fullpath);
+  pthread_mutex_unlock(&settings_write_mutex);
 }
 
 
@@ -34,4 +34,8 @@ const char *hts_settings_get_root(void);
 
 int hts_settings_open_file(int for_write, const char *pathfmt, ...);
 
+void hts_settings_flush(void);
+
+void hts_settings_get_stats(int *saves, int *coalesced, int *written);
+
 #endif /* HTSSETTINGS_H__ */ 
@@ -23,6 +23,19 @@
 #include "packet.h"
 #include "atomic.h"
 #include "service.h"
+#include "mempool.h"
+
+static mempool_t *streaming_msg_pool;
+
+/**
+ *
+ */
+void
+streaming_init(void)
+{
+  streaming_msg_pool = mempool_create("streaming_message_t",
+				      sizeof(streaming_message_t));
+}
 
 void
 streaming_pad_init(streaming_pad_t *sp)
@@ -115,7 +128,7 @@ streaming_target_disconnect(streaming_pad_t *sp, streaming_target_t *st)
 streaming_message_t *
 streaming_msg_create(streaming_message_type_t type)
 {
-  streaming_message_t *sm = malloc(sizeof(streaming_message_t));
+  streaming_message_t *sm = mempool_get(streaming_msg_pool);
   sm->sm_type = type;
   return sm;
 }
@@ -165,7 +178,7 @@ streaming_msg_create_code(streaming_message_type_t type, int code)
 streaming_message_t *
 streaming_msg_clone(streaming_message_t *src)
 {
-  streaming_message_t *dst = malloc(sizeof(streaming_message_t));
+  streaming_message_t *dst = mempool_get(streaming_msg_pool);
   streaming_start_t *ss;
 
   dst->sm_type = src->sm_type;
@@ -185,6 +198,7 @@ streaming_msg_clone(streaming_message_t *src)
   case SMT_STOP:
   case SMT_SERVICE_STATUS:
   case SMT_NOSTART:
+  case SMT_SKIP:
     dst->sm_code = src->sm_code;
     break;
 
@@ -192,7 +206,7 @@ streaming_msg_clone(streaming_message_t *src)
     break;
 
   case SMT_MPEGTS:
-    dst->sm_data = malloc(188);
+    dst->sm_data = mempool_buf_get(188);
     memcpy(dst->sm_data, src->sm_data, 188);
     break;
 
@@ -250,14 +264,17 @@ streaming_msg_free(streaming_message_t *sm)
   case SMT_NOSTART:
     break;
 
+  case SMT_SKIP:
+    break;
+
   case SMT_MPEGTS:
-    free(sm->sm_data);
+    mempool_buf_put(sm->sm_data, 188);
     break;
 
   default:
     abort();
   }
-  free(sm);
+  mempool_put(streaming_msg_pool, sm);
 }
 
 /**
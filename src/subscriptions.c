@@ -36,10 +36,45 @@
 #include "streaming.h"
 #include "channels.h"
 #include "service.h"
+#include "packet.h"
+#include "htsmsg.h"
+#include "timeshift.h"
+#include "plumbing/normalize.h"
 
 struct th_subscription_list subscriptions;
 static gtimer_t subscription_reschedule_timer;
 
+/**
+ * Zap time histograms, time from subscribing until the service's
+ * first input packet (tuner lock), first PMT and until the first
+ * I-frame is delivered to the subscription
+ */
+#define ZAP_LOCK    0
+#define ZAP_PMT     1
+#define ZAP_IFRAME  2
+#define ZAP_PHASES  3
+
+#define ZAP_BUCKETS 12
+
+static const char *zap_phase_names[ZAP_PHASES] = { "lock", "pmt", "iframe" };
+
+static const int zap_bucket_limits[ZAP_BUCKETS - 1] = { /* ms */
+  100, 250, 500, 750, 1000, 1500, 2000, 3000, 5000, 10000, 20000
+};
+
+typedef struct zap_histogram {
+  int zh_count;
+  int64_t zh_sum;
+  int zh_max;
+  int zh_buckets[ZAP_BUCKETS];
+} zap_histogram_t;
+
+static zap_histogram_t zap_histograms[ZAP_PHASES];
+static pthread_mutex_t zap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void subscription_zap_check(th_subscription_t *s,
+				   streaming_message_t *sm);
+
 /**
  *
  */
@@ -68,6 +103,8 @@ static void
 subscription_link_service(th_subscription_t *s, service_t *t)
 {
   streaming_message_t *sm;
+  th_pktref_t *pr;
+
   s->ths_state = SUBSCRIPTION_TESTING_SERVICE;
  
   s->ths_service = t;
@@ -75,12 +112,26 @@ subscription_link_service(th_subscription_t *s, service_t *t)
 
   pthread_mutex_lock(&t->s_stream_mutex);
 
-  if(TAILQ_FIRST(&t->s_components) != NULL)
-    s->ths_start_message =
-      streaming_msg_create_data(SMT_START, service_build_stream_start(t));
+  if(s->ths_flags & SUBSCRIPTION_TIMESHIFT) {
+    // Everything is passed on by the reader, packets from the store
+    s->ths_timeshift = timeshift_reader_create(t, s->ths_output);
+    s->ths_output = timeshift_reader_input(s->ths_timeshift);
+  }
+
+  if(s->ths_flags & SUBSCRIPTION_NORMALIZED) {
+    // Link to shared normalized output, this will hand us the
+    // current start message (if any) via subscription_input()
+    normalize_attach(t, &s->ths_input);
 
-  // Link to service output
-  streaming_target_connect(&t->s_streaming_pad, &s->ths_input);
+  } else {
+
+    if(TAILQ_FIRST(&t->s_components) != NULL)
+      s->ths_start_message =
+	streaming_msg_create_data(SMT_START, service_build_stream_start(t));
+
+    // Link to service output
+    streaming_target_connect(&t->s_streaming_pad, &s->ths_input);
+  }
 
 
   if(s->ths_start_message != NULL && t->s_streaming_status & TSS_PACKETS) {
@@ -95,6 +146,17 @@ subscription_link_service(th_subscription_t *s, service_t *t)
     sm = streaming_msg_create_code(SMT_SERVICE_STATUS, 
 				   t->s_streaming_status);
     streaming_target_deliver(s->ths_output, sm);
+
+    // Send everything since the last I-frame so the client can start
+    // decoding right away. Normalized subscribers start at the next
+    // I-frame of the shared chain, see normalize.c
+    if(!(s->ths_flags & SUBSCRIPTION_NORMALIZED)) {
+      TAILQ_FOREACH(pr, &t->s_gop_cache, pr_link) {
+	sm = streaming_msg_create_pkt(pr->pr_pkt);
+	subscription_zap_check(s, sm);
+	streaming_target_deliver(s->ths_output, sm);
+      }
+    }
   }
 
   pthread_mutex_unlock(&t->s_stream_mutex);
@@ -113,7 +175,10 @@ subscription_unlink_service(th_subscription_t *s, int reason)
   pthread_mutex_lock(&t->s_stream_mutex);
 
   // Unlink from service output
-  streaming_target_disconnect(&t->s_streaming_pad, &s->ths_input);
+  if(s->ths_flags & SUBSCRIPTION_NORMALIZED)
+    normalize_detach(t, &s->ths_input);
+  else
+    streaming_target_disconnect(&t->s_streaming_pad, &s->ths_input);
 
   if(TAILQ_FIRST(&t->s_components) != NULL && 
      s->ths_state == SUBSCRIPTION_GOT_SERVICE) {
@@ -122,6 +187,11 @@ subscription_unlink_service(th_subscription_t *s, int reason)
     streaming_target_deliver(s->ths_output, sm);
   }
 
+  if(s->ths_timeshift != NULL) {
+    s->ths_output = timeshift_reader_destroy(s->ths_timeshift);
+    s->ths_timeshift = NULL;
+  }
+
   pthread_mutex_unlock(&t->s_stream_mutex);
 
   LIST_REMOVE(s, ths_service_link);
@@ -218,6 +288,104 @@ subscription_unsubscribe(th_subscription_t *s)
 }
 
 
+/**
+ * Events before 'start' happened for an earlier subscriber of an
+ * already running service and are not part of this zap
+ *
+ * zap_mutex must be held
+ */
+static void
+subscription_zap_add(int phase, int64_t start, int64_t ts)
+{
+  zap_histogram_t *zh = &zap_histograms[phase];
+  int i, ms;
+
+  if(ts == 0 || ts < start)
+    return;
+
+  ms = (ts - start) / 1000;
+
+  for(i = 0; i < ZAP_BUCKETS - 1; i++)
+    if(ms <= zap_bucket_limits[i])
+      break;
+
+  zh->zh_buckets[i]++;
+  zh->zh_count++;
+  zh->zh_sum += ms;
+  if(ms > zh->zh_max)
+    zh->zh_max = ms;
+}
+
+
+/**
+ * Record the zap time once the first I-frame (or for services without
+ * video, the first packet) reaches the subscription
+ *
+ * s_stream_mutex must be held
+ */
+static void
+subscription_zap_check(th_subscription_t *s, streaming_message_t *sm)
+{
+  service_t *t = s->ths_service;
+  elementary_stream_t *st;
+  th_pkt_t *pkt;
+
+  if(s->ths_zap_done || sm->sm_type != SMT_PACKET || t == NULL)
+    return;
+
+  pkt = sm->sm_data;
+  if(pkt->pkt_frametype != PKT_I_FRAME) {
+    TAILQ_FOREACH(st, &t->s_components, es_link)
+      if(SCT_ISVIDEO(st->es_type))
+	return;
+  }
+
+  s->ths_zap_done = 1;
+
+  pthread_mutex_lock(&zap_mutex);
+  subscription_zap_add(ZAP_LOCK,   s->ths_zap_start, t->s_zap_input);
+  subscription_zap_add(ZAP_PMT,    s->ths_zap_start, t->s_zap_pmt);
+  subscription_zap_add(ZAP_IFRAME, s->ths_zap_start, getmonoclock());
+  pthread_mutex_unlock(&zap_mutex);
+}
+
+
+/**
+ *
+ */
+htsmsg_t *
+subscription_zap_stats(void)
+{
+  htsmsg_t *out = htsmsg_create_map(), *m, *l, *b;
+  zap_histogram_t *zh;
+  int i, j;
+
+  pthread_mutex_lock(&zap_mutex);
+
+  for(i = 0; i < ZAP_PHASES; i++) {
+    zh = &zap_histograms[i];
+    m = htsmsg_create_map();
+    htsmsg_add_u32(m, "count", zh->zh_count);
+    htsmsg_add_u32(m, "avg", zh->zh_count ? zh->zh_sum / zh->zh_count : 0);
+    htsmsg_add_u32(m, "max", zh->zh_max);
+
+    l = htsmsg_create_list();
+    for(j = 0; j < ZAP_BUCKETS; j++) {
+      b = htsmsg_create_map();
+      if(j < ZAP_BUCKETS - 1)
+	htsmsg_add_u32(b, "le", zap_bucket_limits[j]);
+      htsmsg_add_u32(b, "count", zh->zh_buckets[j]);
+      htsmsg_add_msg(l, NULL, b);
+    }
+    htsmsg_add_msg(m, "buckets", l);
+    htsmsg_add_msg(out, zap_phase_names[i], m);
+  }
+
+  pthread_mutex_unlock(&zap_mutex);
+  return out;
+}
+
+
 /**
  * This callback is invoked when we receive data and status updates from
  * the currently bound service
@@ -233,6 +401,19 @@ subscription_input(void *opauqe, streaming_message_t *sm)
     if(sm->sm_type == SMT_START) {
       if(s->ths_start_message != NULL) 
 	streaming_msg_free(s->ths_start_message);
+
+      // The normalizer may hold the start until all headers are seen,
+      // if the service already has packets no new status will follow
+      if(s->ths_flags & SUBSCRIPTION_NORMALIZED && s->ths_service != NULL &&
+	 s->ths_service->s_streaming_status & TSS_PACKETS) {
+	s->ths_start_message = NULL;
+	s->ths_state = SUBSCRIPTION_GOT_SERVICE;
+	streaming_target_deliver(s->ths_output, sm);
+	streaming_target_deliver(s->ths_output,
+				 streaming_msg_create_code(SMT_SERVICE_STATUS,
+				   s->ths_service->s_streaming_status));
+	return;
+      }
       s->ths_start_message = sm;
       return;
     }
@@ -261,6 +442,7 @@ subscription_input(void *opauqe, streaming_message_t *sm)
     streaming_msg_free(sm);
     return;
   }
+  subscription_zap_check(s, sm);
   streaming_target_deliver(s->ths_output, sm);
 }
 
@@ -272,6 +454,7 @@ static void
 subscription_input_direct(void *opauqe, streaming_message_t *sm)
 {
   th_subscription_t *s = opauqe;
+  subscription_zap_check(s, sm);
   streaming_target_deliver(s->ths_output, sm);
 }
 
@@ -303,6 +486,7 @@ subscription_create(int weight, const char *name, streaming_target_t *st,
   s->ths_flags             = flags;
 
   time(&s->ths_start);
+  s->ths_zap_start = getmonoclock();
   LIST_INSERT_SORTED(&subscriptions, s, ths_global_link, subscription_sort);
 
   return s;
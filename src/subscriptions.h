@@ -20,6 +20,11 @@
 #define SUBSCRIPTIONS_H
 
 #define SUBSCRIPTION_RAW_MPEGTS 0x1
+#define SUBSCRIPTION_NORMALIZED 0x2  /* Deliver timestamp fixed packets
+					with global headers, using the
+					service's shared chain */
+#define SUBSCRIPTION_TIMESHIFT  0x4  /* Deliver through a timeshift
+					reader, see timeshift.c */
 
 typedef struct th_subscription {
   LIST_ENTRY(th_subscription) ths_global_link;
@@ -55,6 +60,12 @@ typedef struct th_subscription {
 
   streaming_message_t *ths_start_message;
 
+  int64_t ths_zap_start;   /* getmonoclock() when subscribed */
+  int ths_zap_done;        /* Zap time has been recorded */
+
+  struct timeshift_reader *ths_timeshift; /* If SUBSCRIPTION_TIMESHIFT and
+					     linked to a service */
+
 } th_subscription_t;
 
 
@@ -89,4 +100,6 @@ void subscription_dummy_join(const char *id, int first);
 
 int subscriptions_active(void);
 
+struct htsmsg *subscription_zap_stats(void);
+
 #endif /* SUBSCRIPTIONS_H */
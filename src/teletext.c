@@ -33,13 +33,14 @@
 #include "teletext.h"
 #include "packet.h"
 #include "streaming.h"
+#include "timeshift.h"
 #include "service.h"
 
 /**
  *
  */
 typedef struct tt_mag {
-  int ttm_curpage;
+  int ttm_curpage;           /* 0 if no page of interest is being received */
   int ttm_inactive;
   int64_t ttm_current_pts;
   uint8_t ttm_lang;
@@ -53,6 +54,18 @@ typedef struct tt_mag {
 typedef struct tt_private {
   tt_mag_t ttp_mags[8];
 
+  /**
+   * Pages we care about, the subtitle pages of the stream and the
+   * rundown page. Lines of all other pages are dropped right after
+   * the page header has been decoded.
+   */
+  uint32_t ttp_interest[32];
+  int ttp_interest_valid;
+
+  int ttp_active_mags;       /* Magazines with ttm_curpage set */
+
+  uint8_t ttp_clock[8];      /* Last clock field seen in a page header */
+
   int ttp_rundown_valid;
   uint8_t ttp_rundown[23*40 + 1];
 
@@ -63,9 +76,49 @@ static void teletext_rundown_copy(tt_private_t *ttp, tt_mag_t *ttm);
 
 static void teletext_rundown_scan(service_t *t, tt_private_t *ttp);
 
-#define bitreverse(b) \
-(((b) * 0x0202020202ULL & 0x010884422010ULL) % 1023)
+static int tt_interest_all;  /* Decode all pages, for benchmarking */
 
+/**
+ * Teletext is transmitted LSB first
+ */
+static const uint8_t bitreverse[256] = {
+  0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+  0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+  0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,
+  0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+  0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,
+  0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+  0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,
+  0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+  0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,
+  0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+  0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,
+  0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+  0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,
+  0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+  0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,
+  0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+  0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,
+  0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+  0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,
+  0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+  0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
+  0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+  0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,
+  0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+  0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,
+  0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+  0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,
+  0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+  0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,
+  0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+  0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,
+  0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+};
+
+/**
+ * Hamming 8/4 decoding of bitreversed bytes
+ */
 static const uint8_t hamtable[] = {
   0x01, 0xff, 0x81, 0x01, 0xff, 0x00, 0x01, 0xff, 
   0xff, 0x02, 0x01, 0xff, 0x0a, 0xff, 0xff, 0x07, 
@@ -177,8 +230,8 @@ tt_convert_char(int Gtriplet, int natopts, uint8_t inchar)
 static uint8_t
 ham_decode(uint8_t a, uint8_t b)
 {
-  a = hamtable[a];
-  b = hamtable[b];
+  a = hamtable[bitreverse[a]];
+  b = hamtable[bitreverse[b]];
 
   return (b << 4) | (a & 0xf);
 }
@@ -236,14 +289,20 @@ is_tt_clock(const uint8_t *str)
  *
  */
 static int
-update_tt_clock(service_t *t, const uint8_t *buf)
+update_tt_clock(service_t *t, tt_private_t *ttp, const uint8_t *buf)
 {
   uint8_t str[10];
   int i;
   time_t ti;
 
+  /* Every page header carries the clock, it only changes once
+     a second */
+  if(!memcmp(ttp->ttp_clock, buf, 8))
+    return 0;
+  memcpy(ttp->ttp_clock, buf, 8);
+
   for(i = 0; i < 8; i++)
-    str[i] = buf[i] & 0x7f;
+    str[i] = bitreverse[buf[i]] & 0x7f;
   str[8] = 0;
 
   if(!is_tt_clock(str))
@@ -318,6 +377,10 @@ extract_subtitle(service_t *t, elementary_stream_t *st,
   streaming_pad_deliver(&t->s_streaming_pad, sm);
   streaming_msg_free(sm);
 
+  service_gop_cache_add(t, st, pkt);
+  if(t->s_timeshift != NULL)
+    timeshift_write(t->s_timeshift, pkt);
+
   /* Decrease our own reference to the packet */
   pkt_ref_dec(pkt);
 }
@@ -370,15 +433,44 @@ tt_subtitle_deliver(service_t *t, elementary_stream_t *parent, tt_mag_t *ttm)
 }
 
 /**
- *
+ * Collect the subtitle pages of the stream
  */
 static void
-tt_decode_line(service_t *t, elementary_stream_t *st, uint8_t *buf)
+tt_update_interest(service_t *t, elementary_stream_t *parent,
+		   tt_private_t *ttp)
+{
+  elementary_stream_t *st;
+  int page;
+
+  memset(ttp->ttp_interest, tt_interest_all ? 0xff : 0,
+	 sizeof(ttp->ttp_interest));
+
+  TAILQ_FOREACH(st, &t->s_components, es_link) {
+    if(st->es_parent_pid != parent->es_pid)
+      continue;
+    page = st->es_pid - PID_TELETEXT_BASE;
+    if(page >= 0 && page < 1024)
+      ttp->ttp_interest[page >> 5] |= 1 << (page & 31);
+  }
+
+  /* Rundown, for commercial detection */
+  ttp->ttp_interest[192 >> 5] |= 1 << (192 & 31);
+
+  ttp->ttp_interest_valid = 1;
+}
+
+
+/**
+ * 'buf' is a line as transmitted (not bitreversed)
+ */
+static void
+tt_decode_line(service_t *t, elementary_stream_t *st, const uint8_t *buf)
 {
   uint8_t mpag, line, s12, c;
   int page, magidx, i;
   tt_mag_t *ttm;
   tt_private_t *ttp;
+  uint8_t *dst;
 
   if(st->es_priv == NULL) {
     /* Allocate privdata for reassembly */
@@ -387,6 +479,9 @@ tt_decode_line(service_t *t, elementary_stream_t *st, uint8_t *buf)
     ttp = st->es_priv;
   }
 
+  if(!ttp->ttp_interest_valid)
+    tt_update_interest(t, st, ttp);
+
   mpag = ham_decode(buf[0], buf[1]);
   magidx = mpag & 7;
   ttm = &ttp->ttp_mags[magidx];
@@ -405,15 +500,23 @@ tt_decode_line(service_t *t, elementary_stream_t *st, uint8_t *buf)
 
       memset(ttm->ttm_page, ' ', 23 * 40);
       ttm->ttm_curpage = 0;
+      ttp->ttp_active_mags &= ~(1 << magidx);
     }
 
+    if(update_tt_clock(t, ttp, buf + 34))
+      teletext_rundown_scan(t, ttp);
+
     if((page = ham_decode(buf[2], buf[3])) == 0xff)
       return;
 
     /* The page is BDC encoded, mag 0 is displayed as page 800+ */
     page = (magidx ?: 8) * 100 + (page >> 4) * 10 + (page & 0xf);
 
+    if(!(ttp->ttp_interest[page >> 5] & (1 << (page & 31))))
+      return;
+
     ttm->ttm_curpage = page;
+    ttp->ttp_active_mags |= 1 << magidx;
 
     s12 = ham_decode(buf[4], buf[5]);
     c = ham_decode(buf[8], buf[9]);
@@ -425,19 +528,17 @@ tt_decode_line(service_t *t, elementary_stream_t *st, uint8_t *buf)
       memset(ttm->ttm_page, ' ', 23 * 40);
     }
 
-    if(update_tt_clock(t, buf + 34))
-      teletext_rundown_scan(t, ttp);
-
     ttm->ttm_current_pts = t->s_current_pts;
     ttm->ttm_inactive = 0;
     break;
 
   case 1 ... 23:
+    if(ttm->ttm_curpage == 0)
+      break;
     ttm->ttm_inactive = 0;
-    for(i = 0; i < 40; i++) {
-      c = buf[i + 2] & 0x7f;
-      ttm->ttm_page[i + 40 * (line - 1)] = c;
-    }
+    dst = ttm->ttm_page + 40 * (line - 1);
+    for(i = 0; i < 40; i++)
+      dst[i] = bitreverse[buf[i + 2]] & 0x7f;
     break;
 
   default:
@@ -456,11 +557,14 @@ teletext_scan_stream(service_t *t, elementary_stream_t *st)
 {
   tt_private_t *ttp = st->es_priv;
   tt_mag_t *ttm;
-  int i;
+  int i, m;
 
   if(ttp == NULL)
     return;
-  for(i = 0; i < 8; i++) {
+
+  /* Only magazines with a page of interest can time out */
+  for(m = ttp->ttp_active_mags; m; m &= m - 1) {
+    i = __builtin_ctz(m);
     ttm = &ttp->ttp_mags[i];
     ttm->ttm_inactive++;
     if(ttm->ttm_inactive == 2) {
@@ -476,23 +580,133 @@ teletext_scan_stream(service_t *t, elementary_stream_t *st)
 void
 teletext_input(service_t *t, elementary_stream_t *st, const uint8_t *tsb)
 {
-  int i, j;
+  int i;
   const uint8_t *x;
-  uint8_t buf[42];
 
   x = tsb + 4;
   for(i = 0; i < 4; i++) {
-    if(*x == 2 || *x == 3) {
-      for(j = 0; j < 42; j++)
-	buf[j] = bitreverse(x[4 + j]);
-      tt_decode_line(t, st, buf);
-    }
+    if(*x == 2 || *x == 3)
+      tt_decode_line(t, st, x + 4);
     x += 46;
   }
   teletext_scan_stream(t, st);
 }
 
 
+/**
+ * The subtitle pages of the service may have changed
+ */
+void
+teletext_update_interest(service_t *t)
+{
+  elementary_stream_t *st;
+  tt_private_t *ttp;
+
+  TAILQ_FOREACH(st, &t->s_components, es_link)
+    if(st->es_type == SCT_TELETEXT && (ttp = st->es_priv) != NULL)
+      ttp->ttp_interest_valid = 0;
+}
+
+
+
+/**
+ *
+ */
+static int64_t
+tt_bench_run(service_t *t, elementary_stream_t *st, const uint8_t *tsb,
+	     int npkts, int *loops)
+{
+  int64_t ts = getmonoclock(), d;
+  int i;
+
+  *loops = 0;
+  do {
+    free(st->es_priv);
+    st->es_priv = NULL;
+    for(i = 0; i < npkts; i++)
+      teletext_input(t, st, tsb + i * 188);
+    (*loops)++;
+  } while((d = getmonoclock() - ts) < 1000000);
+
+  return d;
+}
+
+
+/**
+ * Decode teletext PID 'pid' of a captured transport stream with only
+ * 'pages' (comma separated, may be NULL) as subtitle pages, and with
+ * every page decoded. Print the time spent per TS packet.
+ */
+void
+teletext_benchmark(const char *path, int pid, const char *pages)
+{
+  service_t *t;
+  elementary_stream_t *st, *sub;
+  uint8_t *tsb = NULL, pkt[188];
+  int npkts = 0, size = 0, loops, page;
+  int64_t d;
+  char *p, *s;
+  FILE *fp;
+
+  if((fp = fopen(path, "rb")) == NULL) {
+    fprintf(stderr, "Unable to open %s -- %s\n", path, strerror(errno));
+    return;
+  }
+
+  while(fread(pkt, 188, 1, fp) == 1) {
+    if(pkt[0] != 0x47 || ((pkt[1] & 0x1f) << 8 | pkt[2]) != pid)
+      continue;
+    if(npkts == size) {
+      size = MAX(1024, size * 2);
+      tsb = realloc(tsb, size * 188);
+    }
+    memcpy(tsb + npkts++ * 188, pkt, 188);
+  }
+  fclose(fp);
+
+  if(npkts == 0) {
+    fprintf(stderr, "No packets on PID %d in %s\n", pid, path);
+    return;
+  }
+
+  t = calloc(1, sizeof(service_t));
+  pthread_mutex_init(&t->s_stream_mutex, NULL);
+  TAILQ_INIT(&t->s_components);
+  TAILQ_INIT(&t->s_gop_cache);
+  streaming_pad_init(&t->s_streaming_pad);
+  t->s_current_pts = 0;
+
+  pthread_mutex_lock(&t->s_stream_mutex);
+
+  st = service_stream_create(t, pid, SCT_TELETEXT);
+
+  if(pages != NULL) {
+    s = strdup(pages);
+    for(p = strtok(s, ","); p != NULL; p = strtok(NULL, ",")) {
+      page = atoi(p);
+      sub = service_stream_create(t, PID_TELETEXT_BASE + page, SCT_TEXTSUB);
+      sub->es_parent_pid = pid;
+    }
+    free(s);
+  }
+
+  printf("%d packets on PID %d, subtitle pages: %s\n",
+	 npkts, pid, pages ?: "none");
+
+  d = tt_bench_run(t, st, tsb, npkts, &loops);
+  printf("%-16s %8.1f ns/packet\n", "subtitles only",
+	 d * 1000.0 / ((int64_t)npkts * loops));
+
+  tt_interest_all = 1;
+  d = tt_bench_run(t, st, tsb, npkts, &loops);
+  printf("%-16s %8.1f ns/packet\n", "all pages",
+	 d * 1000.0 / ((int64_t)npkts * loops));
+  tt_interest_all = 0;
+
+  pthread_mutex_unlock(&t->s_stream_mutex);
+  free(tsb);
+}
+
 
 /**
  * Swedish TV4 rundown dump (page 192)
@@ -22,4 +22,8 @@
 void teletext_input(struct service *t, struct elementary_stream *st,
 		    const uint8_t *tsb);
 
+void teletext_update_interest(struct service *t);
+
+void teletext_benchmark(const char *path, int pid, const char *pages);
+
 #endif /* TELETEXT_H */
@@ -0,0 +1,954 @@
+/*
+ *  tvheadend, disk backed timeshift
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tvheadend.h"
+#include "atomic.h"
+#include "streaming.h"
+#include "packet.h"
+#include "service.h"
+#include "settings.h"
+#include "timeshift.h"
+
+#define TIMESHIFT_SEGMENT_SIZE (32 * 1024 * 1024)
+
+#define TIMESHIFT_ALIGN(x) (((x) + 7) & ~7)
+
+/**
+ * Configuration, from timeshift/config. Timeshift is disabled
+ * unless 'path' is set.
+ */
+static char *timeshift_path;
+static size_t timeshift_max_bytes = 1024 * 1024 * 1024;  /* Per service */
+static int timeshift_max_secs = 3600;
+
+static volatile int timeshift_file_tally;
+
+
+/**
+ * A stored packet, followed by payload and header data
+ */
+typedef struct timeshift_record {
+  int64_t tr_time;           /* getmonoclock() when stored */
+  int64_t tr_pts;
+  int64_t tr_dts;
+  int32_t tr_duration;
+  uint32_t tr_payloadlen;
+  uint32_t tr_headerlen;
+  uint16_t tr_aspect_num;
+  uint16_t tr_aspect_den;
+  uint8_t tr_componentindex;
+  uint8_t tr_frametype;
+  uint8_t tr_field;
+  uint8_t tr_commercial;
+  uint8_t tr_channels;
+  uint8_t tr_sri;
+} timeshift_record_t;
+
+#define TIMESHIFT_RECLEN(r) \
+  TIMESHIFT_ALIGN(sizeof(timeshift_record_t) + \
+		  (r)->tr_payloadlen + (r)->tr_headerlen)
+
+
+/**
+ * Offsets of the I-frames in a segment, used for seeking
+ */
+typedef struct timeshift_keyframe {
+  int64_t tk_time;
+  size_t tk_offset;
+} timeshift_keyframe_t;
+
+
+/**
+ * One mmap'd segment file. The file is unlinked right after it has
+ * been created so nothing is left behind if we crash.
+ */
+typedef struct timeshift_segment {
+  TAILQ_ENTRY(timeshift_segment) tss_link;
+  int tss_refcount;          /* The store (while linked) and readers */
+  int tss_removed;           /* Not in the store anymore */
+
+  uint8_t *tss_data;
+  size_t tss_size;
+  size_t tss_used;           /* Bytes of complete records */
+
+  int64_t tss_start;         /* Time of first and last record */
+  int64_t tss_end;
+
+  timeshift_keyframe_t *tss_keys;
+  int tss_nkeys;
+  int tss_keys_size;
+} timeshift_segment_t;
+
+TAILQ_HEAD(timeshift_segment_queue, timeshift_segment);
+
+
+/**
+ * Per service store
+ *
+ * ts_mutex protects the segment list, the fill level of the last
+ * segment and all readers. Records below tss_used never change so
+ * they can be read without the lock as long as a reference to the
+ * segment is held. Only the writer appends to the last segment.
+ */
+typedef struct timeshift {
+  pthread_mutex_t ts_mutex;
+  pthread_cond_t ts_cond;    /* CLOCK_MONOTONIC */
+
+  struct timeshift_segment_queue ts_segments;
+  size_t ts_size;            /* Size of all segments */
+  int ts_readers;
+  int ts_error;              /* No segment available, logged once */
+} timeshift_t;
+
+
+/**
+ * Segment allocation and release
+ *
+ * Creating a segment (open, fallocate and mmap) and releasing the last
+ * reference to one (the file's blocks are freed) may block on the
+ * disk. The writer runs on the input thread, so both are done by a
+ * background thread. The writer only takes segments from a pool that
+ * is kept at one spare segment per store, plus one for the next store.
+ */
+static pthread_mutex_t timeshift_pool_mutex;
+static pthread_cond_t timeshift_pool_cond;
+static struct timeshift_segment_queue timeshift_pool;  /* Ready for use */
+static struct timeshift_segment_queue timeshift_reap;  /* To be unmapped */
+static int timeshift_pool_size;
+static int timeshift_stores;
+
+static void *timeshift_alloc_thread(void *aux);
+
+
+/**
+ *
+ */
+typedef struct timeshift_reader {
+  streaming_target_t rd_input;
+  streaming_target_t *rd_output;
+
+  service_t *rd_service;
+  timeshift_t *rd_ts;
+
+  pthread_t rd_thread;
+  int rd_running;
+  int rd_started;            /* START has been passed on */
+
+  timeshift_segment_t *rd_seg;  /* Reference held, NULL if none yet */
+  size_t rd_offset;
+  int64_t rd_time;           /* Time of last delivered record */
+  int rd_gen;                /* Bumped when the position is changed */
+  int rd_skip;               /* Send SMT_SKIP before the next packet */
+
+  int rd_speed;              /* Percent, 0 = paused */
+  int rd_rebase;
+  int64_t rd_base_rec;       /* Pacing, record time played at ... */
+  int64_t rd_base_now;       /* ... this time */
+} timeshift_reader_t;
+
+
+/**
+ *
+ */
+void
+timeshift_init(void)
+{
+  htsmsg_t *m;
+  const char *s;
+  uint32_t u32;
+  pthread_t tid;
+
+  if((m = hts_settings_load("timeshift/config")) == NULL)
+    return;
+
+  if((s = htsmsg_get_str(m, "path")) != NULL && *s)
+    timeshift_path = strdup(s);
+  if(!htsmsg_get_u32(m, "maxsize", &u32) && u32 > 0)
+    timeshift_max_bytes = (size_t)u32 * 1024 * 1024;
+  if(!htsmsg_get_u32(m, "maxduration", &u32) && u32 > 0)
+    timeshift_max_secs = u32;
+  htsmsg_destroy(m);
+
+  if(timeshift_path == NULL)
+    return;
+
+  tvhlog(LOG_INFO, "timeshift", "Using %s, max %zd MB, %d seconds "
+	 "per service", timeshift_path, timeshift_max_bytes >> 20,
+	 timeshift_max_secs);
+
+  pthread_mutex_init(&timeshift_pool_mutex, NULL);
+  pthread_cond_init(&timeshift_pool_cond, NULL);
+  TAILQ_INIT(&timeshift_pool);
+  TAILQ_INIT(&timeshift_reap);
+  pthread_create(&tid, NULL, timeshift_alloc_thread, NULL);
+}
+
+
+/**
+ *
+ */
+int
+timeshift_enabled(void)
+{
+  return timeshift_path != NULL;
+}
+
+
+/**
+ *
+ */
+int
+timeshift_max_duration(void)
+{
+  return timeshift_max_secs;
+}
+
+
+/**
+ * Called from the allocation thread only
+ */
+static timeshift_segment_t *
+timeshift_segment_create(void)
+{
+  static int error;
+  timeshift_segment_t *seg;
+  char path[PATH_MAX];
+  void *data;
+  int fd, r;
+
+  snprintf(path, sizeof(path), "%s/tvh-timeshift-%d-%d",
+	   timeshift_path, (int)getpid(),
+	   atomic_add(&timeshift_file_tally, 1));
+
+  if((fd = tvh_open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+    r = errno;
+    goto bad;
+  }
+  unlink(path);
+
+  /* Reserve the blocks, running out of disk with the file mapped
+     would end in SIGBUS */
+  if((r = posix_fallocate(fd, 0, TIMESHIFT_SEGMENT_SIZE)) != 0) {
+    close(fd);
+    goto bad;
+  }
+
+  /* Populate the page tables here rather than on the input thread */
+  data = mmap(NULL, TIMESHIFT_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, fd, 0);
+  r = errno;
+  close(fd);
+  if(data == MAP_FAILED)
+    goto bad;
+
+  seg = calloc(1, sizeof(timeshift_segment_t));
+  seg->tss_data = data;
+  seg->tss_size = TIMESHIFT_SEGMENT_SIZE;
+  error = 0;
+  return seg;
+
+ bad:
+  if(!error)
+    tvhlog(LOG_ERR, "timeshift", "Unable to create segment %s -- %s",
+	   path, strerror(r));
+  error = 1;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+timeshift_segment_free(timeshift_segment_t *seg)
+{
+  munmap(seg->tss_data, seg->tss_size);
+  free(seg->tss_keys);
+  free(seg);
+}
+
+
+/**
+ * Keep the pool filled and release unreferenced segments
+ */
+static void *
+timeshift_alloc_thread(void *aux)
+{
+  timeshift_segment_t *seg;
+  struct timespec ts;
+  time_t retry = 0;
+
+  pthread_mutex_lock(&timeshift_pool_mutex);
+
+  while(1) {
+
+    if((seg = TAILQ_FIRST(&timeshift_reap)) != NULL) {
+      TAILQ_REMOVE(&timeshift_reap, seg, tss_link);
+
+    } else if(timeshift_pool_size > timeshift_stores + 1) {
+      seg = TAILQ_FIRST(&timeshift_pool);
+      TAILQ_REMOVE(&timeshift_pool, seg, tss_link);
+      timeshift_pool_size--;
+
+    } else if(timeshift_pool_size < timeshift_stores + 1 &&
+	      time(NULL) >= retry) {
+      pthread_mutex_unlock(&timeshift_pool_mutex);
+      seg = timeshift_segment_create();
+      pthread_mutex_lock(&timeshift_pool_mutex);
+
+      if(seg != NULL) {
+	TAILQ_INSERT_TAIL(&timeshift_pool, seg, tss_link);
+	timeshift_pool_size++;
+      } else {
+	retry = time(NULL) + 5;
+      }
+      continue;
+
+    } else if(timeshift_pool_size < timeshift_stores + 1) {
+      ts.tv_sec = retry;
+      ts.tv_nsec = 0;
+      pthread_cond_timedwait(&timeshift_pool_cond, &timeshift_pool_mutex,
+			     &ts);
+      continue;
+
+    } else {
+      pthread_cond_wait(&timeshift_pool_cond, &timeshift_pool_mutex);
+      continue;
+    }
+
+    pthread_mutex_unlock(&timeshift_pool_mutex);
+    timeshift_segment_free(seg);
+    pthread_mutex_lock(&timeshift_pool_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ * Take a segment from the pool, NULL if it is empty
+ */
+static timeshift_segment_t *
+timeshift_segment_get(void)
+{
+  timeshift_segment_t *seg;
+
+  pthread_mutex_lock(&timeshift_pool_mutex);
+  if((seg = TAILQ_FIRST(&timeshift_pool)) != NULL) {
+    TAILQ_REMOVE(&timeshift_pool, seg, tss_link);
+    timeshift_pool_size--;
+    seg->tss_refcount = 1;
+    pthread_cond_signal(&timeshift_pool_cond);
+  }
+  pthread_mutex_unlock(&timeshift_pool_mutex);
+  return seg;
+}
+
+
+/**
+ * ts_mutex must be held
+ */
+static void
+timeshift_segment_unref(timeshift_segment_t *seg)
+{
+  if(--seg->tss_refcount > 0)
+    return;
+
+  pthread_mutex_lock(&timeshift_pool_mutex);
+  TAILQ_INSERT_TAIL(&timeshift_reap, seg, tss_link);
+  pthread_cond_signal(&timeshift_pool_cond);
+  pthread_mutex_unlock(&timeshift_pool_mutex);
+}
+
+
+/**
+ * ts_mutex must be held
+ */
+static void
+timeshift_segment_remove(timeshift_t *ts, timeshift_segment_t *seg)
+{
+  TAILQ_REMOVE(&ts->ts_segments, seg, tss_link);
+  ts->ts_size -= seg->tss_size;
+  seg->tss_removed = 1;
+  timeshift_segment_unref(seg);
+}
+
+
+/**
+ * Store a packet, called with the service's s_stream_mutex held
+ */
+void
+timeshift_write(timeshift_t *ts, th_pkt_t *pkt)
+{
+  timeshift_segment_t *seg, *first;
+  timeshift_record_t *r;
+  size_t plen, hlen, len;
+  int64_t now;
+  int newseg = 0;
+  uint8_t *d;
+
+  plen = pkt->pkt_payload != NULL ? pktbuf_len(pkt->pkt_payload) : 0;
+  hlen = pkt->pkt_header  != NULL ? pktbuf_len(pkt->pkt_header)  : 0;
+  len = TIMESHIFT_ALIGN(sizeof(timeshift_record_t) + plen + hlen);
+
+  if(len > TIMESHIFT_SEGMENT_SIZE)
+    return;
+
+  seg = TAILQ_LAST(&ts->ts_segments, timeshift_segment_queue);
+  if(seg == NULL || seg->tss_used + len > seg->tss_size) {
+    if((seg = timeshift_segment_get()) == NULL) {
+      /* The allocation thread has not kept up, never wait for it */
+      if(!ts->ts_error)
+	tvhlog(LOG_WARNING, "timeshift", "No free segment, dropping data");
+      ts->ts_error = 1;
+      return;
+    }
+    ts->ts_error = 0;
+    newseg = 1;
+  }
+
+  /* Nobody reads beyond tss_used, so no need to lock while copying */
+  r = (timeshift_record_t *)(seg->tss_data + seg->tss_used);
+  now = getmonoclock();
+
+  r->tr_time           = now;
+  r->tr_pts            = pkt->pkt_pts;
+  r->tr_dts            = pkt->pkt_dts;
+  r->tr_duration       = pkt->pkt_duration;
+  r->tr_payloadlen     = plen;
+  r->tr_headerlen      = hlen;
+  r->tr_aspect_num     = pkt->pkt_aspect_num;
+  r->tr_aspect_den     = pkt->pkt_aspect_den;
+  r->tr_componentindex = pkt->pkt_componentindex;
+  r->tr_frametype      = pkt->pkt_frametype;
+  r->tr_field          = pkt->pkt_field;
+  r->tr_commercial     = pkt->pkt_commercial;
+  r->tr_channels       = pkt->pkt_channels;
+  r->tr_sri            = pkt->pkt_sri;
+
+  d = (uint8_t *)(r + 1);
+  if(plen)
+    memcpy(d, pktbuf_ptr(pkt->pkt_payload), plen);
+  if(hlen)
+    memcpy(d + plen, pktbuf_ptr(pkt->pkt_header), hlen);
+
+  pthread_mutex_lock(&ts->ts_mutex);
+
+  if(newseg) {
+    TAILQ_INSERT_TAIL(&ts->ts_segments, seg, tss_link);
+    ts->ts_size += seg->tss_size;
+    seg->tss_start = now;
+  }
+
+  if(pkt->pkt_frametype == PKT_I_FRAME) {
+    if(seg->tss_nkeys == seg->tss_keys_size) {
+      seg->tss_keys_size = MAX(64, seg->tss_keys_size * 2);
+      seg->tss_keys = realloc(seg->tss_keys, seg->tss_keys_size *
+			      sizeof(timeshift_keyframe_t));
+    }
+    seg->tss_keys[seg->tss_nkeys].tk_time = now;
+    seg->tss_keys[seg->tss_nkeys].tk_offset = seg->tss_used;
+    seg->tss_nkeys++;
+  }
+
+  seg->tss_used += len;
+  seg->tss_end = now;
+
+  /* Expire old segments, readers still in them keep them mapped */
+  while((first = TAILQ_FIRST(&ts->ts_segments)) != seg &&
+	(ts->ts_size > timeshift_max_bytes ||
+	 first->tss_end < now - timeshift_max_secs * 1000000LL))
+    timeshift_segment_remove(ts, first);
+
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+
+/**
+ * Drop everything, used when the stream composition changes
+ *
+ * Called with the service's s_stream_mutex held
+ */
+void
+timeshift_flush(timeshift_t *ts)
+{
+  timeshift_segment_t *seg;
+
+  pthread_mutex_lock(&ts->ts_mutex);
+  while((seg = TAILQ_FIRST(&ts->ts_segments)) != NULL)
+    timeshift_segment_remove(ts, seg);
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+
+/**
+ * Create the store and seed it with the service's GOP cache
+ */
+static timeshift_t *
+timeshift_create(service_t *t)
+{
+  timeshift_t *ts = calloc(1, sizeof(timeshift_t));
+  pthread_condattr_t attr;
+  th_pktref_t *pr;
+
+  pthread_mutex_init(&ts->ts_mutex, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ts->ts_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  TAILQ_INIT(&ts->ts_segments);
+
+  pthread_mutex_lock(&timeshift_pool_mutex);
+  timeshift_stores++;
+  pthread_cond_signal(&timeshift_pool_cond);
+  pthread_mutex_unlock(&timeshift_pool_mutex);
+
+  TAILQ_FOREACH(pr, &t->s_gop_cache, pr_link)
+    timeshift_write(ts, pr->pr_pkt);
+
+  return ts;
+}
+
+
+/**
+ *
+ */
+static void
+timeshift_destroy(timeshift_t *ts)
+{
+  timeshift_segment_t *seg;
+
+  assert(ts->ts_readers == 0);
+
+  while((seg = TAILQ_FIRST(&ts->ts_segments)) != NULL)
+    timeshift_segment_remove(ts, seg);
+
+  pthread_mutex_lock(&timeshift_pool_mutex);
+  timeshift_stores--;
+  pthread_cond_signal(&timeshift_pool_cond);
+  pthread_mutex_unlock(&timeshift_pool_mutex);
+
+  pthread_cond_destroy(&ts->ts_cond);
+  pthread_mutex_destroy(&ts->ts_mutex);
+  free(ts);
+}
+
+
+/**
+ * Move reader to 'seg' at 'offset', ts_mutex must be held
+ */
+static void
+timeshift_reader_set(timeshift_reader_t *rd, timeshift_segment_t *seg,
+		     size_t offset)
+{
+  if(seg != NULL)
+    seg->tss_refcount++;
+  if(rd->rd_seg != NULL)
+    timeshift_segment_unref(rd->rd_seg);
+  rd->rd_seg = seg;
+  rd->rd_offset = offset;
+  rd->rd_rebase = 1;
+  rd->rd_gen++;
+}
+
+
+/**
+ * Position reader at the last I-frame before 'time'. If there is
+ * none, at the start of the store
+ *
+ * ts_mutex must be held
+ */
+static void
+timeshift_reader_find(timeshift_reader_t *rd, int64_t time)
+{
+  timeshift_t *ts = rd->rd_ts;
+  timeshift_segment_t *seg;
+  int i;
+
+  TAILQ_FOREACH_REVERSE(seg, &ts->ts_segments, timeshift_segment_queue,
+			tss_link) {
+    for(i = seg->tss_nkeys - 1; i >= 0; i--) {
+      if(seg->tss_keys[i].tk_time <= time) {
+	timeshift_reader_set(rd, seg, seg->tss_keys[i].tk_offset);
+	return;
+      }
+    }
+  }
+
+  if((seg = TAILQ_FIRST(&ts->ts_segments)) != NULL && seg->tss_nkeys > 0)
+    timeshift_reader_set(rd, seg, seg->tss_keys[0].tk_offset);
+  else
+    timeshift_reader_set(rd, seg, 0);
+}
+
+
+/**
+ * Record at the reader's position, NULL if the reader has caught up
+ * with the writer
+ *
+ * ts_mutex must be held
+ */
+static timeshift_record_t *
+timeshift_reader_next(timeshift_reader_t *rd)
+{
+  timeshift_t *ts = rd->rd_ts;
+  timeshift_segment_t *seg;
+
+  while(1) {
+    seg = rd->rd_seg;
+
+    if(seg == NULL || seg->tss_removed) {
+      /* Nothing read yet, or we have fallen out of the store. Resume
+	 at the oldest I-frame still stored */
+      TAILQ_FOREACH(seg, &ts->ts_segments, tss_link)
+	if(seg->tss_nkeys > 0)
+	  break;
+      if(seg == NULL)
+	return NULL;
+      if(rd->rd_seg != NULL)
+	rd->rd_skip = 1;
+      timeshift_reader_set(rd, seg, seg->tss_keys[0].tk_offset);
+    }
+
+    if(rd->rd_offset < seg->tss_used)
+      return (timeshift_record_t *)(seg->tss_data + rd->rd_offset);
+
+    if((seg = TAILQ_NEXT(seg, tss_link)) == NULL)
+      return NULL;
+
+    seg->tss_refcount++;
+    timeshift_segment_unref(rd->rd_seg);
+    rd->rd_seg = seg;
+    rd->rd_offset = 0;
+  }
+}
+
+
+/**
+ *
+ */
+static th_pkt_t *
+timeshift_record_to_pkt(const timeshift_record_t *r)
+{
+  const uint8_t *d = (const uint8_t *)(r + 1);
+  th_pkt_t *pkt;
+
+  pkt = pkt_alloc(d, r->tr_payloadlen, r->tr_pts, r->tr_dts);
+  if(r->tr_headerlen)
+    pkt->pkt_header = pktbuf_alloc(d + r->tr_payloadlen, r->tr_headerlen);
+
+  pkt->pkt_duration       = r->tr_duration;
+  pkt->pkt_aspect_num     = r->tr_aspect_num;
+  pkt->pkt_aspect_den     = r->tr_aspect_den;
+  pkt->pkt_componentindex = r->tr_componentindex;
+  pkt->pkt_frametype      = r->tr_frametype;
+  pkt->pkt_field          = r->tr_field;
+  pkt->pkt_commercial     = r->tr_commercial;
+  pkt->pkt_channels       = r->tr_channels;
+  pkt->pkt_sri            = r->tr_sri;
+  return pkt;
+}
+
+
+/**
+ * Deliver packets from the store, paced by the time they were
+ * stored and the reader's speed
+ */
+static void *
+timeshift_reader_thread(void *aux)
+{
+  timeshift_reader_t *rd = aux;
+  timeshift_t *ts = rd->rd_ts;
+  timeshift_segment_t *seg, *last;
+  timeshift_record_t *r;
+  struct timespec tp;
+  th_pkt_t *pkt;
+  int64_t now, due;
+  size_t len;
+  int gen;
+
+  pthread_mutex_lock(&ts->ts_mutex);
+
+  while(rd->rd_running) {
+
+    if(!rd->rd_started || rd->rd_speed == 0) {
+      pthread_cond_wait(&ts->ts_cond, &ts->ts_mutex);
+      continue;
+    }
+
+    if((r = timeshift_reader_next(rd)) == NULL) {
+      /* Caught up with live, continue in normal speed */
+      if(rd->rd_speed != 100) {
+	rd->rd_speed = 100;
+	rd->rd_rebase = 1;
+      }
+      pthread_cond_wait(&ts->ts_cond, &ts->ts_mutex);
+      continue;
+    }
+
+    now = getmonoclock();
+    if(rd->rd_rebase) {
+      rd->rd_base_rec = r->tr_time;
+      rd->rd_base_now = now;
+      rd->rd_rebase = 0;
+    }
+
+    due = rd->rd_base_now + (r->tr_time - rd->rd_base_rec) * 100 / rd->rd_speed;
+    if(due > now + 1000) {
+      tp.tv_sec  = due / 1000000;
+      tp.tv_nsec = (due % 1000000) * 1000;
+      pthread_cond_timedwait(&ts->ts_cond, &ts->ts_mutex, &tp);
+      continue;
+    }
+
+    /* Copy the packet out of the segment without holding the lock */
+    seg = rd->rd_seg;
+    seg->tss_refcount++;
+    gen = rd->rd_gen;
+    len = TIMESHIFT_RECLEN(r);
+
+    pthread_mutex_unlock(&ts->ts_mutex);
+    pkt = timeshift_record_to_pkt(r);
+    pthread_mutex_lock(&ts->ts_mutex);
+
+    if(gen == rd->rd_gen && rd->rd_started && rd->rd_running) {
+      if(rd->rd_skip) {
+	last = TAILQ_LAST(&ts->ts_segments, timeshift_segment_queue);
+	now = last != NULL ? MAX(0, last->tss_end - r->tr_time) : 0;
+	streaming_target_deliver(rd->rd_output,
+				 streaming_msg_create_code(SMT_SKIP,
+							   now / 1000));
+	rd->rd_skip = 0;
+      }
+      rd->rd_offset += len;
+      rd->rd_time = r->tr_time;
+      streaming_target_deliver(rd->rd_output,
+			       streaming_msg_create_data(SMT_PACKET, pkt));
+    } else {
+      pkt_ref_dec(pkt);
+    }
+    timeshift_segment_unref(seg);
+  }
+
+  pthread_mutex_unlock(&ts->ts_mutex);
+  return NULL;
+}
+
+
+/**
+ * Control messages from the subscription. Packets are dropped, the
+ * reader thread delivers them from the store instead.
+ *
+ * Called with the service's s_stream_mutex held
+ */
+static void
+timeshift_reader_recv(void *opaque, streaming_message_t *sm)
+{
+  timeshift_reader_t *rd = opaque;
+  timeshift_t *ts = rd->rd_ts;
+
+  if(sm->sm_type == SMT_PACKET || sm->sm_type == SMT_MPEGTS) {
+    streaming_msg_free(sm);
+    return;
+  }
+
+  pthread_mutex_lock(&ts->ts_mutex);
+
+  switch(sm->sm_type) {
+  case SMT_START:
+    /* Start from the most recent I-frame */
+    timeshift_reader_find(rd, INT64_MAX);
+    rd->rd_started = 1;
+    rd->rd_speed = 100;
+    rd->rd_time = 0;
+    rd->rd_skip = 0;
+    break;
+
+  case SMT_STOP:
+    rd->rd_started = 0;
+    break;
+
+  default:
+    break;
+  }
+
+  streaming_target_deliver(rd->rd_output, sm);
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+
+/**
+ * Called with the service's s_stream_mutex held
+ */
+timeshift_reader_t *
+timeshift_reader_create(service_t *t, streaming_target_t *output)
+{
+  timeshift_reader_t *rd = calloc(1, sizeof(timeshift_reader_t));
+
+  lock_assert(&t->s_stream_mutex);
+
+  if(t->s_timeshift == NULL)
+    t->s_timeshift = timeshift_create(t);
+
+  rd->rd_ts = t->s_timeshift;
+  rd->rd_ts->ts_readers++;
+  rd->rd_service = t;
+  rd->rd_output = output;
+  rd->rd_speed = 100;
+  rd->rd_running = 1;
+  streaming_target_init(&rd->rd_input, timeshift_reader_recv, rd, 0);
+
+  pthread_create(&rd->rd_thread, NULL, timeshift_reader_thread, rd);
+  return rd;
+}
+
+
+/**
+ *
+ */
+streaming_target_t *
+timeshift_reader_input(timeshift_reader_t *rd)
+{
+  return &rd->rd_input;
+}
+
+
+/**
+ * Stop the reader, the store goes with the last reader. Returns the
+ * output the reader was created with.
+ *
+ * Called with the service's s_stream_mutex held
+ */
+streaming_target_t *
+timeshift_reader_destroy(timeshift_reader_t *rd)
+{
+  timeshift_t *ts = rd->rd_ts;
+  service_t *t = rd->rd_service;
+  streaming_target_t *output = rd->rd_output;
+
+  lock_assert(&t->s_stream_mutex);
+
+  pthread_mutex_lock(&ts->ts_mutex);
+  rd->rd_running = 0;
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+
+  pthread_join(rd->rd_thread, NULL);
+
+  pthread_mutex_lock(&ts->ts_mutex);
+  timeshift_reader_set(rd, NULL, 0);
+  pthread_mutex_unlock(&ts->ts_mutex);
+
+  if(--ts->ts_readers == 0) {
+    t->s_timeshift = NULL;
+    timeshift_destroy(ts);
+  }
+  free(rd);
+  return output;
+}
+
+
+/**
+ * Seek 'delta' us from the current position, to the closest I-frame
+ * before that. Seeking past the end goes live.
+ */
+void
+timeshift_reader_seek(timeshift_reader_t *rd, int64_t delta)
+{
+  timeshift_t *ts = rd->rd_ts;
+  timeshift_segment_t *last;
+  int64_t pos;
+
+  pthread_mutex_lock(&ts->ts_mutex);
+
+  last = TAILQ_LAST(&ts->ts_segments, timeshift_segment_queue);
+  pos = rd->rd_time ?: (last != NULL ? last->tss_end : 0);
+
+  timeshift_reader_find(rd, pos + delta);
+  rd->rd_skip = 1;
+
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+
+/**
+ * Playback speed in percent, 0 pauses. Rewinding is done by seeking.
+ */
+void
+timeshift_reader_speed(timeshift_reader_t *rd, int speed)
+{
+  timeshift_t *ts = rd->rd_ts;
+
+  pthread_mutex_lock(&ts->ts_mutex);
+  rd->rd_speed = MAX(0, MIN(speed, 400));
+  rd->rd_rebase = 1;
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+
+/**
+ * Jump to the most recent I-frame and resume normal speed
+ */
+void
+timeshift_reader_live(timeshift_reader_t *rd)
+{
+  timeshift_t *ts = rd->rd_ts;
+
+  pthread_mutex_lock(&ts->ts_mutex);
+  timeshift_reader_find(rd, INT64_MAX);
+  rd->rd_speed = 100;
+  rd->rd_skip = 1;
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+
+/**
+ * How far (us) the reader is behind live
+ */
+int64_t
+timeshift_reader_shift(timeshift_reader_t *rd)
+{
+  timeshift_t *ts = rd->rd_ts;
+  timeshift_segment_t *last;
+  int64_t r = 0;
+
+  pthread_mutex_lock(&ts->ts_mutex);
+  last = TAILQ_LAST(&ts->ts_segments, timeshift_segment_queue);
+  if(last != NULL && rd->rd_time)
+    r = MAX(0, last->tss_end - rd->rd_time);
+  pthread_mutex_unlock(&ts->ts_mutex);
+  return r;
+}
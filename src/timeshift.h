@@ -0,0 +1,68 @@
+/*
+ *  tvheadend, disk backed timeshift
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMESHIFT_H__
+#define TIMESHIFT_H__
+
+struct service;
+struct th_pkt;
+struct timeshift;
+struct timeshift_reader;
+
+/**
+ * Each service with timeshifting subscribers has one timeshift store,
+ * a ring of mmap'd segment files fed with the parsed packets of the
+ * service. Every subscriber has a reader with its own position and
+ * speed, all readers share the store (and the page cache).
+ *
+ * The store is created by the first reader and destroyed with the
+ * last one. Both are done with the service's s_stream_mutex held.
+ */
+void timeshift_init(void);
+
+int timeshift_enabled(void);
+
+int timeshift_max_duration(void);
+
+void timeshift_write(struct timeshift *ts, struct th_pkt *pkt);
+
+void timeshift_flush(struct timeshift *ts);
+
+/**
+ * Readers
+ *
+ * The reader is put between the subscription and 'output'. Control
+ * messages are passed on, packets are delivered from the store by
+ * the reader's own thread.
+ */
+struct timeshift_reader *timeshift_reader_create(struct service *t,
+						 streaming_target_t *output);
+
+streaming_target_t *timeshift_reader_input(struct timeshift_reader *rd);
+
+streaming_target_t *timeshift_reader_destroy(struct timeshift_reader *rd);
+
+void timeshift_reader_seek(struct timeshift_reader *rd, int64_t delta);
+
+void timeshift_reader_speed(struct timeshift_reader *rd, int speed);
+
+void timeshift_reader_live(struct timeshift_reader *rd);
+
+int64_t timeshift_reader_shift(struct timeshift_reader *rd);
+
+#endif /* TIMESHIFT_H__ */
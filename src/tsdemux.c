@@ -61,27 +61,69 @@ got_section(const uint8_t *data, size_t len, void *opaque)
 }
 
 
+/**
+ * Parse the headers of 'num' consecutive packets
+ */
+void
+ts_parse_packets(const uint8_t *tsb, int num, tsdesc_t *tsd)
+{
+  int flags;
+
+  for(; num > 0; num--, tsb += 188, tsd++) {
+    flags = 0;
+    if(tsb[1] & 0x80)
+      flags |= TSD_TEI;
+    if(tsb[1] & 0x40)
+      flags |= TSD_PUSI;
+    if(tsb[3] & 0x10)
+      flags |= TSD_PAYLOAD;
+    if(tsb[3] & 0xc0)
+      flags |= TSD_SCRAMBLED;
+
+    tsd->tsd_tsb = tsb;
+    tsd->tsd_pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+    tsd->tsd_cc  = tsb[3] & 0xf;
+
+    if(tsb[3] & 0x20) {
+      tsd->tsd_off = tsb[4] + 5;
+
+      if(tsb[4] > 0 && tsb[5] & 0x10 && !(flags & TSD_TEI)) {
+	tsd->tsd_pcr  = (uint64_t)tsb[6] << 25;
+	tsd->tsd_pcr |= (uint64_t)tsb[7] << 17;
+	tsd->tsd_pcr |= (uint64_t)tsb[8] << 9;
+	tsd->tsd_pcr |= (uint64_t)tsb[9] << 1;
+	tsd->tsd_pcr |= ((uint64_t)tsb[10] >> 7) & 0x01;
+	flags |= TSD_PCR;
+      }
+    } else {
+      tsd->tsd_off = 4;
+    }
+    tsd->tsd_flags = flags;
+  }
+}
+
+
 /**
  * Continue processing of transport stream packets
  */
 static void
-ts_recv_packet0(service_t *t, elementary_stream_t *st, const uint8_t *tsb)
+ts_recv_packet0(service_t *t, elementary_stream_hot_t *esh,
+		const tsdesc_t *tsd, int remux)
 {
-  int off, pusi, cc, error;
-
-  service_set_streaming_status_flags(t, TSS_MUX_PACKETS);
+  elementary_stream_t *st = esh->esh_stream;
+  const uint8_t *tsb = tsd->tsd_tsb;
+  int off, pusi, error, type = esh->esh_type;
 
-  if(streaming_pad_probe_type(&t->s_streaming_pad, SMT_MPEGTS))
+  if(remux)
     ts_remux(t, tsb);
 
-  error = !!(tsb[1] & 0x80);
-  pusi  = !!(tsb[1] & 0x40);
+  error = !!(tsd->tsd_flags & TSD_TEI);
+  pusi  = !!(tsd->tsd_flags & TSD_PUSI);
 
   /* Check CC */
 
-  if(tsb[3] & 0x10) {
-    cc = tsb[3] & 0xf;
-    if(st->es_cc_valid && cc != st->es_cc) {
+  if(tsd->tsd_flags & TSD_PAYLOAD) {
+    if(esh->esh_cc_valid && tsd->tsd_cc != esh->esh_cc) {
       /* Incorrect CC */
       limitedlog(&st->es_loglimit_cc, "TS", service_component_nicename(st),
 		 "Continuity counter error");
@@ -92,13 +134,14 @@ ts_recv_packet0(service_t *t, elementary_stream_t *st, const uint8_t *tsb)
       if(!pusi)
 	error |= 0x2;
     }
-    st->es_cc_valid = 1;
-    st->es_cc = (cc + 1) & 0xf;
+    esh->esh_cc_valid = 1;
+    esh->esh_cc = (tsd->tsd_cc + 1) & 0xf;
   }
 
-  off = tsb[3] & 0x20 ? tsb[4] + 5 : 4;
+  off = tsd->tsd_off;
 
-  switch(st->es_type) {
+  /* Sections may add or remove streams, esh is not valid after this */
+  switch(type) {
 
   case SCT_CA:
   case SCT_PAT:
@@ -131,24 +174,9 @@ ts_recv_packet0(service_t *t, elementary_stream_t *st, const uint8_t *tsb)
  * than the stream PCR
  */
 static void
-ts_extract_pcr(service_t *t, elementary_stream_t *st, const uint8_t *tsb, 
-	       int64_t *pcrp)
+ts_extract_pcr(service_t *t, elementary_stream_t *st, int64_t pcr)
 {
-  int64_t real, pcr, d;
-
-  pcr  = (uint64_t)tsb[6] << 25;
-  pcr |= (uint64_t)tsb[7] << 17;
-  pcr |= (uint64_t)tsb[8] << 9;
-  pcr |= (uint64_t)tsb[9] << 1;
-  pcr |= ((uint64_t)tsb[10] >> 7) & 0x01;
-  
-  pcr = pcr;
-
-  if(pcrp != NULL)
-    *pcrp = pcr;
-
-  if(st == NULL)
-    return;
+  int64_t real, d;
 
   real = getmonoclock();
 
@@ -178,100 +206,130 @@ ts_extract_pcr(service_t *t, elementary_stream_t *st, const uint8_t *tsb,
 }
 
 /**
- * Process service stream packets, extract PCR and optionally descramble
+ * Process a batch of service stream packets, extract PCR and
+ * optionally descramble
+ *
+ * The stream mutex is taken and the streaming status is updated
+ * once per batch instead of once per packet
  */
 void
-ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
+ts_recv_packets(service_t *t, const tsdesc_t *tsd, int num)
 {
+  elementary_stream_hot_t *esh;
   elementary_stream_t *st;
-  int pid, n, m, r;
+  int n, m, r, remux, status = TSS_INPUT_HARDWARE;
   th_descrambler_t *td;
-  int error = 0;
+  int error;
 
-  if(t->s_status != SERVICE_RUNNING)
+  if(num == 0 || t->s_status != SERVICE_RUNNING)
     return;
 
   pthread_mutex_lock(&t->s_stream_mutex);
 
-  service_set_streaming_status_flags(t, TSS_INPUT_HARDWARE);
+  remux = streaming_pad_probe_type(&t->s_streaming_pad, SMT_MPEGTS);
 
-  if(tsb[1] & 0x80) {
-    /* Transport Error Indicator */
-    limitedlog(&t->s_loglimit_tei, "TS", service_nicename(t),
-	       "Transport error indicator");
-    error = 1;
-  }
+  for(; num > 0; num--, tsd++) {
 
-  pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+    error = tsd->tsd_flags & TSD_TEI;
+    if(error) {
+      /* Transport Error Indicator */
+      limitedlog(&t->s_loglimit_tei, "TS", service_nicename(t),
+		 "Transport error indicator");
+    }
 
-  st = service_stream_find(t, pid);
+    esh = service_stream_hot_find(t, tsd->tsd_pid);
+    if(esh == NULL)
+      continue;
+    st = esh->esh_stream;
 
-  /* Extract PCR */
-  if(tsb[3] & 0x20 && tsb[4] > 0 && tsb[5] & 0x10 && !error)
-    ts_extract_pcr(t, st, tsb, pcrp);
+    if(tsd->tsd_flags & TSD_PCR)
+      ts_extract_pcr(t, st, tsd->tsd_pcr);
 
-  if(st == NULL) {
-    pthread_mutex_unlock(&t->s_stream_mutex);
-    return;
-  }
+    if(!error)
+      status |= TSS_INPUT_SERVICE;
 
-  if(!error)
-    service_set_streaming_status_flags(t, TSS_INPUT_SERVICE);
+    avgstat_add(&t->s_rate, 188, dispatch_clock);
 
-  avgstat_add(&t->s_rate, 188, dispatch_clock);
+    if((tsd->tsd_flags & TSD_SCRAMBLED) ||
+       (t->s_scrambled_seen && esh->esh_type != SCT_CA &&
+	esh->esh_type != SCT_PAT && esh->esh_type != SCT_PMT)) {
 
-  if((tsb[3] & 0xc0) ||
-      (t->s_scrambled_seen && st->es_type != SCT_CA &&
-       st->es_type != SCT_PAT && st->es_type != SCT_PMT)) {
+      /**
+       * Lock for descrambling, but only if packet was not in error
+       */
+      if(!error)
+	t->s_scrambled_seen = t->s_scrambled;
 
-    /**
-     * Lock for descrambling, but only if packet was not in error
-     */
-    if(!error)
-      t->s_scrambled_seen = t->s_scrambled;
+      /* scrambled stream */
+      n = m = 0;
 
-    /* scrambled stream */
-    n = m = 0;
+      LIST_FOREACH(td, &t->s_descramblers, td_service_link) {
+	n++;
 
-    LIST_FOREACH(td, &t->s_descramblers, td_service_link) {
-      n++;
-      
-      r = td->td_descramble(td, t, st, tsb);
-      if(r == 0) {
-	pthread_mutex_unlock(&t->s_stream_mutex);
-	return;
-      }
+	r = td->td_descramble(td, t, st, tsd->tsd_tsb);
+	if(r == 0)
+	  break;
 
-      if(r == 1)
-	m++;
-    }
+	if(r == 1)
+	  m++;
+      }
 
-    if(!error) {
-      if(n == 0) {
-	service_set_streaming_status_flags(t, TSS_NO_DESCRAMBLER);
-      } else if(m == n) {
-	service_set_streaming_status_flags(t, TSS_NO_ACCESS);
+      if(td == NULL && !error) {
+	if(n == 0) {
+	  status |= TSS_NO_DESCRAMBLER;
+	} else if(m == n) {
+	  status |= TSS_NO_ACCESS;
+	}
       }
-    }
 
-  } else {
-    ts_recv_packet0(t, st, tsb);
+    } else {
+      status |= TSS_MUX_PACKETS;
+      ts_recv_packet0(t, esh, tsd, remux);
+    }
   }
+
+  service_set_streaming_status_flags(t, status);
   pthread_mutex_unlock(&t->s_stream_mutex);
 }
 
 
+/**
+ * Process a single service stream packet
+ */
+void
+ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
+{
+  tsdesc_t tsd;
+
+  if(t->s_status != SERVICE_RUNNING)
+    return;
+
+  ts_parse_packets(tsb, 1, &tsd);
+
+  if(pcrp != NULL && tsd.tsd_flags & TSD_PCR)
+    *pcrp = tsd.tsd_pcr;
+
+  ts_recv_packets(t, &tsd, 1);
+}
+
+
 /*
  * Process transport stream packets, simple version
  */
 void
 ts_recv_packet2(service_t *t, const uint8_t *tsb)
 {
-  elementary_stream_t *st;
-  int pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+  elementary_stream_hot_t *esh;
+  tsdesc_t tsd;
+
+  ts_parse_packets(tsb, 1, &tsd);
 
-  if((st = service_stream_find(t, pid)) != NULL)
-    ts_recv_packet0(t, st, tsb);
+  if((esh = service_stream_hot_find(t, tsd.tsd_pid)) != NULL) {
+    service_set_streaming_status_flags(t, TSS_MUX_PACKETS);
+    ts_recv_packet0(t, esh, &tsd,
+		    streaming_pad_probe_type(&t->s_streaming_pad,
+					     SMT_MPEGTS));
+  }
 }
 
 
@@ -19,6 +19,29 @@
 #ifndef TSDEMUX_H
 #define TSDEMUX_H
 
+/**
+ * Transport stream packet header, parsed once per packet by
+ * ts_parse_packets() and shared by all services on the mux
+ */
+typedef struct tsdesc {
+  const uint8_t *tsd_tsb;
+  int64_t tsd_pcr;        /* Valid if TSD_PCR is set */
+  uint16_t tsd_pid;
+  uint16_t tsd_off;       /* Payload offset, may be > 188 if corrupt */
+  uint8_t tsd_cc;
+  uint8_t tsd_flags;
+} tsdesc_t;
+
+#define TSD_TEI       0x1  /* Transport error indicator */
+#define TSD_PUSI      0x2  /* Payload unit start */
+#define TSD_PAYLOAD   0x4
+#define TSD_SCRAMBLED 0x8
+#define TSD_PCR       0x10
+
+void ts_parse_packets(const uint8_t *tsb, int num, tsdesc_t *tsd);
+
+void ts_recv_packets(struct service *t, const tsdesc_t *tsd, int num);
+
 void ts_recv_packet1(struct service *t, const uint8_t *tsb, int64_t *pcrp);
 
 void ts_recv_packet2(struct service *t, const uint8_t *tsb);
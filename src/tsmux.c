@@ -422,7 +422,8 @@ lookahead_dequeue(tsmuxer_t *tsm, tsmuxer_es_t *te)
     pkt_ref_dec(pkt);
     TAILQ_REMOVE(&te->te_smq, sm, sm_link);
 
-    free(sm);
+    sm->sm_data = NULL;
+    streaming_msg_free(sm);
   }
   //  ts_check_deliver(ts, tms);
 }
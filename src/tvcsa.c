@@ -0,0 +1,563 @@
+/*
+ *  tvheadend, CSA descrambler buffering
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tvheadend.h"
+#include "service.h"
+#include "tsdemux.h"
+#include "tvcsa.h"
+#include "ffdecsa/FFdecsa.h"
+
+
+/**
+ * Services descrambled with the same control words
+ */
+typedef struct tvcsa_group {
+  LIST_ENTRY(tvcsa_group) cg_link;  /* tvcsa_groups, tvcsa_groups_mutex */
+  int cg_refcount;                  /* tvcsa_groups_mutex */
+  uint8_t cg_cw[16];
+  void *cg_keys;
+
+  pthread_mutex_t cg_mutex;
+
+  int cg_cluster_size;      /* Allocated size (packets) */
+  int cg_target;            /* Flush when this many packets are queued */
+  uint8_t *cg_tsbcluster;
+  int64_t *cg_tsbtime;      /* Arrival time of each queued packet */
+  tvcsa_t **cg_owner;       /* Service of each queued packet */
+  int cg_fill;
+
+  /* Packet rate measurement */
+  int64_t cg_rate_start;
+  int cg_rate_count;
+
+} tvcsa_group_t;
+
+static LIST_HEAD(, tvcsa_group) tvcsa_groups;
+static pthread_mutex_t tvcsa_groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Services with a descrambler, scanned by the flush thread.
+ * Lock order is s_stream_mutex, tvcsa_active_mutex, cg_mutex; the
+ * flush thread only trylocks s_stream_mutex
+ */
+static LIST_HEAD(, tvcsa) tvcsa_active;
+static pthread_mutex_t tvcsa_active_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tvcsa_flush_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ *
+ */
+void
+tvcsa_init(tvcsa_t *csa)
+{
+  memset(csa, 0, sizeof(tvcsa_t));
+  csa->csa_output = ts_recv_packet2;
+}
+
+
+/**
+ * Find or create the group for the service's current key
+ */
+static void
+tvcsa_group_join(tvcsa_t *csa)
+{
+  tvcsa_group_t *cg;
+  int n;
+
+  pthread_mutex_lock(&tvcsa_groups_mutex);
+
+  LIST_FOREACH(cg, &tvcsa_groups, cg_link)
+    if(!memcmp(cg->cg_cw, csa->csa_key, 16))
+      break;
+
+  if(cg == NULL) {
+    cg = calloc(1, sizeof(tvcsa_group_t));
+    memcpy(cg->cg_cw, csa->csa_key, 16);
+    cg->cg_keys = get_key_struct();
+    set_even_control_word(cg->cg_keys, cg->cg_cw);
+    set_odd_control_word(cg->cg_keys, cg->cg_cw + 8);
+    pthread_mutex_init(&cg->cg_mutex, NULL);
+
+    n = get_suggested_cluster_size();
+    cg->cg_target = n;
+    cg->cg_cluster_size = n * TVCSA_MAX_CLUSTERS;
+    cg->cg_tsbcluster = malloc(cg->cg_cluster_size * 188);
+    cg->cg_tsbtime = malloc(cg->cg_cluster_size * sizeof(int64_t));
+    cg->cg_owner = malloc(cg->cg_cluster_size * sizeof(tvcsa_t *));
+    LIST_INSERT_HEAD(&tvcsa_groups, cg, cg_link);
+  }
+
+  cg->cg_refcount++;
+  csa->csa_group = cg;
+  pthread_mutex_unlock(&tvcsa_groups_mutex);
+}
+
+
+/**
+ * Leave the group, packets still queued for the service are dropped
+ */
+static void
+tvcsa_group_leave(tvcsa_t *csa)
+{
+  tvcsa_group_t *cg = csa->csa_group;
+  int i;
+
+  pthread_mutex_lock(&cg->cg_mutex);
+  for(i = 0; i < cg->cg_fill; i++)
+    if(cg->cg_owner[i] == csa)
+      cg->cg_owner[i] = NULL;
+  pthread_mutex_unlock(&cg->cg_mutex);
+
+  csa->csa_group = NULL;
+
+  pthread_mutex_lock(&tvcsa_groups_mutex);
+  if(--cg->cg_refcount == 0) {
+    LIST_REMOVE(cg, cg_link);
+    free_key_struct(cg->cg_keys);
+    free(cg->cg_tsbcluster);
+    free(cg->cg_tsbtime);
+    free(cg->cg_owner);
+    pthread_mutex_destroy(&cg->cg_mutex);
+    free(cg);
+  }
+  pthread_mutex_unlock(&tvcsa_groups_mutex);
+}
+
+
+/**
+ *
+ */
+void
+tvcsa_destroy(tvcsa_t *csa, service_t *t, const char *subsys)
+{
+  if(csa->csa_service != NULL) {
+    pthread_mutex_lock(&tvcsa_active_mutex);
+    LIST_REMOVE(csa, csa_active_link);
+    pthread_mutex_unlock(&tvcsa_active_mutex);
+  }
+
+  if(csa->csa_group != NULL)
+    tvcsa_group_leave(csa);
+
+  if(csa->csa_packets)
+    tvhlog(LOG_DEBUG, subsys,
+	   "%s: Descrambled %lld packets, average added latency %d ms, "
+	   "%d partial clusters",
+	   service_nicename(t), (long long)csa->csa_packets,
+	   tvcsa_average_latency(csa) / 1000, csa->csa_partial_flushes);
+
+  free(csa->csa_ready);
+  free(csa->csa_out);
+}
+
+
+/**
+ * Average time (in us) packets spent waiting for their cluster
+ */
+int
+tvcsa_average_latency(tvcsa_t *csa)
+{
+  return csa->csa_packets ? csa->csa_latency_sum / csa->csa_packets : 0;
+}
+
+
+/**
+ * An all zero control word means 'unchanged'
+ */
+void
+tvcsa_set_control_words(tvcsa_t *csa, const uint8_t *even, const uint8_t *odd)
+{
+  memcpy(csa->csa_cw, even, 8);
+  memcpy(csa->csa_cw + 8, odd, 8);
+  csa->csa_pending_cw_update = 1;
+}
+
+
+/**
+ * Descramble whatever is queued in the group's cluster and park the
+ * packets with the services they belong to
+ *
+ * If 'all' is set the cluster is drained completely, otherwise packets
+ * FFdecsa did not process are kept for the next round.
+ *
+ * cg_mutex must be held
+ */
+static void
+tvcsa_group_flush(tvcsa_group_t *cg, tvcsa_t *caller, int64_t now, int all)
+{
+  int i, r;
+  unsigned char *vec[3];
+  const uint8_t *t0;
+  tvcsa_t *csa;
+
+  if(cg->cg_fill < cg->cg_target)
+    caller->csa_partial_flushes++;
+
+  while(cg->cg_fill > 0) {
+
+    vec[0] = cg->cg_tsbcluster;
+    vec[1] = cg->cg_tsbcluster + cg->cg_fill * 188;
+    vec[2] = NULL;
+
+    r = decrypt_packets(cg->cg_keys, vec);
+    if(r <= 0) {
+      cg->cg_fill = 0;
+      break;
+    }
+
+    t0 = cg->cg_tsbcluster;
+    for(i = 0; i < r; i++, t0 += 188) {
+      if((csa = cg->cg_owner[i]) == NULL)
+	continue;
+
+      if(csa->csa_ready_fill == csa->csa_ready_size) {
+	csa->csa_ready_size = MAX(csa->csa_ready_size * 2, cg->cg_target);
+	csa->csa_ready = realloc(csa->csa_ready, csa->csa_ready_size * 188);
+      }
+      memcpy(csa->csa_ready + csa->csa_ready_fill * 188, t0, 188);
+      csa->csa_ready_fill++;
+      csa->csa_latency_sum += now - cg->cg_tsbtime[i];
+      csa->csa_packets++;
+    }
+
+    r = cg->cg_fill - r;
+    assert(r >= 0);
+
+    if(r > 0) {
+      memmove(cg->cg_tsbcluster, t0, r * 188);
+      memmove(cg->cg_tsbtime, cg->cg_tsbtime + cg->cg_fill - r,
+	      r * sizeof(int64_t));
+      memmove(cg->cg_owner, cg->cg_owner + cg->cg_fill - r,
+	      r * sizeof(tvcsa_t *));
+    }
+    cg->cg_fill = r;
+
+    if(!all)
+      break;
+  }
+}
+
+
+/**
+ * Pick the batch size from the packet rate of the group. A full
+ * suggested cluster is what one decrypt_packets() call takes, so a
+ * larger batch only adds delay. Low rate groups use a smaller batch
+ * that fills in half of TVCSA_MAX_DELAY, rounded up to the FFdecsa
+ * parallelism
+ */
+static void
+tvcsa_group_rate(tvcsa_group_t *cg, int64_t now)
+{
+  int64_t d = now - cg->cg_rate_start;
+  int n, p;
+
+  cg->cg_rate_count++;
+
+  if(d < 1000000)
+    return;
+
+  n = cg->cg_rate_count * (TVCSA_MAX_DELAY / 2) / d;
+  p = get_internal_parallelism();
+  n = (n + p - 1) / p * p;
+  cg->cg_target = MIN(MAX(n, p), get_suggested_cluster_size());
+
+  cg->cg_rate_start = now;
+  cg->cg_rate_count = 0;
+}
+
+
+/**
+ * Load new control words. If the service's key set changes it
+ * moves to another group, whatever is queued in the old group is
+ * descrambled with the old keys first
+ */
+static void
+tvcsa_update_keys(tvcsa_t *csa, int64_t now)
+{
+  tvcsa_group_t *cg = csa->csa_group;
+  int i;
+
+  csa->csa_pending_cw_update = 0;
+  for(i = 0; i < 8; i++)
+    if(csa->csa_cw[i]) {
+      memcpy(csa->csa_key, csa->csa_cw, 8);
+      break;
+    }
+
+  for(i = 0; i < 8; i++)
+    if(csa->csa_cw[8 + i]) {
+      memcpy(csa->csa_key + 8, csa->csa_cw + 8, 8);
+      break;
+    }
+
+  if(cg != NULL) {
+    if(!memcmp(cg->cg_cw, csa->csa_key, 16))
+      return;
+
+    pthread_mutex_lock(&cg->cg_mutex);
+    tvcsa_group_flush(cg, csa, now, 1);
+    pthread_mutex_unlock(&cg->cg_mutex);
+    tvcsa_group_leave(csa);
+  }
+  tvcsa_group_join(csa);
+}
+
+
+/**
+ * Take the packets descrambled for the service, also those descrambled
+ * by other services in the group. They are passed on by the caller
+ * from csa_out
+ *
+ * cg_mutex must be held
+ */
+static int
+tvcsa_grab_ready(tvcsa_t *csa)
+{
+  int n = csa->csa_ready_fill, i;
+  uint8_t *p;
+
+  if(n > 0) {
+    p = csa->csa_ready;
+    i = csa->csa_ready_size;
+    csa->csa_ready = csa->csa_out;
+    csa->csa_ready_size = csa->csa_out_size;
+    csa->csa_ready_fill = 0;
+    csa->csa_out = p;
+    csa->csa_out_size = i;
+  }
+  return n;
+}
+
+
+/**
+ * Descramble and pass on packets that have waited for TVCSA_MAX_DELAY
+ * when no new packet arrives to trigger it (input paused or stopped)
+ *
+ * s_stream_mutex is held
+ */
+static void
+tvcsa_flush_idle(tvcsa_t *csa, int64_t now)
+{
+  tvcsa_group_t *cg = csa->csa_group;
+  int i, n;
+
+  if(cg == NULL)
+    return;
+
+  pthread_mutex_lock(&cg->cg_mutex);
+  if(cg->cg_fill > 0 && now - cg->cg_tsbtime[0] >= TVCSA_MAX_DELAY)
+    tvcsa_group_flush(cg, csa, now, 1);
+  n = tvcsa_grab_ready(csa);
+  pthread_mutex_unlock(&cg->cg_mutex);
+
+  for(i = 0; i < n; i++)
+    csa->csa_output(csa->csa_service, csa->csa_out + i * 188);
+}
+
+
+/**
+ * A service that is busy (its stream mutex is taken) is feeding
+ * packets and flushes by itself, so those are skipped
+ */
+static void *
+tvcsa_flush_thread(void *aux)
+{
+  tvcsa_t *csa;
+  service_t *t;
+  int64_t now;
+
+  while(1) {
+    usleep(TVCSA_MAX_DELAY / 2);
+    now = getmonoclock();
+
+    pthread_mutex_lock(&tvcsa_active_mutex);
+    LIST_FOREACH(csa, &tvcsa_active, csa_active_link) {
+      t = csa->csa_service;
+      if(pthread_mutex_trylock(&t->s_stream_mutex))
+	continue;
+      tvcsa_flush_idle(csa, now);
+      pthread_mutex_unlock(&t->s_stream_mutex);
+    }
+    pthread_mutex_unlock(&tvcsa_active_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+tvcsa_flush_start(void)
+{
+  pthread_t tid;
+  pthread_create(&tid, NULL, tvcsa_flush_thread, NULL);
+}
+
+
+/**
+ *
+ */
+static void
+tvcsa_descramble0(tvcsa_t *csa, service_t *t, const uint8_t *tsb,
+		  int64_t now)
+{
+  tvcsa_group_t *cg;
+  int i, n;
+
+  if(csa->csa_pending_cw_update || csa->csa_group == NULL)
+    tvcsa_update_keys(csa, now);
+
+  cg = csa->csa_group;
+  pthread_mutex_lock(&cg->cg_mutex);
+
+  memcpy(cg->cg_tsbcluster + cg->cg_fill * 188, tsb, 188);
+  cg->cg_tsbtime[cg->cg_fill] = now;
+  cg->cg_owner[cg->cg_fill] = csa;
+  cg->cg_fill++;
+
+  tvcsa_group_rate(cg, now);
+
+  if(cg->cg_fill >= cg->cg_target ||
+     now - cg->cg_tsbtime[0] >= TVCSA_MAX_DELAY)
+    tvcsa_group_flush(cg, csa, now, 0);
+
+  n = tvcsa_grab_ready(csa);
+  pthread_mutex_unlock(&cg->cg_mutex);
+
+  for(i = 0; i < n; i++)
+    csa->csa_output(t, csa->csa_out + i * 188);
+}
+
+
+/**
+ * Queue a scrambled packet. The batch is descrambled once it reaches
+ * the group's target size or when its oldest packet has been waiting
+ * for TVCSA_MAX_DELAY, by the flush thread if the input goes quiet.
+ */
+void
+tvcsa_descramble(tvcsa_t *csa, service_t *t, const uint8_t *tsb)
+{
+  if(csa->csa_service == NULL) {
+    pthread_once(&tvcsa_flush_once, tvcsa_flush_start);
+    csa->csa_service = t;
+    pthread_mutex_lock(&tvcsa_active_mutex);
+    LIST_INSERT_HEAD(&tvcsa_active, csa, csa_active_link);
+    pthread_mutex_unlock(&tvcsa_active_mutex);
+  }
+  tvcsa_descramble0(csa, t, tsb, getmonoclock());
+}
+
+
+/**
+ * Benchmark
+ */
+#define TVCSA_BENCH_RATE 5000  /* Packets per second and service (~7.5Mbit) */
+#define TVCSA_BENCH_TIME 2     /* Simulated seconds per run */
+
+static void
+tvcsa_bench_output(struct service *t, const uint8_t *tsb)
+{
+}
+
+
+/**
+ *
+ */
+static void
+tvcsa_bench_run(int nsvc, int shared)
+{
+  tvcsa_t *csa = calloc(nsvc, sizeof(tvcsa_t));
+  uint8_t tsb[188], cw[16];
+  struct timespec ts0, ts1;
+  int64_t now = 0, npkts, lat = 0, pkts = 0, i;
+  int partial = 0;
+  double cpu;
+
+  memset(tsb, 0x55, sizeof(tsb));
+  tsb[0] = 0x47;
+  tsb[1] = 0x01;
+  tsb[2] = 0x00;
+  tsb[3] = 0x90; /* Even key, payload only */
+
+  for(i = 0; i < nsvc; i++) {
+    tvcsa_init(&csa[i]);
+    csa[i].csa_output = tvcsa_bench_output;
+    memset(cw, 0x11, sizeof(cw));
+    if(!shared)
+      cw[0] = cw[8] = i + 1;
+    tvcsa_set_control_words(&csa[i], cw, cw + 8);
+  }
+
+  npkts = (int64_t)TVCSA_BENCH_RATE * TVCSA_BENCH_TIME * nsvc;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts0);
+  for(i = 0; i < npkts; i++) {
+    now = i * 1000000LL / (TVCSA_BENCH_RATE * nsvc);
+    tvcsa_descramble0(&csa[i % nsvc], NULL, tsb, now + 1);
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts1);
+
+  cpu = (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9;
+
+  for(i = 0; i < nsvc; i++) {
+    lat += csa[i].csa_latency_sum;
+    pkts += csa[i].csa_packets;
+    partial += csa[i].csa_partial_flushes;
+    tvcsa_group_leave(&csa[i]);
+    free(csa[i].csa_ready);
+    free(csa[i].csa_out);
+  }
+  free(csa);
+
+  printf("%8d %8s %12.1f %12.2f %10d\n", nsvc, shared ? "shared" : "own",
+	 npkts * 188 * 8 / cpu / 1e6,
+	 pkts ? lat / pkts / 1000.0 : 0, partial);
+}
+
+
+/**
+ * Descramble simulated input for 1 .. maxservices services, with all
+ * services sharing one key set and with a key set each, and print
+ * throughput (Mbit/s per CPU second) against added latency
+ */
+void
+tvcsa_benchmark(int maxservices)
+{
+  int n;
+
+  printf("FFdecsa parallelism %d, suggested cluster size %d, "
+	 "%d packets/s per service\n",
+	 get_internal_parallelism(), get_suggested_cluster_size(),
+	 TVCSA_BENCH_RATE);
+  printf("%8s %8s %12s %12s %10s\n",
+	 "services", "keys", "Mbit/s/CPU", "latency ms", "partial");
+
+  for(n = 1; n <= maxservices; n++) {
+    tvcsa_bench_run(n, 1);
+    tvcsa_bench_run(n, 0);
+  }
+}
@@ -0,0 +1,104 @@
+/*
+ *  tvheadend, CSA descrambler buffering
+ *  Copyright (C) 2012
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TVCSA_H__
+#define TVCSA_H__
+
+struct service;
+struct tvcsa_group;
+
+/**
+ * Max time (in us) a packet may sit in a partially filled cluster
+ * before the cluster is descrambled anyway. FFdecsa is most efficient
+ * with full clusters, but for low bitrate services (radio, SD) filling
+ * a cluster can take seconds.
+ */
+#define TVCSA_MAX_DELAY 100000
+
+/**
+ * Size of a group's packet queue, in units of the FFdecsa suggested
+ * cluster size. A batch is never larger than one cluster, the rest
+ * holds packets decrypt_packets() leaves for the next round
+ */
+#define TVCSA_MAX_CLUSTERS 2
+
+/**
+ * Per service CSA descrambler state, used by the CSA based
+ * descramblers (cwc, capmt)
+ *
+ * Services with identical control words share a tvcsa_group and
+ * their packets are descrambled together in one batch. Packets
+ * descrambled on behalf of another service are parked in that
+ * service's csa_ready buffer and passed on the next time it
+ * calls tvcsa_descramble()
+ *
+ * All access must be done with s_stream_mutex held
+ */
+typedef struct tvcsa {
+
+  /* Where descrambled packets go, ts_recv_packet2() by default */
+  void (*csa_output)(struct service *t, const uint8_t *tsb);
+
+  /**
+   * Control words waiting to be loaded. They are only applied at a
+   * cluster boundary so packets already queued are descrambled with
+   * the key they were sent with.
+   */
+  uint8_t csa_cw[16];
+  int csa_pending_cw_update;
+
+  uint8_t csa_key[16];      /* Control words in effect */
+  struct tvcsa_group *csa_group;
+
+  /* Descrambled packets, protected by the group's mutex */
+  uint8_t *csa_ready;
+  int csa_ready_fill;
+  int csa_ready_size;
+
+  /* Swapped with csa_ready before the packets are passed on */
+  uint8_t *csa_out;
+  int csa_out_size;
+
+  /* Service being descrambled, set on the first packet. Services
+     are on tvcsa_active so queued packets are flushed when the input
+     stops delivering */
+  struct service *csa_service;
+  LIST_ENTRY(tvcsa) csa_active_link;
+
+  /* Statistics, protected by the group's mutex */
+
+  int64_t csa_latency_sum;  /* Sum of added latency (us) */
+  int64_t csa_packets;      /* Number of descrambled packets */
+  int csa_partial_flushes;  /* Clusters flushed before they were full */
+
+} tvcsa_t;
+
+void tvcsa_init(tvcsa_t *csa);
+
+void tvcsa_destroy(tvcsa_t *csa, struct service *t, const char *subsys);
+
+void tvcsa_set_control_words(tvcsa_t *csa, const uint8_t *even,
+			     const uint8_t *odd);
+
+void tvcsa_descramble(tvcsa_t *csa, struct service *t, const uint8_t *tsb);
+
+int tvcsa_average_latency(tvcsa_t *csa);
+
+void tvcsa_benchmark(int maxservices);
+
+#endif /* TVCSA_H__ */
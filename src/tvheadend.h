@@ -246,6 +246,14 @@ typedef enum {
    */
   SMT_NOSTART,
 
+  /**
+   * Playback position changed (timeshift)
+   *
+   * Packets already queued are from the old position. sm_code is
+   * the new distance to live in ms.
+   */
+  SMT_SKIP,
+
   /**
    * Raw MPEG TS data
    */
@@ -356,7 +364,37 @@ static inline unsigned int tvh_strhash(const char *s, unsigned int mod)
 void tvh_str_set(char **strp, const char *src);
 int tvh_str_update(char **strp, const char *src);
 
-void tvhlog(int severity, const char *subsys, const char *fmt, ...);
+void tvhlog0(int severity, const char *subsys, const char *fmt, ...);
+
+extern int tvhlog_level_min;
+extern int tvhlog_level_max;
+
+int tvhlog_subsys_level(const char *subsys);
+
+void tvhlog_comet_debug(int delta);
+
+void tvhlog_init(void);
+
+void tvhlog_stop(void);
+
+/**
+ * Check the log level before anything is formatted (or the arguments
+ * are even evaluated)
+ */
+static inline int
+tvhlog_enabled(int severity, const char *subsys)
+{
+  if(severity <= tvhlog_level_min)
+    return 1;
+  if(severity > tvhlog_level_max)
+    return 0;
+  return severity <= tvhlog_subsys_level(subsys);
+}
+
+#define tvhlog(severity, subsys, fmt...) do { \
+ if(tvhlog_enabled(severity, subsys)) \
+  tvhlog0(severity, subsys, fmt); \
+} while(0)
 
 void tvhlog_spawn(int severity, const char *subsys, const char *fmt, ...);
 
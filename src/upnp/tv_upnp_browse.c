@@ -19,19 +19,25 @@
 /*
  * upnp-Tree:
  *
- * root(0)  - liveTV(1)  - Channel_1(1001)
+ * root(0)  - liveTV(1)  - Channel_1(1000000+ch_id)
  *                           ...
- *                       - Channel_N(1000+N)
- *          - IPTV(2)    - Channel_1(2001)
+ *                       - Channel_N
+ *          - IPTV(2)
+ *          - Recs(3)    - File_1(2000000+de_id)
  *                           ...
- *                       - Channel_N(2000+N)
- *          - Recs(3)    - File_1(10001)
- *                           ...
- *                       - File_N(10000+N)
+ *                       - File_N
  *
  *  files should be the biggest amount
  *  treat dirs in rec(Recordings) as files
  *
+ *  Object ids are derived from the channel / dvr entry id so they stay
+ *  stable while the tree is updated from channel and dvr notifications.
+ *  All nodes are hashed on their id and containers keep their children
+ *  in an array, so a Browse costs O(RequestedCount) regardless of the
+ *  size of the tree. Every change bumps the SystemUpdateID.
+ *
+ *  The tree is protected by upnp_br_mutex since the upnp callbacks run
+ *  in libupnp's threads without global_lock.
  */
 
 #include "tvheadend.h"
@@ -40,9 +46,19 @@
 #include "tv_upnp_cfg.h"
 #include "dvr/dvr.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define UPNP_BR_ID_ROOT         0
+#define UPNP_BR_ID_LIVE         1
+#define UPNP_BR_ID_IPTV         2
+#define UPNP_BR_ID_RECS         3
+#define UPNP_BR_ID_CHANNEL_BASE 1000000
+#define UPNP_BR_ID_DVR_BASE     2000000
+
+#define UPNP_BR_HASH_SIZE       1024
+
 typedef struct upnp_br_leaf   upnp_br_leaf_t;
 typedef struct upnp_br_node   upnp_br_node_t;
 
@@ -70,10 +86,12 @@ nrAudioChannels=\"1\"
 
 struct upnp_br_node {
     upnp_br_node_t* parent;
-    upnp_br_node_t* prev_s;
-    upnp_br_node_t* next_s;
+    LIST_ENTRY(upnp_br_node) hash_link;
+
+    upnp_br_node_t** children;
     size_t child_count;
-    upnp_br_node_t* child1;
+    size_t child_alloc;
+    size_t child_idx;       // position in parent->children
 
     int id;
     int restr;
@@ -82,6 +100,9 @@ struct upnp_br_node {
 };
 
 static upnp_br_node_t* upnp_br_root = NULL;
+static LIST_HEAD(, upnp_br_node) upnp_br_hash[UPNP_BR_HASH_SIZE];
+static pthread_mutex_t upnp_br_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int upnp_br_update_id = 0;
 
 /*----------------------------------------------------------------------------*/
 
@@ -96,23 +117,24 @@ tvstring_t* prn_leaf_url2tvs( tvstring_t* server, unsigned short port, upnp_br_l
 tvstring_t* prn_leaf_attr2tvs( upnp_br_leaf_t* leaf );
 
 void append_as_child( upnp_br_node_t* parent, upnp_br_node_t* node );
+void remove_node( upnp_br_node_t* node );
+static int insert_child( upnp_br_node_t* parent, upnp_br_node_t* node, size_t idx );
+static void unlink_child( upnp_br_node_t* node );
 
 int is_leaf( upnp_br_node_t* node );
-upnp_br_node_t* find_node( int id, upnp_br_node_t* base );
+upnp_br_node_t* find_node( int id );
 
 /*----------------------------------------------------------------------------*/
 
+static void upnp_br_set_path( upnp_br_leaf_t* leaf, const char* path )
+{
+    snprintf( leaf->path, sizeof(leaf->path), "%s", path ?: "" );
+}
+
 upnp_br_node_t* new_node( const char* name, int id, int rest  ) {
-    upnp_br_node_t* nd = (upnp_br_node_t *)malloc(sizeof(upnp_br_node_t));
+    upnp_br_node_t* nd = (upnp_br_node_t *)calloc(1, sizeof(upnp_br_node_t));
     if( nd != NULL ) {
-        nd->parent = NULL;
-        nd->prev_s = NULL;
-        nd->next_s = NULL;
-        nd->child_count = 0;
-        nd->child1 = NULL;
-
-        strncpy( nd->name, name, sizeof(nd->name) );
-        nd->name[ sizeof(nd->name) - 1 ] = 0;
+        snprintf( nd->name, sizeof(nd->name), "%s", name ?: "" );
         nd->id = id;
         nd->restr = rest;
         nd->leaf = NULL;
@@ -124,47 +146,104 @@ upnp_br_node_t* new_leaf( const char* name, const char* path, int id, int rest
     upnp_br_node_t* nd = new_node( name, id, rest  );
     if( nd != NULL ) {
         nd->leaf = (upnp_br_leaf_t*) calloc(sizeof(upnp_br_leaf_t), 1);
+        if( nd->leaf != NULL )
+            upnp_br_set_path( nd->leaf, path );
     }
     return nd;
 }
 
-void append_as_child( upnp_br_node_t* parent, upnp_br_node_t* node )
+static void hash_node( upnp_br_node_t* node )
 {
-    upnp_br_node_t* prev = NULL;
+    LIST_INSERT_HEAD( &upnp_br_hash[node->id & (UPNP_BR_HASH_SIZE - 1)],
+                      node, hash_link );
+}
 
-    if( node == NULL )
-        return;
+/* Put node at position idx of parent's children */
+static int insert_child( upnp_br_node_t* parent, upnp_br_node_t* node, size_t idx )
+{
+    size_t i;
+
+    if( parent->child_count == parent->child_alloc ) {
+        size_t n = parent->child_alloc ? parent->child_alloc * 2 : 16;
+        upnp_br_node_t** c = realloc( parent->children, n * sizeof(upnp_br_node_t*) );
+        if( c == NULL )
+            return -1;
+        parent->children = c;
+        parent->child_alloc = n;
+    }
 
-    if( parent == NULL ) {
-        release_node( node );
-        return;
+    if( idx > parent->child_count )
+        idx = parent->child_count;
+
+    for( i = parent->child_count; i > idx; --i ) {
+        parent->children[i] = parent->children[i - 1];
+        parent->children[i]->child_idx = i;
     }
-    node->parent = parent;
 
+    node->parent = parent;
+    node->child_idx = idx;
+    parent->children[idx] = node;
     ++(parent->child_count);
-    prev = parent->child1;
-    while( prev != NULL ) {
-        if( prev->next_s == NULL )
-            break;
-        prev = prev->next_s;
+    return 0;
+}
+
+/* Take node out of its parent's children */
+static void unlink_child( upnp_br_node_t* node )
+{
+    upnp_br_node_t* parent = node->parent;
+    size_t i;
+
+    if( parent == NULL )
+        return;
+
+    --(parent->child_count);
+    for( i = node->child_idx; i < parent->child_count; ++i ) {
+        parent->children[i] = parent->children[i + 1];
+        parent->children[i]->child_idx = i;
     }
+    node->parent = NULL;
+}
 
-    if( prev == NULL ) {
-        parent->child1 = node;
-    } else {
-        prev->next_s = node;
-        node->prev_s = prev;
+void append_as_child( upnp_br_node_t* parent, upnp_br_node_t* node )
+{
+    if( node == NULL )
+        return;
+
+    if( parent == NULL ||
+        insert_child( parent, node, parent->child_count ) ) {
+        release_node( node );
+        return;
     }
+    hash_node( node );
+}
+
+/* Unlink node from its parent and the index, then free it */
+void remove_node( upnp_br_node_t* node )
+{
+    unlink_child( node );
+    release_node( node );
 }
 
 void release_node( upnp_br_node_t* node )
 {
-    //TODO
+    size_t i;
+
+    if( node == NULL )
+        return;
+
+    for( i = 0; i < node->child_count; ++i )
+        release_node( node->children[i] );
+
+    if( node->hash_link.le_prev != NULL )
+        LIST_REMOVE( node, hash_link );
+    release_leaf( node->leaf );
+    free( node->children );
+    free( node );
 }
 
 void release_leaf( upnp_br_leaf_t* leaf )
 {
-    //TODO
+    free( leaf );
 }
 
 /*
@@ -196,32 +275,36 @@ int is_leaf( upnp_br_node_t* node )
     return 1;
 }
 
-upnp_br_node_t* find_node( int id, upnp_br_node_t* base )
+upnp_br_node_t* find_node( int id )
 {
-    upnp_br_node_t* curr;
-    upnp_br_node_t* ret;
-    if( base == NULL ) return NULL;
-    if( base->id == id ) return base;
-    for(curr = base->child1; curr != NULL; curr = curr->next_s ) {
-        if( NULL != (ret = find_node( id, curr )) )
-            return ret;
-    }
+    upnp_br_node_t* nd;
+    LIST_FOREACH( nd, &upnp_br_hash[id & (UPNP_BR_HASH_SIZE - 1)], hash_link )
+        if( nd->id == id )
+            return nd;
     return NULL;
 }
 
 /*----------------------------------------------------------------------------*/
 
+static void upnp_br_rename( upnp_br_node_t* nd, const char* name )
+{
+    snprintf( nd->name, sizeof(nd->name), "%s", name ?: "" );
+}
+
 void tv_upnp_browse_tv_tree_init(void)
 {
     channel_t* ch = NULL;
-    int ch_curr = 1000;
     dvr_entry_t* de = NULL;
-    int rec_curr = 10000;
 
-    upnp_br_root = new_node( "Root", 0, 1 );
-    upnp_br_node_t* live = new_node( "liveTV", 1, 1 );
-    upnp_br_node_t* iptv = new_node( "IPTV", 2, 1 );
-    upnp_br_node_t* recs = new_node( "Recs", 3, 1 );
+    lock_assert(&global_lock);
+
+    pthread_mutex_lock( &upnp_br_mutex );
+
+    upnp_br_root = new_node( "Root", UPNP_BR_ID_ROOT, 1 );
+    hash_node( upnp_br_root );
+    upnp_br_node_t* live = new_node( "liveTV", UPNP_BR_ID_LIVE, 1 );
+    upnp_br_node_t* iptv = new_node( "IPTV", UPNP_BR_ID_IPTV, 1 );
+    upnp_br_node_t* recs = new_node( "Recs", UPNP_BR_ID_RECS, 1 );
 
     append_as_child( upnp_br_root, live );
     append_as_child( upnp_br_root, iptv );
@@ -229,53 +312,156 @@ void tv_upnp_browse_tv_tree_init(void)
 
     /* Send all channels */
     RB_FOREACH( ch, &channel_name_tree, ch_name_link ) {
-        upnp_br_node_t* ch_leaf = new_leaf( ch->ch_name, ch->ch_name, ++ch_curr, 1 ); // TODO: sdp
+        upnp_br_node_t* ch_leaf = new_leaf( ch->ch_name, ch->ch_name, UPNP_BR_ID_CHANNEL_BASE + ch->ch_id, 1 ); // TODO: sdp
         append_as_child( live, ch_leaf );
     }
 
 
     /* Send all DVR entries */
     LIST_FOREACH(de, &dvrentries, de_global_link) {
-        upnp_br_node_t* rec_leaf = new_leaf( de->de_title, de->de_filename, ++rec_curr, 1 );
+        upnp_br_node_t* rec_leaf = new_leaf( de->de_title, de->de_filename, UPNP_BR_ID_DVR_BASE + de->de_id, 1 );
         append_as_child( recs, rec_leaf );
     }
+
+    pthread_mutex_unlock( &upnp_br_mutex );
 }
 
 void tv_upnp_browse_tv_tree_release(void)
 {
+    pthread_mutex_lock( &upnp_br_mutex );
     release_node( upnp_br_root );
+    upnp_br_root = NULL;
+    pthread_mutex_unlock( &upnp_br_mutex );
+}
+
+unsigned int tv_upnp_browse_update_id(void)
+{
+    unsigned int id;
+    pthread_mutex_lock( &upnp_br_mutex );
+    id = upnp_br_update_id;
+    pthread_mutex_unlock( &upnp_br_mutex );
+    return id;
+}
+
+/*
+ * Incremental updates. Changes made before the tree is built are picked
+ * up by tv_upnp_browse_tv_tree_init()
+ *
+ * If 'sorted' is set the leaf is (re)positioned in front of the node
+ * 'next_id', or last if that does not exist, so the container keeps the
+ * order it was built in.
+ */
+
+static void upnp_br_leaf_set( int parent_id, int id, const char* name, const char* path,
+                              int sorted, int next_id )
+{
+    upnp_br_node_t *nd, *parent, *next;
+    size_t idx;
+
+    pthread_mutex_lock( &upnp_br_mutex );
+    if( upnp_br_root != NULL && (parent = find_node( parent_id )) != NULL ) {
+        if( (nd = find_node( id )) != NULL ) {
+            upnp_br_rename( nd, name );
+            if( nd->leaf != NULL && path != NULL )
+                upnp_br_set_path( nd->leaf, path );
+            if( sorted )
+                unlink_child( nd );
+        } else {
+            nd = new_leaf( name, path, id, 1 );
+            if( nd == NULL )
+                goto out;
+            hash_node( nd );
+        }
+
+        if( nd->parent == NULL ) {
+            next = sorted ? find_node( next_id ) : NULL;
+            idx = next != NULL && next->parent == parent ?
+                next->child_idx : parent->child_count;
+            if( insert_child( parent, nd, idx ) )
+                release_node( nd );
+        }
+        ++upnp_br_update_id;
+    }
+ out:
+    pthread_mutex_unlock( &upnp_br_mutex );
+}
+
+static void upnp_br_leaf_del( int id )
+{
+    upnp_br_node_t* nd;
+
+    pthread_mutex_lock( &upnp_br_mutex );
+    if( upnp_br_root != NULL && (nd = find_node( id )) != NULL ) {
+        remove_node( nd );
+        ++upnp_br_update_id;
+    }
+    pthread_mutex_unlock( &upnp_br_mutex );
+}
+
+void tv_upnp_browse_channel_update( channel_t* ch )
+{
+    /* Same order as channel_name_tree, like the initial build */
+    channel_t* next = RB_NEXT( ch, ch_name_link );
+
+    lock_assert(&global_lock);
+
+    upnp_br_leaf_set( UPNP_BR_ID_LIVE, UPNP_BR_ID_CHANNEL_BASE + ch->ch_id,
+                      ch->ch_name, ch->ch_name, 1,
+                      next != NULL ? UPNP_BR_ID_CHANNEL_BASE + next->ch_id : -1 );
+}
+
+void tv_upnp_browse_channel_delete( channel_t* ch )
+{
+    upnp_br_leaf_del( UPNP_BR_ID_CHANNEL_BASE + ch->ch_id );
+}
+
+void tv_upnp_browse_dvr_entry_update( dvr_entry_t* de )
+{
+    upnp_br_leaf_set( UPNP_BR_ID_RECS, UPNP_BR_ID_DVR_BASE + de->de_id,
+                      de->de_title, de->de_filename, 0, -1 );
 }
 
+void tv_upnp_browse_dvr_entry_delete( dvr_entry_t* de )
+{
+    upnp_br_leaf_del( UPNP_BR_ID_DVR_BASE + de->de_id );
+}
+
+/*----------------------------------------------------------------------------*/
+
 void tv_upnp_browse_tv_tree_node( tvstring_t* didl, int node_id, int children, int nd_start, int* nr_ret, int* nr_ttl )
 {
-    upnp_br_node_t* nd = find_node( node_id, upnp_br_root );
+    upnp_br_node_t* nd;
+
+    pthread_mutex_lock( &upnp_br_mutex );
+
+    nd = find_node( node_id );
 
     if( nd == NULL ) {
         (*nr_ttl) = 0;
         (*nr_ret) = 0;
-        return;
-    }
+    } else if( children ) {
+        size_t i, end, start = nd_start > 0 ? nd_start : 0;
 
-    if( children ) {
-        upnp_br_node_t* curr = NULL;
-        int i = 0;
-        if( is_leaf(nd) ) return;
-        if( (*nr_ret) < 1 )
-            (*nr_ret) = nd->child_count;
+        (*nr_ttl) = nd->child_count;
+        if( start > nd->child_count )
+            start = nd->child_count;
 
-        for(curr = nd->child1; (curr != NULL)&&(i < nd_start + (*nr_ret) ); curr = curr->next_s, ++i ) {
-            tv_upnp_browse_node2xml( didl, curr );
-        }
-        if(!children) {
-            (*nr_ret) = i - nd_start;
-            (*nr_ttl) = nd->child_count;
-        }
+        // RequestedCount 0 means all
+        end = nd->child_count;
+        if( (*nr_ret) > 0 && start + (*nr_ret) < end )
+            end = start + (*nr_ret);
+
+        for( i = start; i < end; ++i )
+            tv_upnp_browse_node2xml( didl, nd->children[i] );
+        (*nr_ret) = end - start;
 
     } else {
         tv_upnp_browse_node2xml( didl, nd );
         (*nr_ttl) = 1;
         (* nr_ret) = 1;
     }
+
+    pthread_mutex_unlock( &upnp_br_mutex );
 }
 
 void tv_upnp_browse_node2xml( tvstring_t* xml, upnp_br_node_t* node )
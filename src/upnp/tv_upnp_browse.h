@@ -21,9 +21,19 @@
 
 #include "tvstring.h"
 
+struct channel;
+struct dvr_entry;
+
 void tv_upnp_browse_tv_tree_init(void);
 void tv_upnp_browse_tv_tree_release(void);
 
+unsigned int tv_upnp_browse_update_id(void);
+
+void tv_upnp_browse_channel_update( struct channel* ch );
+void tv_upnp_browse_channel_delete( struct channel* ch );
+void tv_upnp_browse_dvr_entry_update( struct dvr_entry* de );
+void tv_upnp_browse_dvr_entry_delete( struct dvr_entry* de );
+
 void tv_upnp_browse_tv_tree_node( tvstring_t* didl, int node_id, int children, int nd_start, int* nr_ret, int* nr_ttl );
 
 #endif /* TV_UPNP_BROWSW_H_ */
@@ -178,7 +178,10 @@ int upnp_act_browse( struct Upnp_Action_Request* uar )
     tvs_cat_int( res, nr_ttl );
     tvs_cat( res,
             "</TotalMatches> "
-            "<UpdateID>0</UpdateID> "
+            "<UpdateID>" );
+    tvs_cat_int( res, tv_upnp_browse_update_id() );
+    tvs_cat( res,
+            "</UpdateID> "
             "</u:BrowseResponse>" );
 
     ixmlParseBufferEx( res->c_str,&(uar->ActionResult));
@@ -208,5 +211,16 @@ int upnp_act_get_sort_caps( struct Upnp_Action_Request* uar )
 
 int upnp_act_get_sys_upd_ID( struct Upnp_Action_Request* uar )
 {
+    tvstring_t* res = tvs_newp(
+            "<u:GetSystemUpdateIDResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+            "<Id>" );
+    tvs_cat_int( res, tv_upnp_browse_update_id() );
+    tvs_cat( res,
+            "</Id>"
+            "</u:GetSystemUpdateIDResponse>" );
+
+    ixmlParseBufferEx( res->c_str,&(uar->ActionResult));
+    tvs_del( &res );
+
     return UPNP_E_SUCCESS;
 }
@@ -64,6 +64,9 @@ cmb_destroy(comet_mailbox_t *cmb)
 {
   mbdebug("mailbox[%s]: destroyed\n", cmb->cmb_boxid);
 
+  if(cmb->cmb_debug)
+    tvhlog_comet_debug(-1);
+
   if(cmb->cmb_messages != NULL)
     htsmsg_destroy(cmb->cmb_messages);
 
@@ -243,6 +246,7 @@ comet_mailbox_dbg(http_connection_t *hc, const char *remain, void *opaque)
     if(!strcmp(cmb->cmb_boxid, cometid)) {
       char buf[64];
       cmb->cmb_debug = !cmb->cmb_debug;
+      tvhlog_comet_debug(cmb->cmb_debug ? 1 : -1);
  
       if(cmb->cmb_messages == NULL)
 	cmb->cmb_messages = htsmsg_create_list();
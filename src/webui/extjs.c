@@ -25,6 +25,7 @@
 #include <stdarg.h>
 
 #include <arpa/inet.h>
+#include <sys/stat.h>
 
 #include "htsmsg.h"
 #include "htsmsg_json.h"
@@ -213,7 +214,8 @@ extjs_tablemgr(http_connection_t *hc, const char *remain, void *opaque)
 {
   htsbuf_queue_t *hq = &hc->hc_reply;
   dtable_t *dt;
-  htsmsg_t *out = NULL, *in, *array;
+  htsmsg_t *out = NULL, *in, *array = NULL;
+  json_writer_t jw;
 
   const char *tablename = http_arg_get(&hc->hc_req_args, "table");
   const char *op        = http_arg_get(&hc->hc_req_args, "op");
@@ -241,9 +243,6 @@ extjs_tablemgr(http_connection_t *hc, const char *remain, void *opaque)
   } else if(!strcmp(op, "get")) {
     array = dtable_record_get_all(dt);
 
-    out = htsmsg_create_map();
-    htsmsg_add_msg(out, "entries", array);
-
   } else if(!strcmp(op, "update")) {
     if(http_access_verify(hc, dt->dt_dtc->dtc_write_access))
       goto noaccess;
@@ -277,6 +276,14 @@ extjs_tablemgr(http_connection_t *hc, const char *remain, void *opaque)
   if(in != NULL)
     htsmsg_destroy(in);
 
+  if(array != NULL) {
+    json_writer_init(&jw, hq);
+    json_begin_map(&jw, NULL);
+    json_add_msg(&jw, "entries", array);
+    json_end_map(&jw);
+    htsmsg_destroy(array);
+  }
+
   if(out != NULL) {
     htsmsg_json_serialize(out, hq, 0);
     htsmsg_destroy(out);
@@ -286,6 +293,16 @@ extjs_tablemgr(http_connection_t *hc, const char *remain, void *opaque)
 }
 
 
+/**
+ *
+ */
+static char *
+extjs_strdup(const char *s)
+{
+  return s != NULL ? strdup(s) : NULL;
+}
+
+
 /**
  *
  */
@@ -345,6 +362,21 @@ extjs_channels_update(htsmsg_t *in)
   }
 }
 
+/**
+ * Channel rows copied out under global_lock, formatted without it
+ */
+typedef struct extjs_channel_row {
+  char *name;
+  char *xmltvsrc;
+  char *icon;
+  char *tags;
+  int chid;
+  int pre;
+  int post;
+  int number;
+} extjs_channel_row_t;
+
+
 /**
  *
  */
@@ -352,10 +384,12 @@ static int
 extjs_channels(http_connection_t *hc, const char *remain, void *opaque)
 {
   htsbuf_queue_t *hq = &hc->hc_reply;
-  htsmsg_t *array, *c;
+  json_writer_t jw;
+  extjs_channel_row_t *rows = NULL, *r;
   channel_t *ch;
   char buf[1024];
   channel_tag_mapping_t *ctm;
+  int i, n = 0;
   const char *op        = http_arg_get(&hc->hc_req_args, "op");
   const char *entries   = http_arg_get(&hc->hc_req_args, "entries");
 
@@ -365,40 +399,34 @@ extjs_channels(http_connection_t *hc, const char *remain, void *opaque)
   htsmsg_autodtor(in) =
     entries != NULL ? htsmsg_json_deserialize(entries) : NULL;
 
-  htsmsg_autodtor(out) = htsmsg_create_map();
-
-  scopedgloballock();
+  pthread_mutex_lock(&global_lock);
 
   if(!strcmp(op, "list")) {
-    array = htsmsg_create_list();
+    RB_FOREACH(ch, &channel_name_tree, ch_name_link)
+      n++;
 
-    RB_FOREACH(ch, &channel_name_tree, ch_name_link) {
-      c = htsmsg_create_map();
-      htsmsg_add_str(c, "name", ch->ch_name);
-      htsmsg_add_u32(c, "chid", ch->ch_id);
-      
-      if(ch->ch_xc != NULL)
-	htsmsg_add_str(c, "xmltvsrc", ch->ch_xc->xc_displayname);
-
-      if(ch->ch_icon != NULL)
-        htsmsg_add_str(c, "ch_icon", ch->ch_icon);
+    rows = calloc(MAX(1, n), sizeof(extjs_channel_row_t));
+    r = rows;
 
+    RB_FOREACH(ch, &channel_name_tree, ch_name_link) {
       buf[0] = 0;
       LIST_FOREACH(ctm, &ch->ch_ctms, ctm_channel_link) {
 	snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
 		 "%s%d", strlen(buf) == 0 ? "" : ",",
 		 ctm->ctm_tag->ct_identifier);
       }
-      htsmsg_add_str(c, "tags", buf);
 
-      htsmsg_add_s32(c, "epg_pre_start", ch->ch_dvr_extra_time_pre);
-      htsmsg_add_s32(c, "epg_post_end",  ch->ch_dvr_extra_time_post);
-      htsmsg_add_s32(c, "number",        ch->ch_number);
-
-      htsmsg_add_msg(array, NULL, c);
+      r->name     = strdup(ch->ch_name);
+      r->xmltvsrc = ch->ch_xc != NULL ?
+	strdup(ch->ch_xc->xc_displayname) : NULL;
+      r->icon     = extjs_strdup(ch->ch_icon);
+      r->tags     = strdup(buf);
+      r->chid     = ch->ch_id;
+      r->pre      = ch->ch_dvr_extra_time_pre;
+      r->post     = ch->ch_dvr_extra_time_post;
+      r->number   = ch->ch_number;
+      r++;
     }
-    
-    htsmsg_add_msg(out, "entries", array);
 
   } else if(!strcmp(op, "delete") && in != NULL) {
     extjs_channels_delete(in);
@@ -407,10 +435,40 @@ extjs_channels(http_connection_t *hc, const char *remain, void *opaque)
     extjs_channels_update(in);
      
   } else {
+    pthread_mutex_unlock(&global_lock);
     return 400;
   }
 
-  htsmsg_json_serialize(out, hq, 0);
+  pthread_mutex_unlock(&global_lock);
+
+  json_writer_init(&jw, hq);
+  json_begin_map(&jw, NULL);
+
+  if(rows != NULL) {
+    json_begin_list(&jw, "entries");
+
+    for(i = 0, r = rows; i < n; i++, r++) {
+      json_begin_map(&jw, NULL);
+      json_add_str(&jw, "name", r->name);
+      json_add_s64(&jw, "chid", r->chid);
+      json_add_str(&jw, "xmltvsrc", r->xmltvsrc);
+      json_add_str(&jw, "ch_icon", r->icon);
+      json_add_str(&jw, "tags", r->tags);
+      json_add_s64(&jw, "epg_pre_start", r->pre);
+      json_add_s64(&jw, "epg_post_end", r->post);
+      json_add_s64(&jw, "number", r->number);
+      json_end_map(&jw);
+
+      free(r->name);
+      free(r->xmltvsrc);
+      free(r->icon);
+      free(r->tags);
+    }
+    json_end_list(&jw);
+    free(rows);
+  }
+
+  json_end_map(&jw);
   http_output_content(hc, "text/x-json; charset=UTF-8");
   return 0;
 }
@@ -650,6 +708,27 @@ extjs_confignames(http_connection_t *hc, const char *remain, void *opaque)
 
 }
 
+/**
+ * EPG rows copied out under global_lock, formatted without it
+ */
+typedef struct extjs_epg_row {
+  char *channel;
+  char *chicon;
+  char *title;
+  char *description;
+  char *episode;
+  char *ext_desc;
+  char *ext_item;
+  char *ext_text;
+  const char *contentgrp;
+  const char *schedstate;
+  int chid;
+  uint32_t id;
+  time_t start;
+  time_t stop;
+} extjs_epg_row_t;
+
+
 /**
  *
  */
@@ -657,10 +736,12 @@ static int
 extjs_epg(http_connection_t *hc, const char *remain, void *opaque)
 {
   htsbuf_queue_t *hq = &hc->hc_reply;
-  htsmsg_t *out, *array, *m;
+  json_writer_t jw;
   epg_query_result_t eqr;
+  extjs_epg_row_t *rows, *r;
+  dvr_entry_t *de;
   event_t *e;
-  int start = 0, end, limit, i;
+  int start = 0, end, limit, i, total;
   const char *s;
   const char *channel = http_arg_get(&hc->hc_req_args, "channel");
   const char *tag     = http_arg_get(&hc->hc_req_args, "tag");
@@ -678,76 +759,88 @@ extjs_epg(http_connection_t *hc, const char *remain, void *opaque)
   else
     limit = 20; /* XXX */
 
-  out = htsmsg_create_map();
-  array = htsmsg_create_list();
-
   pthread_mutex_lock(&global_lock);
 
   epg_query(&eqr, channel, tag, cgrp, title);
 
   epg_query_sort(&eqr);
 
-  htsmsg_add_u32(out, "totalCount", eqr.eqr_entries);
-
+  total = eqr.eqr_entries;
+  start = MAX(0, MIN(start, total));
+  end = MAX(start, MIN(start + limit, total));
 
-  start = MIN(start, eqr.eqr_entries);
-  end = MIN(start + limit, eqr.eqr_entries);
-
-  for(i = start; i < end; i++) {
-    const char *s;
+  rows = calloc(MAX(1, end - start), sizeof(extjs_epg_row_t));
 
+  for(i = start, r = rows; i < end; i++, r++) {
     e = eqr.eqr_array[i];
 
-    m = htsmsg_create_map();
-
     if(e->e_channel != NULL) {
-      htsmsg_add_str(m, "channel", e->e_channel->ch_name);
-      htsmsg_add_u32(m, "channelid", e->e_channel->ch_id);
-      if(e->e_channel->ch_icon != NULL)
-	htsmsg_add_str(m, "chicon", e->e_channel->ch_icon);
+      r->channel = strdup(e->e_channel->ch_name);
+      r->chicon  = extjs_strdup(e->e_channel->ch_icon);
+      r->chid    = e->e_channel->ch_id;
     }
 
-    if(e->e_title != NULL)
-      htsmsg_add_str(m, "title", e->e_title);
+    r->title       = extjs_strdup(e->e_title);
+    r->description = extjs_strdup(e->e_desc);
+    r->episode     = extjs_strdup(e->e_episode.ee_onscreen);
+    r->ext_desc    = extjs_strdup(e->e_ext_desc);
+    r->ext_item    = extjs_strdup(e->e_ext_item);
+    r->ext_text    = extjs_strdup(e->e_ext_text);
+    r->contentgrp  = epg_content_group_get_name(e->e_content_type);
+    r->id          = e->e_id;
+    r->start       = e->e_start;
+    r->stop        = e->e_stop;
 
-    if(e->e_desc != NULL)
-      htsmsg_add_str(m, "description", e->e_desc);
-
-    if(e->e_episode.ee_onscreen != NULL)
-      htsmsg_add_str(m, "episode", e->e_episode.ee_onscreen);
+    if((de = dvr_entry_find_by_event(e)) != NULL)
+      r->schedstate = dvr_entry_schedstatus(de);
+  }
 
-    if(e->e_ext_desc != NULL)
-      htsmsg_add_str(m, "ext_desc", e->e_ext_desc);
+  epg_query_free(&eqr);
 
-    if(e->e_ext_item != NULL)
-      htsmsg_add_str(m, "ext_item", e->e_ext_item);
+  pthread_mutex_unlock(&global_lock);
 
-    if(e->e_ext_text != NULL)
-      htsmsg_add_str(m, "ext_text", e->e_ext_text);
+  json_writer_init(&jw, hq);
+  json_begin_map(&jw, NULL);
+  json_add_s64(&jw, "totalCount", total);
+  json_begin_list(&jw, "entries");
 
-    htsmsg_add_u32(m, "id", e->e_id);
-    htsmsg_add_u32(m, "start", e->e_start);
-    htsmsg_add_u32(m, "end", e->e_stop);
-    htsmsg_add_u32(m, "duration", e->e_stop - e->e_start);
-    
-    if((s = epg_content_group_get_name(e->e_content_type)) != NULL)
-      htsmsg_add_str(m, "contentgrp", s);
+  for(i = start, r = rows; i < end; i++, r++) {
+    json_begin_map(&jw, NULL);
 
-    dvr_entry_t *de;
-    if((de = dvr_entry_find_by_event(e)) != NULL)
-      htsmsg_add_str(m, "schedstate", dvr_entry_schedstatus(de));
+    if(r->channel != NULL) {
+      json_add_str(&jw, "channel", r->channel);
+      json_add_s64(&jw, "channelid", r->chid);
+      json_add_str(&jw, "chicon", r->chicon);
+    }
 
-    htsmsg_add_msg(array, NULL, m);
+    json_add_str(&jw, "title", r->title);
+    json_add_str(&jw, "description", r->description);
+    json_add_str(&jw, "episode", r->episode);
+    json_add_str(&jw, "ext_desc", r->ext_desc);
+    json_add_str(&jw, "ext_item", r->ext_item);
+    json_add_str(&jw, "ext_text", r->ext_text);
+    json_add_s64(&jw, "id", r->id);
+    json_add_s64(&jw, "start", r->start);
+    json_add_s64(&jw, "end", r->stop);
+    json_add_s64(&jw, "duration", r->stop - r->start);
+    json_add_str(&jw, "contentgrp", r->contentgrp);
+    json_add_str(&jw, "schedstate", r->schedstate);
+    json_end_map(&jw);
+
+    free(r->channel);
+    free(r->chicon);
+    free(r->title);
+    free(r->description);
+    free(r->episode);
+    free(r->ext_desc);
+    free(r->ext_item);
+    free(r->ext_text);
   }
 
-  epg_query_free(&eqr);
-
-  pthread_mutex_unlock(&global_lock);
-
-  htsmsg_add_msg(out, "entries", array);
+  json_end_list(&jw);
+  json_end_map(&jw);
+  free(rows);
 
-  htsmsg_json_serialize(out, hq, 0);
-  htsmsg_destroy(out);
   http_output_content(hc, "text/x-json; charset=UTF-8");
   return 0;
 }
@@ -980,6 +1073,27 @@ extjs_dvr(http_connection_t *hc, const char *remain, void *opaque)
 }
 
 
+/**
+ * DVR rows copied out under global_lock, formatted without it
+ */
+typedef struct extjs_dvr_row {
+  char *channel;
+  char *chicon;
+  char *config_name;
+  char *title;
+  char *description;
+  char *episode;
+  char *creator;
+  char *filename;     /* Only for completed recordings */
+  const char *pri;
+  const char *status;
+  const char *schedstate;
+  int id;
+  time_t start;
+  time_t stop;
+} extjs_dvr_row_t;
+
+
 /**
  *
  */
@@ -987,12 +1101,14 @@ static int
 extjs_dvrlist(http_connection_t *hc, const char *remain, void *opaque)
 {
   htsbuf_queue_t *hq = &hc->hc_reply;
-  htsmsg_t *out, *array, *m;
+  json_writer_t jw;
   dvr_query_result_t dqr;
   dvr_entry_t *de;
-  int start = 0, end, limit, i;
+  extjs_dvr_row_t *rows, *r;
+  int start = 0, end, limit, i, total;
   const char *s;
-  off_t fsize;
+  struct stat st;
+  char url[100];
 
   if((s = http_arg_get(&hc->hc_req_args, "start")) != NULL)
     start = atoi(s);
@@ -1009,77 +1125,88 @@ extjs_dvrlist(http_connection_t *hc, const char *remain, void *opaque)
     return HTTP_STATUS_UNAUTHORIZED;
   }
 
-  out = htsmsg_create_map();
-  array = htsmsg_create_list();
-
-
   dvr_query(&dqr);
 
   dvr_query_sort(&dqr);
 
-  htsmsg_add_u32(out, "totalCount", dqr.dqr_entries);
+  total = dqr.dqr_entries;
+  start = MAX(0, MIN(start, total));
+  end = MAX(start, MIN(start + limit, total));
 
-  start = MIN(start, dqr.dqr_entries);
-  end = MIN(start + limit, dqr.dqr_entries);
+  rows = calloc(MAX(1, end - start), sizeof(extjs_dvr_row_t));
 
-  for(i = start; i < end; i++) {
+  for(i = start, r = rows; i < end; i++, r++) {
     de = dqr.dqr_array[i];
 
-    m = htsmsg_create_map();
-
     if(de->de_channel != NULL) {
-      htsmsg_add_str(m, "channel", de->de_channel->ch_name);
-      if(de->de_channel->ch_icon != NULL)
-	htsmsg_add_str(m, "chicon", de->de_channel->ch_icon);
-    }
-
-    htsmsg_add_str(m, "config_name", de->de_config_name);
-
-    if(de->de_title != NULL)
-      htsmsg_add_str(m, "title", de->de_title);
-
-    if(de->de_desc != NULL)
-      htsmsg_add_str(m, "description", de->de_desc);
-
-    if(de->de_episode.ee_onscreen)
-      htsmsg_add_str(m, "episode", de->de_episode.ee_onscreen);
-
-    htsmsg_add_u32(m, "id", de->de_id);
-    htsmsg_add_u32(m, "start", de->de_start);
-    htsmsg_add_u32(m, "end", de->de_stop);
-    htsmsg_add_u32(m, "duration", de->de_stop - de->de_start);
-    
-    htsmsg_add_str(m, "creator", de->de_creator);
-
-    htsmsg_add_str(m, "pri", dvr_val2pri(de->de_pri));
-
-    htsmsg_add_str(m, "status", dvr_entry_status(de));
-    htsmsg_add_str(m, "schedstate", dvr_entry_schedstatus(de));
-
-
-    if(de->de_sched_state == DVR_COMPLETED) {
-      fsize = dvr_get_filesize(de);
-      if(fsize > 0) {
-	char url[100];
-	htsmsg_add_s64(m, "filesize", fsize);
-
-	snprintf(url, sizeof(url), "dvrfile/%d", de->de_id);
-	htsmsg_add_str(m, "url", url);
-      }
+      r->channel = strdup(de->de_channel->ch_name);
+      r->chicon  = extjs_strdup(de->de_channel->ch_icon);
     }
 
-
-    htsmsg_add_msg(array, NULL, m);
+    r->config_name = strdup(de->de_config_name);
+    r->title       = extjs_strdup(de->de_title);
+    r->description = extjs_strdup(de->de_desc);
+    r->episode     = extjs_strdup(de->de_episode.ee_onscreen);
+    r->creator     = strdup(de->de_creator);
+    r->pri         = dvr_val2pri(de->de_pri);
+    r->status      = dvr_entry_status(de);
+    r->schedstate  = dvr_entry_schedstatus(de);
+    r->id          = de->de_id;
+    r->start       = de->de_start;
+    r->stop        = de->de_stop;
+
+    if(de->de_sched_state == DVR_COMPLETED)
+      r->filename = extjs_strdup(de->de_filename);
   }
 
   dvr_query_free(&dqr);
 
   pthread_mutex_unlock(&global_lock);
 
-  htsmsg_add_msg(out, "entries", array);
+  json_writer_init(&jw, hq);
+  json_begin_map(&jw, NULL);
+  json_add_s64(&jw, "totalCount", total);
+  json_begin_list(&jw, "entries");
+
+  for(i = start, r = rows; i < end; i++, r++) {
+    json_begin_map(&jw, NULL);
+    json_add_str(&jw, "channel", r->channel);
+    json_add_str(&jw, "chicon", r->chicon);
+    json_add_str(&jw, "config_name", r->config_name);
+    json_add_str(&jw, "title", r->title);
+    json_add_str(&jw, "description", r->description);
+    json_add_str(&jw, "episode", r->episode);
+    json_add_s64(&jw, "id", r->id);
+    json_add_s64(&jw, "start", r->start);
+    json_add_s64(&jw, "end", r->stop);
+    json_add_s64(&jw, "duration", r->stop - r->start);
+    json_add_str(&jw, "creator", r->creator);
+    json_add_str(&jw, "pri", r->pri);
+    json_add_str(&jw, "status", r->status);
+    json_add_str(&jw, "schedstate", r->schedstate);
+
+    /* stat() the recording without holding global_lock */
+    if(r->filename != NULL && !stat(r->filename, &st) && st.st_size > 0) {
+      json_add_s64(&jw, "filesize", st.st_size);
+      snprintf(url, sizeof(url), "dvrfile/%d", r->id);
+      json_add_str(&jw, "url", url);
+    }
+    json_end_map(&jw);
+
+    free(r->channel);
+    free(r->chicon);
+    free(r->config_name);
+    free(r->title);
+    free(r->description);
+    free(r->episode);
+    free(r->creator);
+    free(r->filename);
+  }
+
+  json_end_list(&jw);
+  json_end_map(&jw);
+  free(rows);
 
-  htsmsg_json_serialize(out, hq, 0);
-  htsmsg_destroy(out);
   http_output_content(hc, "text/x-json; charset=UTF-8");
   return 0;
 }
@@ -30,6 +30,8 @@
 #include "epg.h"
 #include "xmltv.h"
 #include "psi.h"
+#include "settings.h"
+#include "mempool.h"
 #if ENABLE_LINUXDVB
 #include "dvr/dvr.h"
 #include "dvb/dvb.h"
@@ -151,6 +153,39 @@ dumpdvbadapters(htsbuf_queue_t *hq)
 }
 #endif
 
+static void
+dumpsettings(htsbuf_queue_t *hq)
+{
+  int saves, coalesced, written;
+
+  outputtitle(hq, 0, "Settings");
+
+  hts_settings_get_stats(&saves, &coalesced, &written);
+  htsbuf_qprintf(hq,
+		 "  saves = %d\n"
+		 "  coalesced = %d\n"
+		 "  written = %d\n",
+		 saves, coalesced, written);
+}
+
+
+static void
+dumpmempools(htsbuf_queue_t *hq)
+{
+  mempool_stats_t v[16];
+  int i, n;
+
+  outputtitle(hq, 0, "Memory pools");
+
+  n = mempool_get_stats(v, 16);
+  for(i = 0; i < n; i++)
+    htsbuf_qprintf(hq,
+		   "  %-20s %6zd bytes: live = %d, peak = %d, allocated = %d\n",
+		   v[i].mps_name, v[i].mps_size, v[i].mps_live,
+		   v[i].mps_peak, v[i].mps_total);
+}
+
+
 int
 page_statedump(http_connection_t *hc, const char *remain, void *opaque)
 {
@@ -184,6 +219,10 @@ page_statedump(http_connection_t *hc, const char *remain, void *opaque)
 		 tvh_binshasum[18],
 		 tvh_binshasum[19]);
 
+  dumpsettings(hq);
+
+  dumpmempools(hq);
+
   dumpchannels(hq);
   
 #if ENABLE_LINUXDVB
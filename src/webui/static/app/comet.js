@@ -13,7 +13,8 @@ Ext.extend(tvheadend.Comet = function() {
 	autorec: true,
 	dvrdb: true,
         dvrconfig: true,
-	channels: true
+	channels: true,
+	serviceprobe: true
     });
 }, Ext.util.Observable);
 
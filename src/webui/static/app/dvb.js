@@ -1032,6 +1032,23 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
     });
 
 
+    var probeTemplate = new Ext.XTemplate(
+	'<tpl if="active != 0 || queued != 0">' +
+	    'Probing {active} services, {queued} queued<br>' +
+	    '{done} done ({rate} services/minute)' +
+	    '</tpl>'
+    );
+
+    var probeStatus = new Ext.Panel({
+	border: false,
+	style:'margin:5px'
+    });
+
+    tvheadend.comet.on('serviceprobe', function(m) {
+	if(probeStatus.body)
+	    probeTemplate.overwrite(probeStatus.body, m);
+    });
+
     /* Tool panel */
 
     var toolpanel = new Ext.Panel({
@@ -1046,7 +1063,8 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
 
 	items: [
 	    addMuxByLocationBtn,
-	    serviceScanBtn
+	    serviceScanBtn,
+	    probeStatus
 	]
     });
 
@@ -1055,7 +1073,7 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
     var confreader = new Ext.data.JsonReader({
 	root: 'dvbadapters'
     }, ['name', 'automux', 'idlescan', 'diseqcversion', 'qmon',
-	'dumpmux', 'nitoid']);
+	'dumpmux', 'swsections', 'nitoid']);
 
     
     function saveConfForm () {
@@ -1084,6 +1102,10 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
 	    fieldLabel: 'Monitor signal quality',
 	    name: 'qmon'
 	}),
+	new Ext.form.Checkbox({
+	    fieldLabel: 'Software section filtering',
+	    name: 'swsections'
+	}),
 	new Ext.form.Checkbox({
 	    fieldLabel: 'Write full DVB MUX to disk',
 	    name: 'dumpmux',
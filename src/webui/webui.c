@@ -36,6 +36,8 @@
 #include "dvr/dvr.h"
 #include "filebundle.h"
 #include "psi.h"
+#include "subscriptions.h"
+#include "htsmsg_json.h"
 
 struct filebundle *filebundles;
 
@@ -220,6 +222,9 @@ http_stream_run(http_connection_t *hc, streaming_queue_t *sq)
       run = 0;
       break;
 
+    case SMT_SKIP:
+      break;
+
     case SMT_MPEGTS:
       run = (write(hc->hc_fd, sm->sm_data, 188) == 188);
       break;
@@ -671,6 +676,20 @@ favicon(http_connection_t *hc, const char *remain, void *opaque)
 
 int page_statedump(http_connection_t *hc, const char *remain, void *opaque);
 
+/**
+ * Zap time histograms (ms) as JSON
+ */
+static int
+page_zapstats(http_connection_t *hc, const char *remain, void *opaque)
+{
+  htsmsg_t *m = subscription_zap_stats();
+
+  htsmsg_json_serialize(m, &hc->hc_reply, 0);
+  htsmsg_destroy(m);
+  http_output_content(hc, "text/x-json; charset=UTF-8");
+  return 0;
+}
+
 /**
  * WEB user interface
  */
@@ -685,6 +704,8 @@ webui_init(const char *contentpath)
 
   http_path_add("/state", NULL, page_statedump, ACCESS_ADMIN);
 
+  http_path_add("/zapstats", NULL, page_zapstats, ACCESS_ADMIN);
+
   http_path_add("/stream",  NULL, http_stream,  ACCESS_STREAMING);
 
   webui_static_content(contentpath, "/static",        "src/webui/static");